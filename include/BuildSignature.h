@@ -12,8 +12,11 @@
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/TypeBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Dominators.h"
 #include "HashBuilder.h"
 #include <cstdio>
+#include <functional>
+#include <map>
 
 using namespace llvm;
 
@@ -26,6 +29,8 @@ typedef enum {
 // SImple: Set Implementation
 class SImple {
 public:
+  virtual ~SImple() {}
+
   virtual Value* allocateLocal(IRBuilder<> Builder) = 0;
   virtual Value* allocateGlobal(IRBuilder<> Builder) = 0;
   virtual Value* allocateHeap(IRBuilder<> Builder) {
@@ -47,8 +52,147 @@ public:
   //If not implemented, always return a constant int 0;
     return Builder.getInt32(0);
   }
+
+  /// Whether the set's checks should skip work with control flow (range
+  /// guards) or evaluate everything and combine the results with select,
+  /// which leaves the CFG of instrumented loops intact. Inline checks are
+  /// cheap enough to prefer the latter; sets that call into the runtime for
+  /// every check are not.
+  virtual bool prefersPredicatedChecks() { return true; }
+
+  /// Emit this set's own checks without branches, or with them.
+  virtual void setPredicatedChecks(bool predicated) {}
+
+  /// Whether inserts can be collected in a private copy from allocateLocal
+  /// and folded into the set later by mergeSignature. Inserting into a copy
+  /// that only one loop touches leaves that loop with a plain OR reduction
+  /// if the signature fits a register, which the loop vectorizer handles,
+  /// and with stores to a private array that nothing else aliases if not.
+  virtual bool isMergeable() { return false; }
+
+  /// OR the private copy Other into Signature.
+  virtual void mergeSignature(IRBuilder<> Builder, Value *Signature,
+                              Value *Other) {}
+
+  /// Whether an address stays a member until the set is cleared, so an
+  /// insert or check that an earlier one covers can be elided
+  /// (-number-addresses, -granularity).
+  virtual bool keepsMembers() { return true; }
+
+  /// Make the set track 1 << shift byte granules itself, keying on the
+  /// addresses it is given. Returns false if it does not support it, in
+  /// which case it is handed granule numbers instead (see toGranule). Sets
+  /// whose runtime also sees raw addresses, as the cuckoo filters' free
+  /// hook does, must take it.
+  virtual bool takeGranularity(int shift) { return false; }
+
+  // Checks against several sets ==========================================
+
+  /// Sets made by the same SImpleFactory call with the same hash family
+  /// index an address identically, so one hash of it serves all of them.
+  void setHashFamily(const std::string &family) { hashFamily = family; }
+  bool sharesHashesWith(SImple *Other) {
+    return !hashFamily.empty() && hashFamily == Other->hashFamily
+      && getName() == Other->getName();
+  }
+
+  /// Check V against each of Signs, signatures of sets that share their
+  /// hashes with this one, and return the i32 result for each. By default
+  /// they are checked one at a time.
+  virtual std::vector<Value*> checkMembershipMulti(IRBuilder<> Builder,
+      const std::vector<Value*> &Signs, Value *V);
+
+  // Ranges (see -summarize-ranges) ========================================
+
+  /// Whether insertRange and checkRange beat inserting or checking the
+  /// addresses one at a time, so a loop's affine accesses are worth
+  /// summarizing.
+  virtual bool supportsRanges() { return false; }
+
+  /// Insert the Count (i64, at least 1) addresses First, First + Stride,
+  /// ..., where Stride is a positive i64 number of bytes. By default this
+  /// emits a loop over them, so Builder may be left in a split block.
+  /// Memory intrinsics and masked accesses are inserted as ranges too, so
+  /// sets should bound the cost by their size; of those here, only DumpSet
+  /// and TraceSet, which record every address, and the unused
+  /// RangeSetLibCall keep the default O(Count) loop. Sets whose
+  /// insertPointer splits blocks must override it.
+  virtual void insertRange(IRBuilder<> Builder, Value *Signature,
+                           Value *First, Value *Count, Value *Stride);
+
+  /// Check whether any of those addresses may be a member; the result is
+  /// an i32 as for checkMembership.
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Signature,
+                            Value *First, Value *Count, Value *Stride);
+
+  // Pooled storage (see AllocatePooled and runtime/SigPool.cpp) ===========
+
+  /// Bytes of zeroed storage the set needs in a pooled buffer, or 0 if it
+  /// cannot live in one (allocatePooled then falls back to allocateLocal).
+  virtual unsigned getPooledBytes() { return 0; }
+
+  /// Turn a zeroed pooled buffer into an empty set.
+  virtual Value* initPooled(IRBuilder<> Builder, Value *Buffer) {
+    return Builder.CreateBitCast(Buffer, getSignatureType());
+  }
+
+  /// Make insertPointer mark the 1 << chunkShift byte chunks it writes in
+  /// the pooled buffer's dirty mask, so only those are cleared on release.
+  /// Returns false if the set does not support it.
+  virtual bool trackDirtyChunks(int chunkShift) { return false; }
+
+  Value* allocatePooled(IRBuilder<> Builder);
+  void freePooled(IRBuilder<> Builder, Value *Signature);
+
+ protected:
+  /// Set the dirty bit of the chunk holding Word, for a set whose pooled
+  /// buffer starts at Sign.
+  static void markDirtyChunk(IRBuilder<> &Builder, Value *Sign, Value *Word,
+                             int chunkShift);
+
+  /// Emit a loop at Builder that calls Body with each address of the range
+  /// and ORs together what it returns (if anything), and move Builder after
+  /// it. Body must not split blocks.
+  static Value* emitRangeLoop(IRBuilder<> &Builder, Value *First,
+      Value *Count, Value *Stride,
+      std::function<Value*(IRBuilder<> &, Value *)> Body);
+
+  /// insertRange for signatures that more than Limit addresses would set
+  /// most of anyway: above Limit, Fill them instead of looping.
+  void insertRangeOrFill(IRBuilder<> Builder, Value *Signature, Value *First,
+      Value *Count, Value *Stride, uint64_t Limit,
+      std::function<void(IRBuilder<> &)> Fill);
+
+  /// The matching checkRange: above Limit addresses, answer Hit (1 if
+  /// null), which must already be computed at Builder.
+  Value* checkRangeOrHit(IRBuilder<> Builder, Value *Signature, Value *First,
+      Value *Count, Value *Stride, uint64_t Limit, Value *Hit = nullptr);
+
+  /// mergeSignature for signatures stored as numWords words of WordTy: OR
+  /// each word of Other into Sign with a loop at Builder. If dirty chunks
+  /// are tracked, the chunks of the pooled buffer at DirtyBase that change
+  /// are marked. The block at Builder is split around the loop.
+  static void mergeWords(IRBuilder<> Builder, Value *Sign, Value *Other,
+                         Type *WordTy, uint64_t numWords, Value *DirtyBase,
+                         int dirtyShift);
+
+  /// Set every bit of the bytes bytes at Sign and, if dirty chunks are
+  /// tracked, mark the whole pooled buffer at DirtyBase dirty.
+  static void fillSignature(IRBuilder<> &Builder, Value *Sign, uint64_t bytes,
+                            Value *DirtyBase, int dirtyShift);
+
+ private:
+  std::string hashFamily;
 };
 
+class ArraySignature;
+
+///
+/// SimpleSignature keeps the whole signature in one iN integer. Above the
+/// native register width, shifts and masks of an iN are expanded into long
+/// multi-word sequences, so wider signatures are lowered to an array of
+/// i64 words (word = idx >> 6, bit = idx & 63) with the same bits set.
+///
 class SimpleSignature : public SImple {
  private:
   int numBits;
@@ -56,9 +200,13 @@ class SimpleSignature : public SImple {
 
   //  Value *AI;
   HashBuilder hashBuilderLambda;
+  ArraySignature *words;  // the lowering, if numBits > NativeBits
 
  public:
+  static const int NativeBits = 64;
+
   SimpleSignature(int numBits, const HashBuilder &hb);
+  virtual ~SimpleSignature();
 
   virtual Value* allocateLocal(IRBuilder<> Builder);
   virtual Value* allocateGlobal(IRBuilder<> Builder);
@@ -71,6 +219,20 @@ class SimpleSignature : public SImple {
 
   virtual Type *getSignatureType();
   virtual std::string getName();
+
+  // Small enough to always clear in full.
+  virtual unsigned getPooledBytes() { return numBits / 8; }
+
+  virtual bool isMergeable() { return true; }
+  virtual void mergeSignature(IRBuilder<> Builder, Value *Sign, Value *Other);
+
+  /// A range of more addresses than the signature has bits sets all of
+  /// them, and is only checked against an empty signature.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                           Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                            Value *Count, Value *Stride);
 };
 
 ///
@@ -90,12 +252,15 @@ class ArraySignature : public SImple {
   bool isPow2;
   int pow2;
   int pow2mask;
+  int dirtyShift;  // -1 unless tracking dirty chunks
 
   Type *ElTy;
   Type *SignTy;
 
   HashBuilder hashBuilderLambda;
 
+  Value* bitMask(IRBuilder<> &Builder, Value *index);
+
  public:
   ArraySignature(int numBitsEl, int length, const HashBuilder &hb);
 
@@ -111,12 +276,48 @@ class ArraySignature : public SImple {
   virtual Type *getSignatureType();
   virtual std::string getName();
   virtual int getLength() {return length;}
+
+  /// Set or test the bit at an already hashed i32 index. Signatures that
+  /// compute indices for several banks at once use these directly.
+  /// insertIndex returns a pointer to the word it wrote.
+  Value* insertIndex(IRBuilder<> Builder, Value *Sign, Value *index);
+  Value* checkIndex(IRBuilder<> Builder, Value *Sign, Value *index);
+  /// checkIndex against several signatures of this shape; from
+  /// MinGatherWidth of them on, their words are fetched with one gather.
+  std::vector<Value*> checkIndexMulti(IRBuilder<> Builder,
+      const std::vector<Value*> &Signs, Value *index);
+  Value* hashIndex(IRBuilder<> Builder, Value *V) {
+    return hashBuilderLambda(Builder, V);
+  }
+  static const unsigned MinGatherWidth = 4;
+
+  virtual std::vector<Value*> checkMembershipMulti(IRBuilder<> Builder,
+      const std::vector<Value*> &Signs, Value *V);
+  /// Hash V and set its bit, without marking it dirty; returns the word.
+  Value* insertWord(IRBuilder<> Builder, Value *Sign, Value *V);
+
+  /// As for BankedSignature, with the whole array as its one bank.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                           Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                            Value *Count, Value *Stride);
+
+  virtual bool isMergeable() { return true; }
+  virtual void mergeSignature(IRBuilder<> Builder, Value *Sign, Value *Other);
+
+  virtual unsigned getPooledBytes() { return length * numBitsEl / 8; }
+  virtual bool trackDirtyChunks(int chunkShift) {
+    dirtyShift = chunkShift;
+    return true;
+  }
 };
 
 class BankedSignature : public SImple {
- private:
+ protected:
   int numBanks;
   int numBitsEl;
+  int dirtyShift;  // -1 unless tracking dirty chunks
   Type *ElTy;
   Type *SignTy;
 
@@ -125,7 +326,7 @@ class BankedSignature : public SImple {
  public:
   BankedSignature(int nBanks, int numBitsEl, int length);
   BankedSignature(int anumBitsEl, const std::vector<int> &lengths,
-                  std::vector<HashBuilder> &hashes);
+                  const std::vector<HashBuilder> &hashes);
   virtual ~BankedSignature();
 
   virtual Value* allocateLocal(IRBuilder<> Builder);
@@ -133,6 +334,27 @@ class BankedSignature : public SImple {
 
   virtual void insertPointer(IRBuilder<> Builder, Value *Sign, Value *V);
   virtual Value* checkMembership(IRBuilder<> Builder, Value *Sign, Value *V);
+  virtual std::vector<Value*> checkMembershipMulti(IRBuilder<> Builder,
+      const std::vector<Value*> &Signs, Value *V);
+
+  /// insertPointer for banks that live inside a larger pooled buffer
+  /// starting at DirtyBase (RangeAndBankedSignature keeps its range in
+  /// front of them).
+  void insertBanks(IRBuilder<> Builder, Value *Sign, Value *V,
+                   Value *DirtyBase);
+
+  /// A range with more addresses than the smallest bank has bits would set
+  /// most of it anyway, so insertRange then fills the banks instead of
+  /// looping, and checkRange answers 1.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                           Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                            Value *Count, Value *Stride);
+  /// insertRange for banks inside a larger pooled buffer, as insertBanks.
+  void insertBanksRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                        Value *Count, Value *Stride, Value *DirtyBase);
+  unsigned long getMinBankBits();
 
 // Do nothing, because we never put signatures on the heap
   virtual void freeSet(IRBuilder<> Builder, Value *) {}
@@ -151,12 +373,123 @@ class BankedSignature : public SImple {
      return totalLength;
   }
 
+  virtual bool isMergeable() { return true; }
+  virtual void mergeSignature(IRBuilder<> Builder, Value *Sign, Value *Other);
+
+  virtual unsigned getPooledBytes() { return getTotalLength() * numBitsEl / 8; }
+  virtual bool trackDirtyChunks(int chunkShift) {
+    dirtyShift = chunkShift;
+    return true;
+  }
+
+  virtual std::string getName();
+};
+
+///
+/// DoubleHashSignature is a BankedSignature with equal sized banks whose
+/// indices all come from one 64-bit multiply of the address: the top bits
+/// give h1, the bits below them an odd h2, and bank i uses h1 + i*h2
+/// (Kirsch-Mitzenmacher double hashing). Each extra bank then costs an add
+/// and a mask rather than a full hash.
+///
+class DoubleHashSignature : public BankedSignature {
+ private:
+  int indexBits;
+  uint64_t seed;
+
+ public:
+  DoubleHashSignature(int nBanks, int numBitsEl, int length,
+                      uint64_t seed = ddphash::multiplyShiftSeed(0));
+
+  virtual void insertPointer(IRBuilder<> Builder, Value *Sign, Value *V);
+  virtual Value* checkMembership(IRBuilder<> Builder, Value *Sign, Value *V);
+
+  virtual std::vector<Value*> checkMembershipMulti(IRBuilder<> Builder,
+      const std::vector<Value*> &Signs, Value *V);
+
   virtual std::string getName();
+
+ private:
+  void hashPair(IRBuilder<> &Builder, Value *V, Value *&h1, Value *&h2);
+  Value* nextIndex(IRBuilder<> &Builder, Value *&sum, Value *h2);
 };
 
+///
+/// BlockedSignature is a blocked Bloom filter: an array of 512 bit blocks,
+/// each one cache line and held as a <16 x i32> vector. One 64-bit multiply
+/// of the address gives both the block (top bits of the product) and the k
+/// bits to use within it (9 bits each, taken below the block bits), so an
+/// insert or check touches a single line, and a check is one vector compare
+/// of the block against the mask of the k bits.
+///
+class BlockedSignature : public SImple {
+ private:
+  int numBlocks;
+  int blockBits;  // log2(numBlocks)
+  int numHashes;
+  int dirtyShift;  // -1 unless tracking dirty chunks
+  uint64_t seed;
+
+  Type *BlockTy;
+  Type *SignTy;
+
+  Value* blockAndMask(IRBuilder<> &Builder, Value *Sign, Value *V,
+                      Value *&mask);
+
+ public:
+  static const int BitsPerBlock = 512;
+  static const int BytesPerBlock = BitsPerBlock / 8;
+
+  BlockedSignature(int numBlocks, int numHashes = 4,
+                   uint64_t seed = ddphash::multiplyShiftSeed(0));
+
+  virtual Value* allocateLocal(IRBuilder<> Builder);
+  virtual Value* allocateGlobal(IRBuilder<> Builder);
+
+  virtual void insertPointer(IRBuilder<> Builder, Value *Sign, Value *V);
+  virtual Value* checkMembership(IRBuilder<> Builder, Value *Sign, Value *V);
+
+  // do nothing, because we never put signatures on the heap
+  virtual void freeSet(IRBuilder<> Builder, Value *) {}
+
+  virtual Value* getSignatureInfo(sigInfoType infoType, IRBuilder<> Builder,
+                                  Value *Signature, Value *V = nullptr);
+
+  virtual Type *getSignatureType();
+  virtual std::string getName();
+
+  /// A range of more addresses than the blocks have bits per hash would
+  /// set most of them anyway, so it fills them all.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                           Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Sign, Value *First,
+                            Value *Count, Value *Stride);
+
+  virtual bool isMergeable() { return true; }
+  virtual void mergeSignature(IRBuilder<> Builder, Value *Sign, Value *Other);
+
+  virtual unsigned getPooledBytes() { return numBlocks * BytesPerBlock; }
+  virtual bool trackDirtyChunks(int chunkShift) {
+    dirtyShift = chunkShift;
+    return true;
+  }
+};
+
+///
+/// LibCallSignature leaves the signature to the runtime (Signature.cpp in
+/// lib/runtime): numWords i32 words in four banks, updated and tested by
+/// calls to Insert_Value_2K and MembershipCheck_2K, or to their _Sig
+/// versions for sizes other than 2K bits.
+///
 class LibCallSignature : public SImple {
+ private:
+  int numWords;  // a power of 2, at least 4
+
  public:
-  LibCallSignature();
+  static const int Words2K = 64;
+
+  LibCallSignature(int numBits = 2048);
 
   virtual Value* allocateLocal(IRBuilder<> Builder);
   virtual Value* allocateGlobal(IRBuilder<> Builder);
@@ -169,6 +502,15 @@ class LibCallSignature : public SImple {
 
   virtual Type *getSignatureType();
   virtual std::string getName();
+  virtual bool prefersPredicatedChecks() { return false; }
+
+  /// Insert_Range_Sig and Check_Range_Sig in the runtime, which fill the
+  /// signature, or only test it for any bit, above a bank's bits.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Signature,
+                           Value *First, Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Signature,
+                            Value *First, Value *Count, Value *Stride);
 };
 
 class PerfectSet : public SImple {
@@ -186,11 +528,121 @@ class PerfectSet : public SImple {
 
   virtual Value* getSignatureInfo(sigInfoType infoType, IRBuilder<> Builder,
                                   Value *Signature, Value *V = nullptr);
+  virtual bool prefersPredicatedChecks() { return false; }
+
+  // PerfectSet_Insert_Range and PerfectSet_Check_Range in the runtime,
+  // which keep word ranges as runs; other strides take O(Count log n).
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Signature,
+                           Value *First, Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Signature,
+                            Value *First, Value *Count, Value *Stride);
+};
+
+///
+/// CuckooSet is an approximate set kept by the runtime (CuckooSet.cpp) as a
+/// cuckoo filter of 16-bit fingerprints. Unlike the signatures it supports
+/// deletion: with -cuckooinstr, every free/delete in the module first calls
+/// CuckooSet_Free_Hook, which removes the freed block from the live sets.
+/// Each filter is told its granule when it is made, so the hook deletes
+/// the same keys the inserts added.
+///
+class CuckooSet : public SImple {
+  int log2Buckets;
+  int granuleShift;
+ public:
+  static const int BitsPerBucket = 64;  // 4 slots of 16 bits
+
+  CuckooSet(int log2Buckets);
+
+  virtual Value* allocateLocal(IRBuilder<> Builder);
+  virtual Value* allocateGlobal(IRBuilder<> Builder);
+  virtual Value* allocateHeap(IRBuilder<> Builder);
+
+  virtual void insertPointer(IRBuilder<> Builder, Value *Signature, Value *V);
+  virtual Value* checkMembership(IRBuilder<> Builder, Value *Signature, Value *V);
+  virtual void freeSet(IRBuilder<> Builder, Value *Signature);
+
+  virtual Type *getSignatureType();
+  virtual std::string getName();
+
+  virtual Value* getSignatureInfo(sigInfoType infoType, IRBuilder<> Builder,
+                                  Value *Signature, Value *V = nullptr);
+  virtual bool prefersPredicatedChecks() { return false; }
+  virtual bool takeGranularity(int shift) {
+    granuleShift = shift;
+    return true;
+  }
+
+  /// CuckooSet_Insert_Range and CuckooSet_Check_Range in the runtime: a
+  /// range of more granules than the filter has slots marks it full, or
+  /// only misses an empty filter.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Signature,
+                           Value *First, Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Signature,
+                            Value *First, Value *Count, Value *Stride);
+};
+
+///
+/// ShadowSet is an exact set kept in shadow memory by the runtime
+/// (ShadowSet.cpp). Each granule of 1 << granuleShift bytes has a 64-bit
+/// tag in a two-level table, naming the set instance that last inserted
+/// it. A set instance is just its tag, a fresh epoch from ShadowSet_New;
+/// an insert stores the tag into the granule's slot and a check loads the
+/// slot and compares, both inline. Clearing the set is taking a new epoch.
+///
+/// A granule remembers only its last insert, so a check misses once a
+/// store in another set has overwritten what this one inserted: it finds
+/// the last writer, where PerfectSet finds any earlier one. For the same
+/// reason no insert or check of it can be elided as covered by another.
+///
+class ShadowSet : public SImple {
+  int granuleShift;
+  Value* newEpoch(IRBuilder<> &Builder);
+  Value* getChunkSlot(IRBuilder<> &Builder, Value *V, Value *&Chunk,
+                      Value *&Offset);
+ public:
+  /// log2 of the granules in each lazily mapped second level chunk; must
+  /// match ChunkBits in runtime/ShadowSet.cpp.
+  static const int ChunkBits = 22;
+  /// Bits of address the tables cover; must match AddressBits there too.
+  static const int AddressBits = 48;
+  /// The chunk table of the coarsest granule has a single slot.
+  static const int MaxGranuleShift = AddressBits - ChunkBits;
+
+  ShadowSet(int granuleShift);
+
+  virtual Value* allocateLocal(IRBuilder<> Builder);
+  virtual Value* allocateGlobal(IRBuilder<> Builder);
+
+  virtual void insertPointer(IRBuilder<> Builder, Value *Signature, Value *V);
+  virtual Value* checkMembership(IRBuilder<> Builder, Value *Signature, Value *V);
+  // An abandoned epoch needs no freeing.
+  virtual void freeSet(IRBuilder<> Builder, Value *) {}
+
+  virtual Type *getSignatureType();
+  virtual std::string getName();
+  virtual bool keepsMembers() { return false; }
+  /// A granularity replaces -shadow-granule; the tags are per granule
+  /// either way.
+  virtual bool takeGranularity(int shift);
+
+  /// ShadowSet_Insert_Range and ShadowSet_Check_Range in the runtime, which
+  /// store or compare one tag per granule of the range; insertPointer's
+  /// branch to map a chunk cannot go in emitRangeLoop's loop.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Signature,
+                           Value *First, Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Signature,
+                            Value *First, Value *Count, Value *Stride);
 };
 
 class RangeAndBankedSignature : public SImple {
   BankedSignature bankSig;
   StructType* internalType;
+  int dirtyShift;  // -1 unless tracking dirty chunks
+  bool predicated; // check the banks even outside the range
   void setInternalType(Module *M);
  public:
   RangeAndBankedSignature(int nBanks, int numBitsEl, int length);
@@ -208,6 +660,26 @@ class RangeAndBankedSignature : public SImple {
 
   virtual Type *getSignatureType();
   virtual std::string getName();
+
+  // The min/max pair takes the first 8 bytes, ahead of the banks.
+  virtual bool isMergeable() { return true; }
+  virtual void mergeSignature(IRBuilder<> Builder, Value *Sign, Value *Other);
+
+  virtual unsigned getPooledBytes() { return 8 + bankSig.getPooledBytes(); }
+  virtual Value* initPooled(IRBuilder<> Builder, Value *Buffer);
+  virtual bool trackDirtyChunks(int chunkShift) {
+    dirtyShift = chunkShift;
+    return bankSig.trackDirtyChunks(chunkShift);
+  }
+
+  virtual void setPredicatedChecks(bool p) { predicated = p; }
+
+  // checkRange only compares with the range, ignoring the banks.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Signature,
+                           Value *First, Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Signature,
+                            Value *First, Value *Count, Value *Stride);
 };
 
 class RangeSet : public SImple {
@@ -226,6 +698,13 @@ class RangeSet : public SImple {
 
   virtual Type *getSignatureType();
   virtual std::string getName();
+
+  // Both take O(1): the range just grows to cover First and the last address.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Signature,
+                           Value *First, Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Signature,
+                            Value *First, Value *Count, Value *Stride);
 };
 
 class RangeSetLibCall : public SImple {
@@ -240,6 +719,7 @@ class RangeSetLibCall : public SImple {
 
   virtual Type *getSignatureType();
   virtual std::string getName();
+  virtual bool prefersPredicatedChecks() { return false; }
 };
 
 class HashTableSet : public SImple {
@@ -255,6 +735,15 @@ class HashTableSet : public SImple {
 
   virtual Type *getSignatureType();
   virtual std::string getName();
+  virtual bool prefersPredicatedChecks() { return false; }
+
+  /// HT_Insert_Range and HT_Check_Range in the runtime, which fill the
+  /// table, or only test it for any bit, above TableSize addresses.
+  virtual bool supportsRanges() { return true; }
+  virtual void insertRange(IRBuilder<> Builder, Value *Signature,
+                           Value *First, Value *Count, Value *Stride);
+  virtual Value* checkRange(IRBuilder<> Builder, Value *Signature,
+                            Value *First, Value *Count, Value *Stride);
 };
 
 class DumpSet : public SImple {
@@ -277,13 +766,60 @@ class DumpSet : public SImple {
 
   virtual Type *getSignatureType();
   virtual std::string getName();
+  virtual bool prefersPredicatedChecks() { return false; }
+  virtual void setPredicatedChecks(bool predicated) {
+    set->setPredicatedChecks(predicated);
+  }
+};
+
+///
+/// TraceSet - Wraps another set and records every allocation, insert and
+/// membership check into a compact per-thread address trace (see
+/// lib/runtime/TraceSet.cpp). The wrapped set still computes the answer.
+///
+class TraceSet : public SImple {
+ protected:
+  SImple *set;
+  int refid;
+
+  void recordRegion(IRBuilder<> Builder);
+  void recordAccess(IRBuilder<> Builder, const char *FnName, Value *V);
+
+ public:
+  TraceSet(SImple *aSet,int arefid): set(aSet),refid(arefid) {}
+
+  virtual Value* allocateLocal(IRBuilder<> Builder);
+  virtual Value* allocateGlobal(IRBuilder<> Builder);
+  virtual Value* allocateHeap(IRBuilder<> Builder);
+
+  virtual void insertPointer(IRBuilder<> Builder, Value *Signature, Value *V);
+  virtual Value* checkMembership(IRBuilder<> Builder, Value *Signature, Value *V);
+  virtual void freeSet(IRBuilder<> Builder, Value *Signature);
+
+  virtual Type *getSignatureType();
+  virtual std::string getName();
+
+  virtual Value* getSignatureInfo(sigInfoType infoType, IRBuilder<> Builder,
+                                  Value *Signature, Value *V = nullptr) {
+    return set->getSignatureInfo(infoType, Builder, Signature, V);
+  }
+  virtual bool prefersPredicatedChecks() { return false; }
+  virtual void setPredicatedChecks(bool predicated) {
+    set->setPredicatedChecks(predicated);
+  }
+  virtual bool takeGranularity(int shift) {
+    return set->takeGranularity(shift);
+  }
 };
 
+// Allocation policies. FreesSets says whether free() does anything, and so
+// whether every path out of a set's region has to reach it.
 template <typename SetType>
 class AllocateLocal {
  protected:
   SetType &S;
  public:
+  static const bool FreesSets = false;
   AllocateLocal(SetType &aS): S(aS) {}
   Value * allocate(IRBuilder<> &Builder) {
     return S.allocateLocal(Builder);
@@ -296,6 +832,7 @@ class AllocateGlobal {
  protected:
   SetType &S;
  public:
+  static const bool FreesSets = false;
   AllocateGlobal(SetType &aS): S(aS) {}
   Value * allocate(IRBuilder<> &Builder) {
     return S.allocateGlobal(Builder);
@@ -308,6 +845,7 @@ class AllocateUniqueGlobal {
  protected:
   SetType &S;
  public:
+  static const bool FreesSets = false;
   AllocateUniqueGlobal(SetType &aS): S(aS) {}
   Value * allocate(IRBuilder<> &Builder) {
     return S.allocateUniqueGlobal(Builder);
@@ -320,6 +858,7 @@ class AllocateHeap {
  protected:
   SetType &S;
  public:
+  static const bool FreesSets = true;
   AllocateHeap(SetType &aS): S(aS) {}
   Value * allocate(IRBuilder<> &Builder) {
     return S.allocateHeap(Builder);
@@ -329,6 +868,24 @@ class AllocateHeap {
   }
 };
 
+// Takes sets from the per-thread pool in runtime/SigPool.cpp on entry and
+// returns them on exit, so they neither sit on the stack nor need clearing
+// in full. Sets that cannot be pooled are allocated locally.
+template <typename SetType>
+class AllocatePooled {
+ protected:
+  SetType &S;
+ public:
+  static const bool FreesSets = true;
+  AllocatePooled(SetType &aS): S(aS) {}
+  Value * allocate(IRBuilder<> &Builder) {
+    return S.allocatePooled(Builder);
+  }
+  void free(IRBuilder<> Builder, Value *Signature) {
+    S.freePooled(Builder,Signature);
+  }
+};
+
 template
 <
     // Decide where sets should be allocated in memory
@@ -361,6 +918,24 @@ class SImpleWrapper
  void freeSet(IRBuilder<> Builder) {
    Alloc.free(Builder,Sign);
  }
+ Value* allocateLocalCopy(IRBuilder<> Builder) {
+   return S.allocateLocal(Builder);
+ }
+ void insertPointerInto(IRBuilder<> Builder, Value *Copy, Value *V) {
+   S.insertPointer(Builder,Copy,V);
+ }
+ void mergeLocalCopy(IRBuilder<> Builder, Value *Copy) {
+   S.mergeSignature(Builder,Sign,Copy);
+ }
+ void insertRange(IRBuilder<> Builder, Value *First, Value *Count,
+                  Value *Stride) {
+   S.insertRange(Builder,Sign,First,Count,Stride);
+ }
+ Value* checkRange(IRBuilder<> Builder, Value *First, Value *Count,
+                   Value *Stride) {
+   return S.checkRange(Builder,Sign,First,Count,Stride);
+ }
+ Value* getSignature() { return Sign; }
  Type *getSignatureType() { return S.getSignatureType(); }
  std::string getName() { return S.getName(); }
 
@@ -387,6 +962,25 @@ class AbstractSetInstrumentHelper {
   virtual SetImpl &getSetImpl() = 0;
   virtual Value* getSignatureInfo(sigInfoType infoType, Instruction *pos,
                                   Value *Ptr = nullptr) = 0;
+
+  // Private copies for sets where getSetImpl().isMergeable().
+  virtual Value* AllocateLocalCopy(Instruction *pos) = 0;
+  virtual void Insert_Value_Into(Value *Copy, Value *Ptr, Instruction *pos) = 0;
+  virtual void MergeLocalCopy(Value *Copy, Instruction *pos) = 0;
+
+  // Summaries of a loop's accesses, for sets where
+  // getSetImpl().supportsRanges().
+  virtual void Insert_Range(Value *First, Value *Count, Value *Stride,
+                            Instruction *pos) = 0;
+  virtual Instruction* MembershipCheckRange(Value *First, Value *Count,
+                                            Value *Stride, Instruction *pos) = 0;
+
+  // One check of an address against several sets whose set implementations
+  // share their hashes (see SImple::sharesHashesWith).
+  virtual Value* getSignature() = 0;
+  virtual std::vector<Instruction*> MembershipCheckMulti(
+      const std::vector<AbstractSetInstrumentHelper<SetImpl>*> &Sets,
+      Value *Ptr, Instruction *pos) = 0;
 };
 
 
@@ -425,6 +1019,45 @@ class FunctionRegion {
    }
 };
 
+///
+/// LazyFunctionRegion starts at the nearest common dominator of the
+/// instructions that use a set instead of at the function entry, so paths
+/// that never touch the set never allocate or clear it. The start is hoisted
+/// up the dominator tree until it is on no cycle, so the set is still
+/// allocated at most once per call. The region is what the start dominates,
+/// and its exits are the returns in it. Paths may also leave the region for
+/// returns it does not dominate; that is harmless for sets that need no
+/// freeing, and placeFrees() adds an exit on each such edge for those that
+/// do.
+///
+class LazyFunctionRegion {
+ public:
+  typedef std::pair<BasicBlock*, BasicBlock*> Edge;
+
+ private:
+  Function &F;
+  Instruction *entry;
+  std::vector<const Instruction*> exits;
+  std::vector<Edge> exitEdges;  //!< Edges out of the region
+
+  void useWholeFunction();
+
+ public:
+  LazyFunctionRegion(Function &F, DominatorTree &DT,
+                     const std::vector<Instruction*> &uses);
+
+///
+/// Give each edge leaving the region a block to free the set in. Edges
+/// another region already split are in split, and reused. An edge that
+/// cannot be split (to a landing pad, or from an indirectbr) makes the
+/// region the whole function.
+///
+  void placeFrees(std::map<Edge, BasicBlock*> &split);
+
+  Instruction &getEntry() { return *entry; }
+  const std::vector<const Instruction*> &getExits() { return exits; }
+};
+
 template
 <
     // Decide where sets should be allocated in memory
@@ -441,12 +1074,59 @@ class SetInstrumentHelper : public AbstractSetInstrumentHelper<SetImpl> {
   //AllocatePolicy Alloc;
   Region &R;
   bool EarlyTerm;
+  bool Predicated;
   Value *ET;
+  int GranuleShift;  //!< log2 of the bytes tracked as one location, or -1
+
+///
+/// With a granularity, the set is handed the number of each address's
+/// granule, scaled by 4. Hashes, which drop the 2 low bits of a word
+/// address, then index by granule, and exact sets key on it.
+///
+  Value* toGranule(IRBuilder<> &B, Value *Ptr) {
+    if (GranuleShift < 0)
+      return Ptr;
+    Value *A = B.CreatePtrToInt(Ptr, B.getInt64Ty());
+    A = B.CreateShl(B.CreateLShr(A, B.getInt64(GranuleShift)), B.getInt64(2));
+    return B.CreateIntToPtr(A, Ptr->getType());
+  }
+
+///
+/// The granules of the range First, First + Stride, ... (Count of them).
+/// A Stride that is a multiple of the granule skips the same number of
+/// granules each time; otherwise the range becomes every granule from the
+/// first address's to the last one's, which is exact when Stride is at
+/// most a granule.
+///
+  void toGranuleRange(IRBuilder<> &B, Value *&First, Value *&Count,
+                      Value *&Stride) {
+    if (GranuleShift < 0)
+      return;
+    uint64_t granule = 1ULL << GranuleShift;
+    Value *A = B.CreatePtrToInt(First, B.getInt64Ty());
+    Value *FirstG = B.CreateLShr(A, B.getInt64(GranuleShift));
+    ConstantInt *C = dyn_cast<ConstantInt>(Stride);
+    if (C && C->getZExtValue() % granule == 0) {
+      Stride = B.getInt64((C->getZExtValue() >> GranuleShift) << 2);
+    } else {
+      Value *Last = B.CreateAdd(A, B.CreateMul(B.CreateSub(Count,
+                                B.getInt64(1)), Stride));
+      Count = B.CreateAdd(B.CreateSub(B.CreateLShr(Last,
+                          B.getInt64(GranuleShift)), FirstG), B.getInt64(1));
+      Stride = B.getInt64(4);
+    }
+    First = B.CreateIntToPtr(B.CreateShl(FirstG, B.getInt64(2)),
+                             First->getType());
+  }
 
  public:
- SetInstrumentHelper(Region &aR, SetImpl *SI, bool early=false)
- : BS(*SI),R(aR),EarlyTerm(early),ET(NULL) {
-    IRBuilder<> Builder(&R.getEntry());
+ SetInstrumentHelper(Region &aR, SetImpl *SI, bool early=false,
+                     bool predicated=false, int granuleShift=-1)
+ : BS(*SI),R(aR),EarlyTerm(early),Predicated(predicated),ET(NULL),
+   GranuleShift(granuleShift) {
+    Instruction *Pos = &R.getEntry();
+    Instruction *Prev = Pos->getPrevNode();
+    IRBuilder<> Builder(Pos);
     BS.allocate(Builder);
     if (EarlyTerm)
       {
@@ -454,10 +1134,31 @@ class SetInstrumentHelper : public AbstractSetInstrumentHelper<SetImpl> {
                                                    "earlyterm");
 	Builder.CreateStore(ConstantInt::get(Builder.getInt32Ty(),0),ET);
       }
+    hoistStaticAllocas(Prev, Pos);
   }
 
   SetImpl &getSetImpl() { return BS.getSetImpl(); }
 
+///
+/// A region may start past the entry block. Move the fixed size allocas
+/// emitted between Prev and Pos to the entry block, so that they remain part
+/// of the static frame; only their initialization stays at the region entry.
+///
+  static void hoistStaticAllocas(Instruction *Prev, Instruction *Pos) {
+    BasicBlock *BB = Pos->getParent();
+    BasicBlock &EntryBB = BB->getParent()->getEntryBlock();
+    if (BB == &EntryBB)
+      return;
+    Instruction *I = Prev ? Prev->getNextNode() : &BB->front();
+    while (I != Pos) {
+      Instruction *Next = I->getNextNode();
+      if (AllocaInst *AI = dyn_cast<AllocaInst>(I))
+        if (isa<Constant>(AI->getArraySize()))
+          AI->moveBefore(&*EntryBB.getFirstInsertionPt());
+      I = Next;
+    }
+  }
+
 ///
 /// Insert pointer, Ptr, into the signature at position, pos. Ptr is
 /// immediately converted to an i32/i64 using ptrtoint, so no need to worry
@@ -465,7 +1166,7 @@ class SetInstrumentHelper : public AbstractSetInstrumentHelper<SetImpl> {
 ///
   virtual void Insert_Value(Value *Ptr, Instruction *pos) {
     IRBuilder<> B(pos);
-    BS.insertPointer(B,Ptr);
+    BS.insertPointer(B,toGranule(B,Ptr));
   }
 
 ///
@@ -473,11 +1174,24 @@ class SetInstrumentHelper : public AbstractSetInstrumentHelper<SetImpl> {
 /// at the location before pos.  Return the instruction that produces
 /// final boolean result as an i32: true means it is a member, false means
 /// it is not.
+///
+/// With early termination, a predicated helper still evaluates the check
+/// but ORs it into the flag instead of branching around it.
 ///
   virtual Instruction* MembershipCheckWith(Value *Ptr, Instruction *pos) {
+    {
+      IRBuilder<> B(pos);
+      Ptr = toGranule(B,Ptr);
+    }
     if (!EarlyTerm) {
     	IRBuilder<> B(pos);
 		return (Instruction*)BS.checkMembership(B,Ptr);
+    } else if (Predicated) {
+		IRBuilder<> B(pos);
+		Value *Ld = B.CreateLoad(ET);
+		Value *V = B.CreateOr(Ld, BS.checkMembership(B,Ptr));
+		B.CreateStore(V,ET);
+		return (Instruction*)V;
     } else {
 		// Split basic block
 		BasicBlock *Old = pos->getParent();
@@ -539,26 +1253,121 @@ class SetInstrumentHelper : public AbstractSetInstrumentHelper<SetImpl> {
      IRBuilder<> B(pos);
      return (Instruction*)BS.getSignatureInfo(infoType,B,Ptr);
   }
+
+///
+/// Allocate an empty private copy of the set, initialized at pos. Its
+/// storage goes in the entry block like the set's own.
+///
+  virtual Value* AllocateLocalCopy(Instruction *pos) {
+    Instruction *Prev = pos->getPrevNode();
+    IRBuilder<> B(pos);
+    Value *Copy = BS.allocateLocalCopy(B);
+    hoistStaticAllocas(Prev, pos);
+    return Copy;
+  }
+
+  virtual void Insert_Value_Into(Value *Copy, Value *Ptr, Instruction *pos) {
+    IRBuilder<> B(pos);
+    BS.insertPointerInto(B,Copy,toGranule(B,Ptr));
+  }
+
+///
+/// Fold the private copy, Copy, into the set before pos.
+///
+  virtual void MergeLocalCopy(Value *Copy, Instruction *pos) {
+    IRBuilder<> B(pos);
+    BS.mergeLocalCopy(B,Copy);
+  }
+
+///
+/// Insert the Count addresses First, First + Stride, ... before pos.
+///
+  virtual void Insert_Range(Value *First, Value *Count, Value *Stride,
+                            Instruction *pos) {
+    IRBuilder<> B(pos);
+    toGranuleRange(B,First,Count,Stride);
+    BS.insertRange(B,First,Count,Stride);
+  }
+
+///
+/// Check whether any of those addresses is present, before pos. It is
+/// evaluated once per loop rather than per access, so unlike
+/// MembershipCheckWith it does not bother with early termination.
+///
+  virtual Instruction* MembershipCheckRange(Value *First, Value *Count,
+                                            Value *Stride, Instruction *pos) {
+    IRBuilder<> B(pos);
+    toGranuleRange(B,First,Count,Stride);
+    return (Instruction*)BS.checkRange(B,First,Count,Stride);
+  }
+
+  virtual Value* getSignature() { return BS.getSignature(); }
+
+///
+/// Check Ptr against each of Sets, this one among them, before pos, hashing
+/// it only once. With early termination every set keeps its own flag, so
+/// they are checked one at a time.
+///
+  virtual std::vector<Instruction*> MembershipCheckMulti(
+      const std::vector<AbstractSetInstrumentHelper<SetImpl>*> &Sets,
+      Value *Ptr, Instruction *pos) {
+    std::vector<Instruction*> res;
+    if (EarlyTerm) {
+      for (auto *S : Sets)
+        res.push_back(S->MembershipCheckWith(Ptr, pos));
+      return res;
+    }
+    std::vector<Value*> Signs;
+    for (auto *S : Sets)
+      Signs.push_back(S->getSignature());
+    IRBuilder<> B(pos);
+    Ptr = toGranule(B, Ptr);
+    for (Value *V : getSetImpl().checkMembershipMulti(B, Signs, Ptr))
+      res.push_back((Instruction*)V);
+    return res;
+  }
 };
 
 ///
 /// Provided primarily for testing.  Do not generate the API
 /// if it's used for instrumentation.
 ///
+/// BuildSignatureAPI emits a C callable API for a SImple, so that set
+/// implementations can be tested and benchmarked outside of the
+/// instrumenter:
+///
+///   i32* <Name>AllocateFn()
+///   void <Name>InsertFn(i32*, i8*)
+///   i32  <Name>MembershipFn(i32*, i8*)
+///   void <Name>FreeFn(i32*)
+///   i64  <Name>SizeFn()       -- static footprint in bytes, 0 if on the heap
+///
+/// The signature handle is always passed around as an i32*, whatever the
+/// SImple's own signature type is. Name defaults to SImple::getName().
+///
 class BuildSignatureAPI {
   SImple &BS;
+  std::string Name;
+  uint64_t StaticBytes;
+
+  Type *getHandleType(LLVMContext &C);
+  Value *castToSignature(IRBuilder<> &Builder, Value *Handle);
 
  public:
-  BuildSignatureAPI(SImple &aBS);
+  BuildSignatureAPI(SImple &aBS, std::string aName = "");
 
   void CreateAllocateFn(Module *M);
   void CreateInsertFn(Module *M);
   void CreateMembershipFn(Module *M);
+  void CreateFreeFn(Module *M);
+  void CreateSizeFn(Module *M);
 
   void CreateAPI(Module *M) {
     CreateAllocateFn(M);
     CreateInsertFn(M);
     CreateMembershipFn(M);
+    CreateFreeFn(M);
+    CreateSizeFn(M);
   }
 };
 
@@ -19,10 +19,12 @@
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/TypeBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/MemoryLocation.h"
 #include "llvm/Analysis/CFG.h"
 
 #include "ProfileDBHelper.h"
@@ -44,13 +46,17 @@ namespace ddp {
     Instruction *rhs;
     unsigned long long pset;
     bool repeated;
+    bool staticHit; // the dependence is proven; nothing to check at runtime
+    Instruction *sharedCheck; // earlier load whose checks lhs can reuse
     unsigned int total;
 
-    Query():id(0),lhs(NULL),rhs(NULL),pset(0),repeated(false),total(0) {}
+    Query():id(0),lhs(NULL),rhs(NULL),pset(0),repeated(false),staticHit(false),
+            sharedCheck(NULL),total(0) {}
 
     Query(unsigned long long aid, Instruction *alhs, Instruction *arhs,
 	                                           unsigned long long apset=0)
-      :id(aid),lhs(alhs),rhs(arhs),pset(apset),repeated(false),total(0) {}
+      :id(aid),lhs(alhs),rhs(arhs),pset(apset),repeated(false),staticHit(false),
+       sharedCheck(NULL),total(0) {}
   };
 
   class Queries {
@@ -80,6 +86,14 @@ namespace ddp {
 
     size_t size() { return v.size(); }
 
+    /// Drop the queries DependenceAnalysis proves independent and mark the
+    /// ones it proves dependent as static hits.
+    void pruneWithDependences(Function &F, AAResults &AA);
+
+    /// Drop the queries whose store is always overwritten before the load,
+    /// and point loads that read the same memory version at a shared check.
+    void pruneWithMemorySSA(Function &F, AAResults &AA);
+
     QueryVector getQueryVector() { return v; }
   };
 
@@ -99,6 +113,23 @@ namespace ddp {
   };
 
   void printBacktrace(const std::string &filename, Value *val);
+
+  /// The accesses queries are made for: loads, stores and atomics, and the
+  /// memory intrinsics and masked vector loads and stores. An atomic both
+  /// reads and writes its address, and a memcpy reads its source and writes
+  /// its destination. Gathers and scatters are not tracked.
+  bool isTrackedRead(Instruction *I);
+  bool isTrackedWrite(Instruction *I);
+  /// Whether I accesses just the value at its pointer (a load, store or
+  /// atomic), rather than a range of bytes.
+  bool isSingleAccess(Instruction *I);
+  Value* getReadPointer(Instruction *I);
+  Value* getWritePointer(Instruction *I);
+  /// The bytes a range access may touch, from its pointer on. Masked lanes
+  /// are not looked at, so this is the whole vector.
+  Value* getAccessLength(Instruction *I);
+  MemoryLocation getReadLocation(Instruction *I);
+  MemoryLocation getWriteLocation(Instruction *I);
 }
 
 #endif //GENERATE_QUERIES_H
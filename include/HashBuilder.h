@@ -12,6 +12,8 @@
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/TypeBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/ADT/StringExtras.h"
+#include "HashConstants.h"
 
 using namespace llvm;
 
@@ -30,7 +32,8 @@ public:
    //                                  getIntPtrType(Builder.getContext());
    // FIXME: The users of this expect a i32. Fix these together.
    // FIXME: The actual hashing is only designed for 32 bits. Has to be fixed
-   // whenever moving to 64 bit.
+   // whenever moving to 64 bit. The Create*64 hashes below do hash the whole
+   // address, and still return an i32 index.
 
    static HashBuilder CreateZeroIndex() {
       return [=](IRBuilder<> Builder, Value *V)->Value * {
@@ -115,6 +118,112 @@ public:
           // be 4 bytes wide.
             V = Builder.CreateLShr(V,ConstantInt::get(intType,2));
          }
+         return V;
+      };
+   }
+
+   /// 64-bit address hashes =================================================
+   ///
+   /// These hash the full address, so addresses that only differ above bit
+   /// 31 (e.g. heap and stack on x86-64) no longer collide. Like the hashes
+   /// above, they drop `shift` low bits and return an i32 index in [0, mask];
+   /// mask must be one less than a power of 2.
+
+   static Value *CreateAddress64(IRBuilder<> &Builder, Value *V) {
+      IntegerType *int64Type = Builder.getInt64Ty();
+      if (V->getType()->isPointerTy())
+         return Builder.CreatePtrToInt(V, int64Type);
+      return Builder.CreateZExtOrTrunc(V, int64Type);
+   }
+
+   static unsigned MaskBits(const int mask) {
+      assert(((unsigned)mask & ((unsigned)mask + 1)) == 0 &&
+             "Hash mask must be one less than a power of 2");
+      unsigned bits = 0;
+      while ((unsigned)mask >> bits)
+         ++bits;
+      return bits;
+   }
+
+   /// Multiply-shift: the top bits of (addr >> shift) * seed. Use a different
+   /// odd seed (ddphash::multiplyShiftSeed) for each bank.
+   static HashBuilder CreateMultiplyShiftIndex64(const int shift,
+                                 const int mask,
+                                 const uint64_t seed = ddphash::multiplyShiftSeed(0)) {
+      const unsigned bits = MaskBits(mask);
+      return [=](IRBuilder<> Builder, Value *V)->Value * {
+         if (bits == 0)
+            return Builder.getInt32(0);
+         Value *index = CreateAddress64(Builder, V);
+         index = Builder.CreateLShr(index, Builder.getInt64(shift));
+         index = Builder.CreateMul(index, Builder.getInt64(seed));
+         index = Builder.CreateLShr(index, Builder.getInt64(64 - bits));
+         return Builder.CreateTrunc(index, Builder.getInt32Ty());
+      };
+   }
+
+   /// Tabulation (H3): XOR of one constant table entry per byte of
+   /// (addr >> shift). The tables are private constants of the module, shared
+   /// by every hash with the same seed.
+   static HashBuilder CreateTabulationIndex64(const int shift, const int mask,
+                                              const uint64_t seed = 0) {
+      return [=](IRBuilder<> Builder, Value *V)->Value * {
+         Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+         GlobalVariable *Tables = GetTabulationTables(M, seed);
+         // Bytes above the top of a shifted address are always 0; skip them.
+         unsigned nBytes = (64 - shift + 7) / 8;
+
+         Value *addr = Builder.CreateLShr(CreateAddress64(Builder, V),
+                                          Builder.getInt64(shift));
+         Value *index = NULL;
+         for (unsigned i = 0; i < nBytes; i++) {
+            Value *byte = Builder.CreateAnd(
+                     Builder.CreateLShr(addr, Builder.getInt64(8 * i)),
+                     Builder.getInt64(0xFF));
+            Value *idx[3] = { Builder.getInt64(0), Builder.getInt64(i), byte };
+            Value *entry = Builder.CreateLoad(
+                     Builder.CreateInBoundsGEP(Tables, ArrayRef<Value*>(idx)));
+            index = index ? Builder.CreateXor(index, entry) : entry;
+         }
+         return Builder.CreateAnd(index, Builder.getInt32(mask));
+      };
+   }
+
+   static GlobalVariable *GetTabulationTables(Module *M, const uint64_t seed) {
+      std::string name = "ddp.h3." + utohexstr(seed);
+      if (GlobalVariable *GV = M->getNamedGlobal(name))
+         return GV;
+
+      LLVMContext &C = M->getContext();
+      ArrayType *RowTy = ArrayType::get(Type::getInt32Ty(C), 256);
+      ArrayType *TableTy = ArrayType::get(RowTy, ddphash::TabulationBytes);
+      std::vector<Constant*> rows;
+      for (unsigned b = 0; b < ddphash::TabulationBytes; b++) {
+         std::vector<uint32_t> row(256);
+         for (unsigned v = 0; v < 256; v++)
+            row[v] = ddphash::tabulationEntry(seed, b, v);
+         rows.push_back(ConstantDataArray::get(C, row));
+      }
+      GlobalVariable *GV = new GlobalVariable(*M, TableTy, true,
+                                       GlobalValue::PrivateLinkage,
+                                       ConstantArray::get(TableTy, rows), name);
+      GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+      return GV;
+   }
+
+   /// Fold: XOR the upper address bits into the lower ones, then mask. It
+   /// keeps the locality of CreateShiftMaskIndex for nearby addresses at a
+   /// few extra operations.
+   static HashBuilder CreateFoldIndex64(const int shift, const int mask) {
+      return [=](IRBuilder<> Builder, Value *V)->Value * {
+         Value *index = CreateAddress64(Builder, V);
+         index = Builder.CreateLShr(index, Builder.getInt64(shift));
+         index = Builder.CreateXor(index,
+                           Builder.CreateLShr(index, Builder.getInt64(32)));
+         index = Builder.CreateXor(index,
+                           Builder.CreateLShr(index, Builder.getInt64(16)));
+         index = Builder.CreateTrunc(index, Builder.getInt32Ty());
+         return Builder.CreateAnd(index, Builder.getInt32(mask));
       };
    }
 };
@@ -0,0 +1,47 @@
+//===- HashConstants.h - Constants of the 64-bit address hashes -*- C++ -*-===//
+//
+// Multipliers and tabulation tables used by the 64-bit hashes in
+// HashBuilderFactory. They are kept free of LLVM so that offline models of
+// the signatures (ddp-sigsim) compute exactly the same hashes.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _HASH_CONSTANTS_H_
+#define _HASH_CONSTANTS_H_
+
+#include <stdint.h>
+
+namespace ddphash {
+
+// Odd 64-bit multipliers for multiply-shift hashing, one per bank. Banks
+// beyond the end of the list reuse it from the start.
+static const uint64_t MultiplyShiftSeeds[] = {
+  0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+  0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+static const unsigned NumMultiplyShiftSeeds =
+    sizeof(MultiplyShiftSeeds) / sizeof(MultiplyShiftSeeds[0]);
+
+inline uint64_t multiplyShiftSeed(unsigned bank) {
+  return MultiplyShiftSeeds[bank % NumMultiplyShiftSeeds];
+}
+
+inline uint64_t splitmix64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// Tabulation (H3) hashing XORs one table entry per address byte.
+static const unsigned TabulationBytes = 8;
+
+/// Entry for the given byte position and byte value of the table with the
+/// given seed.
+inline uint32_t tabulationEntry(uint64_t seed, unsigned byte, unsigned value) {
+  return (uint32_t)(splitmix64(seed ^ ((uint64_t)byte << 8 | value)) >> 32);
+}
+
+} // end namespace ddphash
+
+#endif    // _HASH_CONSTANTS_H_
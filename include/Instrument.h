@@ -22,6 +22,7 @@
 #include "ProfileDBHelper.h"
 #include "BuildSignature.h"
 #include "GenerateQueries.h"
+#include <memory>
 #include <set>
 
 #define USEBUILDER
@@ -32,11 +33,27 @@ namespace llvm {
   typedef std::set<Instruction*> InstrSet;
   typedef std::vector<ReturnInst*> RetInstVecTy;
 
+  class LoopInfo;
+  class ScalarEvolution;
+
+  //The addresses First, First + Stride, ... (Count of them) an access makes
+  //over a run of its loop, and where to insert or check them instead.
+  struct AccessRange {
+    Instruction *Pos;
+    Value *First;
+    Value *Count;
+    Value *Stride;
+  };
+
  class SetInstrument {
  protected:
    ddp::Queries &AQ;
    Function &F;
    FunctionRegion Region;
+   //Per set regions, used instead of Region with -lazy-signatures.
+   std::map<unsigned int, std::unique_ptr<LazyFunctionRegion> > LazyRegions;
+   //Blocks the lazy regions split off their exit edges, to free sets in.
+   std::map<LazyFunctionRegion::Edge, BasicBlock*> SplitExits;
    LLVMContext& Context;
    Module& M;
    Instruction* pos;
@@ -61,6 +78,24 @@ namespace llvm {
    std::map<RefPair, AllocaInst*, RefPairCompare> queryVars;
 
    InstrSet inserted;
+   //Inserts redirected to a loop's private copy of their set.
+   std::map<Instruction*, Value*> LocalCopies;
+   //Inserts, and checks against a set, summarized for their whole loop.
+   std::map<Instruction*, AccessRange> RangeInserts;
+   std::map<RefPair, AccessRange, RefPairCompare> RangeChecks;
+   //Value numbers of addresses, and the inserts and checks they make
+   //redundant: inserts a dominating insert already made, checks that must
+   //hit, and checks answered by an earlier check in the same block.
+   std::map<std::pair<Type*, std::vector<Value*> >, Value*> AddressNumbers;
+   InstrSet CoveredInserts;
+   std::set<RefPair, RefPairCompare> KnownHits;
+   std::map<RefPair, Instruction*, RefPairCompare> CheckSources;
+   //The sets each load is checked against, for -multi-checks.
+   std::map<Instruction*, IntSet> LoadSets;
+   //log2 of the bytes each set tracks as one location, if not its own.
+   std::map<unsigned int, int> GranuleShifts;
+   //Allocas of the uninstrumented function, left alone by promotion.
+   std::set<AllocaInst*> OrigAllocas;
    
    //Map signature id to its population counter.
    std::map<unsigned long long, GlobalVariable *> populationCounterMap; 
@@ -85,6 +120,22 @@ namespace llvm {
    void clearChecked();
 
    static int traceStructSize(Value *val);
+
+   void createLazyRegions();
+   void createAccessRanges();
+   void createRangeSummaries(DominatorTree &DT, LoopInfo &LI,
+                             ScalarEvolution &SE);
+   void createLoopLocalCopies(LoopInfo &LI, ScalarEvolution &SE);
+   Value* numberAddress(Value *Ptr);
+   void createAddressNumbering(DominatorTree &DT);
+   Instruction* checkShared(Instruction *I, unsigned int set);
+   int granuleShiftOf(unsigned int set);
+   void assignGranularities();
+   void coalesceGranules();
+   void promoteInstrumentation();
+   template <typename AllocatePolicy>
+   AbstractSetInstrumentHelper<SImple> *createHelper(unsigned int set,
+                                                     SImple *Set);
  public:
    SetInstrument(ddp::Queries&, Function&, ProfileDBHelper&);
 
@@ -131,7 +131,7 @@ namespace llvm {
             ProfilerTable table=createFileTable();
             SQLite3Insert(fileDB,table,row);
           }
-          sqlite3_close(fileDB);
+          SQLite3Close(fileDB);
         }
       //  if(refID)
           //delete refID;
@@ -26,17 +26,21 @@ namespace llvm {
       int       i;
       int64_t   i64;
       double    d;
-      const char  *text;
     } val;
 
+    // Text values are owned by the column so that rows returned from a
+    // select can be copied and destroyed freely.
+    std::string text;
+
   public:
     int getInt()       { return val.i;    }
-    int getInt64()       { return val.i64;    }
+    int64_t getInt64() { return val.i64;  }
     double getDouble() { return val.d;    }
-    const char *getText()    { return val.text; }
+    const char *getText()    { return text.c_str(); }
+    const std::string &getName() { return name; }
 
     TableColumn(std::string aname, column_kind k)
-    :name(aname), kind(k) {}
+    :name(aname), kind(k) { val.i64 = 0; }
 
     TableColumn(int i, std::string aname=""):name(aname) {
       val.i = i;
@@ -44,14 +48,15 @@ namespace llvm {
     }
     TableColumn(int64_t i, std::string aname=""):name(aname) {
       val.i64 = i;
-      kind = SQL_INT;
+      kind = SQL_INT64;
     }
     TableColumn(double d, std::string aname=""):name(aname) {
       val.d = d;
       kind = SQL_DOUBLE;
     }
     TableColumn(const char *t, std::string aname=""):name(aname) {
-      val.text = strdup(t);
+      val.i64 = 0;
+      text = t ? t : "";
       kind = SQL_TEXT;
     }
     static TableColumn &createInt64(std::string name) {
@@ -79,11 +84,19 @@ namespace llvm {
        case SQL_INT: out << " = " << val.i; break;
        case SQL_INT64: out<< " = " << val.i64; break;
        case SQL_DOUBLE: out << " = " << val.d; break;
-       case SQL_TEXT: out << " like " << "\"" << val.text << "\""; break;
+       case SQL_TEXT: out << " like " << "\"" << text << "\""; break;
        }
        return ret + out.str();
     }
 
+    // Same as toConstraint, but leaves the value as a bind parameter so the
+    // resulting statement text depends only on the column, not its value.
+    std::string toBindConstraint() {
+      if (kind == SQL_TEXT)
+        return name + " like ?";
+      return name + " = ?";
+    }
+
     std::string toString(bool withType=true) {
       if (!withType)
         return name;
@@ -139,7 +152,18 @@ namespace llvm {
        return ret;
     }
 
-    std::string toBindString(bool withType=true) {
+    std::string toBindConstraint() {
+      std::vector<TableColumn>::iterator it;
+      std::string ret="";
+      for(it=row.begin(); it!=row.end(); it++) {
+        if (it!=row.begin())
+          ret = ret + " and ";
+        ret = ret + (*it).toBindConstraint();
+      }
+      return ret;
+    }
+
+    std::string toBindString() {
       std::vector<TableColumn>::iterator it;
       std::string ret="";
       for(it=row.begin(); it!=row.end(); it++) {
@@ -195,11 +219,121 @@ namespace llvm {
     void selectColumn(std::string);
   }
   */
+  /// SQLite3Statement - A prepared statement handed out by the statement
+  /// cache. Statements are reset and returned to the cache when released, so
+  /// repeated selects and inserts against the same table and column set are
+  /// only compiled once per database connection.
+  class SQLite3Statement {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    bool cached;
+    bool busy;
+
+  public:
+    SQLite3Statement(sqlite3 *adb, sqlite3_stmt *astmt, bool acached)
+    :db(adb), stmt(astmt), cached(acached), busy(false) {}
+
+    bool isBusy() { return busy; }
+    void setBusy(bool b) { busy = b; }
+
+    sqlite3_stmt *get() { return stmt; }
+    sqlite3 *getDB() { return db; }
+    bool isValid() { return stmt != NULL; }
+
+    bool bindInt(int idx, int v) {
+      return sqlite3_bind_int(stmt, idx, v) == SQLITE_OK;
+    }
+    bool bindInt64(int idx, int64_t v) {
+      return sqlite3_bind_int64(stmt, idx, (sqlite3_int64)v) == SQLITE_OK;
+    }
+    bool bindDouble(int idx, double v) {
+      return sqlite3_bind_double(stmt, idx, v) == SQLITE_OK;
+    }
+    bool bindText(int idx, const std::string &v) {
+      return sqlite3_bind_text(stmt, idx, v.c_str(), -1,
+                               SQLITE_TRANSIENT) == SQLITE_OK;
+    }
+
+    // Bind a single column according to its kind.
+    bool bind(int idx, TableColumn &c);
+
+    // Bind every column in the row, starting at parameter index first.
+    bool bind(TableRow &values, int first=1);
+
+    // Step, retrying while the database is locked or busy.
+    int step();
+
+    // Reset the statement and return it to the cache (or finalize it, if it
+    // was not cached). The statement must not be used afterwards.
+    void release();
+  };
+
+  /// SQLite3Cursor - Streams the rows of a select one at a time instead of
+  /// materializing the whole result. The layout of the current row follows
+  /// the select row the cursor was created from.
+  class SQLite3Cursor {
+    SQLite3Statement *stmt;
+    TableRow layout;
+    TableRow current;
+    bool done;
+
+    SQLite3Cursor(const SQLite3Cursor&);
+    SQLite3Cursor& operator=(const SQLite3Cursor&);
+
+  public:
+    SQLite3Cursor(SQLite3Statement *astmt, TableRow &select)
+    :stmt(astmt), layout(select), done(astmt == NULL) {}
+
+    SQLite3Cursor(SQLite3Cursor &&other)
+    :stmt(other.stmt), layout(other.layout), current(other.current),
+     done(other.done) {
+      other.stmt = NULL;
+      other.done = true;
+    }
+
+    ~SQLite3Cursor() { close(); }
+
+    bool isValid() { return stmt != NULL; }
+
+    // Advance to the next row. Returns false once the result is exhausted or
+    // an error occurred.
+    bool next();
+
+    // The row most recently produced by next().
+    TableRow &row() { return current; }
+
+    int getInt(int col) { return sqlite3_column_int(stmt->get(), col); }
+    int64_t getInt64(int col) {
+      return (int64_t)sqlite3_column_int64(stmt->get(), col);
+    }
+    double getDouble(int col) { return sqlite3_column_double(stmt->get(), col); }
+    const char *getText(int col) {
+      const unsigned char *t = sqlite3_column_text(stmt->get(), col);
+      return t ? (const char*)t : "";
+    }
+
+    // Release the underlying statement back to the cache.
+    void close();
+  };
+
   bool SQLite3Open(sqlite3 **db, std::string filename, bool create=false);
+  bool SQLite3Close(sqlite3 *db);
   bool SQLite3BeginImmediate(sqlite3 *db);
   bool SQLite3EndTransaction(sqlite3 *db);
   bool SQLite3CreateTable(sqlite3 *db, ProfilerTable &table);
+
+  // Look up (or compile and remember) the statement for key on db. A key
+  // names the table and column set of the statement, so it is independent of
+  // the values bound to it. Returns NULL if the statement does not compile.
+  SQLite3Statement *SQLite3Prepare(sqlite3 *db, const std::string &key,
+                                   const std::string &command);
+
+  // Finalize all cached statements of db. SQLite3Close does this for you.
+  void SQLite3FinalizeStatements(sqlite3 *db);
+
   bool SQLite3Insert(sqlite3 *db, ProfilerTable &table, TableRow &values);
+  SQLite3Cursor SQLite3Query(sqlite3 *db, ProfilerTable &table,
+                             TableRow &select, TableRow &constraints);
   std::vector<TableRow> SQLite3Select(sqlite3 *db, ProfilerTable &table,
                                   TableRow &select, TableRow &constraints);
 }
@@ -19,6 +19,8 @@ class SImpleFactory {
   static SImple *CreateHybridSignature(unsigned int bits);
   static SImple *CreateDynStructSignature(unsigned int bits,
                                           unsigned int structSize);
+  static SImple *CreateDoubleHashSignature(unsigned int bits);
+  static SImple *CreateBlockedSignature(unsigned int bits);
 
   //static SetInstrument *CreateSimpleSignature(int bits);
   //static SetInstrument *CreateSimpleSignatureWithKnuthHash(int bits);
@@ -26,10 +28,20 @@ class SImpleFactory {
   //static SetInstrument *CreateArraySignature(int bits);
   //static SetInstrument *CreateArraySignatureWithKnuthHash(int bits);
 
-  static SImple *CreateLibCallSignature();
+  static SImple *CreateLibCallSignature(unsigned int bits = 2048);
   static SImple *CreatePerfectSet();
   static SImple *CreateRangeSet();
   static SImple *CreateHashTableSet();
+  static SImple *CreateCuckooSet(unsigned int bits);
+  static SImple *CreateShadowSet(unsigned int granuleBytes = 4);
+
+  /// Returns S with its checks emitted branch free or not, whatever the
+  /// set kind prefers; lets ddp-sigbench compare the two.
+  static SImple *WithPredicatedChecks(SImple *S, bool predicated);
+
+  /// The context that the sets' types are created in. Modules that a set
+  /// generates code into must belong to it.
+  static LLVMContext &getContext();
 };
 
 #endif     // SETINSTRUMENTFACTORY_H
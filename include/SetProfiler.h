@@ -37,6 +37,11 @@ namespace llvm {
 
 void initializeSetProfilerPass(PassRegistry&);
 
+/// Function attribute on the runtime bodies that ddp -ddp-runtime-bc links
+/// into the module. They are the runtime, not the program, so SetProfiler
+/// neither profiles them nor hooks their frees.
+const char *const DDPRuntimeFnAttr = "ddp-runtime";
+
 class SetProfiler : public ModulePass {
  private:
   std::set<Function*> fList;
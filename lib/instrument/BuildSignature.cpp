@@ -18,11 +18,17 @@
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/TypeBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "BuildSignature.h"
 #include "SetInstrumentFactory.h"
+#include <algorithm>
+#include <map>
+#include <set>
 #include <string>
 #include <sstream>
 #include <iostream>
@@ -39,19 +45,233 @@ static LLVMContext &getGlobalContext() {
 
 ///=============================================================================
 
+// Below this size clearing the whole buffer costs about as much as tracking.
+static const unsigned MinTrackedPoolBytes = 512;
+
+Value* SImple::allocatePooled(IRBuilder<> Builder) {
+	unsigned bytes = getPooledBytes();
+	if (bytes == 0)
+		return allocateLocal(Builder);
+
+	// The dirty mask has 64 bits; pick the smallest chunk (at least a cache
+	// line) that lets them cover the buffer.
+	int chunkShift = 6;
+	while ((64ULL << chunkShift) < bytes)
+		chunkShift++;
+	if (bytes < MinTrackedPoolBytes || !trackDirtyChunks(chunkShift))
+		chunkShift = -1;
+
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Constant *AcquireFn = M->getOrInsertFunction("SigPool_Acquire",
+			Builder.getInt8PtrTy(), Builder.getInt32Ty(), Builder.getInt32Ty(),
+			(Type*) 0);
+	std::vector<Value *> Args(2);
+	Args[0] = Builder.getInt32(bytes);
+	Args[1] = Builder.getInt32(chunkShift);
+	ArrayRef<Value*> args(Args);
+	return initPooled(Builder, Builder.CreateCall(AcquireFn, args));
+}
+
+void SImple::freePooled(IRBuilder<> Builder, Value *Signature) {
+	if (getPooledBytes() == 0) {
+		freeSet(Builder, Signature);
+		return;
+	}
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Constant *ReleaseFn = M->getOrInsertFunction("SigPool_Release",
+			Builder.getVoidTy(), Builder.getInt8PtrTy(), (Type*) 0);
+	Builder.CreateCall(ReleaseFn,
+			Builder.CreateBitCast(Signature, Builder.getInt8PtrTy()));
+}
+
+// The mask is the i64 just in front of the buffer (see SigPool.cpp).
+void SImple::markDirtyChunk(IRBuilder<> &Builder, Value *Sign, Value *Word,
+		int chunkShift) {
+	Value *base = Builder.CreatePtrToInt(Sign, Builder.getInt64Ty());
+	Value *offset = Builder.CreateSub(
+			Builder.CreatePtrToInt(Word, Builder.getInt64Ty()), base);
+	Value *bit = Builder.CreateShl(Builder.getInt64(1),
+			Builder.CreateLShr(offset, Builder.getInt64(chunkShift)));
+	Value *maskPtr = Builder.CreateGEP(
+			Builder.CreateBitCast(Sign, Builder.getInt64Ty()->getPointerTo()),
+			Builder.getInt32(-1));
+	Value *mask = Builder.CreateLoad(maskPtr);
+	Builder.CreateStore(Builder.CreateOr(mask, bit), maskPtr);
+}
+
+// Builder ends up where it was, which is now the head of the block after the
+// loop.
+Value* SImple::emitRangeLoop(IRBuilder<> &Builder, Value *First, Value *Count,
+		Value *Stride, std::function<Value*(IRBuilder<> &, Value *)> Body) {
+	Value *base = Builder.CreateBitCast(First, Builder.getInt8PtrTy());
+	BasicBlock *Pre = Builder.GetInsertBlock();
+	BasicBlock *Done = Pre->splitBasicBlock(Builder.GetInsertPoint(),
+			Pre->getName() + ".range");
+	BasicBlock *Loop = BasicBlock::Create(Builder.getContext(), "range.loop",
+			Pre->getParent(), Done);
+
+	// splitBasicBlock puts in a terminator for us (argh!) so we must remove it!
+	Pre->getTerminator()->eraseFromParent();
+	IRBuilder<>(Pre).CreateBr(Loop);
+
+	IRBuilder<> LB(Loop);
+	PHINode *i = LB.CreatePHI(LB.getInt64Ty(), 2);
+	PHINode *acc = LB.CreatePHI(LB.getInt32Ty(), 2);
+	i->addIncoming(LB.getInt64(0), Pre);
+	acc->addIncoming(LB.getInt32(0), Pre);
+	Value *res = Body(LB, LB.CreateGEP(base, LB.CreateMul(i, Stride)));
+	Value *next = LB.CreateAdd(i, LB.getInt64(1));
+	i->addIncoming(next, Loop);
+	if (res) {
+		res = LB.CreateOr(acc, res);
+		acc->addIncoming(res, Loop);
+	} else {
+		acc->eraseFromParent();
+	}
+	LB.CreateCondBr(LB.CreateICmpULT(next, Count), Loop, Done);
+
+	Builder.SetInsertPoint(Done, Done->getFirstInsertionPt());
+	return res;
+}
+
+// One iteration per word, so a copy of any size costs a few lines of IR.
+void SImple::mergeWords(IRBuilder<> Builder, Value *Sign, Value *Other,
+		Type *WordTy, uint64_t numWords, Value *DirtyBase, int dirtyShift) {
+	Type *PtrTy = WordTy->getPointerTo();
+	Value *Dst = Builder.CreateBitCast(Sign, PtrTy);
+	Value *Src = Builder.CreateBitCast(Other, PtrTy);
+	BasicBlock *Pre = Builder.GetInsertBlock();
+	BasicBlock *Done = Pre->splitBasicBlock(Builder.GetInsertPoint(),
+			Pre->getName() + ".merged");
+	BasicBlock *Loop = BasicBlock::Create(Builder.getContext(), "merge.loop",
+			Pre->getParent(), Done);
+
+	// splitBasicBlock puts in a terminator for us (argh!) so we must remove it!
+	Pre->getTerminator()->eraseFromParent();
+	IRBuilder<>(Pre).CreateBr(Loop);
+
+	IRBuilder<> LB(Loop);
+	PHINode *i = LB.CreatePHI(LB.getInt64Ty(), 2);
+	i->addIncoming(LB.getInt64(0), Pre);
+	Value *word = LB.CreateLoad(LB.CreateGEP(Src, i));
+	Value *dst = LB.CreateGEP(Dst, i);
+	LB.CreateStore(LB.CreateOr(LB.CreateLoad(dst), word), dst);
+	if (dirtyShift >= 0) {
+		// Only the chunks of words the copy has bits in change.
+		Value *offset = LB.CreateSub(LB.CreatePtrToInt(dst, LB.getInt64Ty()),
+				LB.CreatePtrToInt(DirtyBase, LB.getInt64Ty()));
+		Value *bit = LB.CreateShl(LB.CreateZExt(LB.CreateICmpNE(word,
+				Constant::getNullValue(WordTy)), LB.getInt64Ty()),
+				LB.CreateLShr(offset, LB.getInt64(dirtyShift)));
+		Value *maskPtr = LB.CreateGEP(
+				LB.CreateBitCast(DirtyBase, LB.getInt64Ty()->getPointerTo()),
+				LB.getInt32(-1));
+		LB.CreateStore(LB.CreateOr(LB.CreateLoad(maskPtr), bit), maskPtr);
+	}
+	Value *next = LB.CreateAdd(i, LB.getInt64(1));
+	i->addIncoming(next, Loop);
+	LB.CreateCondBr(LB.CreateICmpULT(next, LB.getInt64(numWords)), Loop, Done);
+}
+
+void SImple::insertRange(IRBuilder<> Builder, Value *Signature, Value *First,
+		Value *Count, Value *Stride) {
+	emitRangeLoop(Builder, First, Count, Stride,
+			[&](IRBuilder<> &B, Value *V) -> Value* {
+				insertPointer(B, Signature, V);
+				return nullptr;
+			});
+}
+
+Value* SImple::checkRange(IRBuilder<> Builder, Value *Signature, Value *First,
+		Value *Count, Value *Stride) {
+	return emitRangeLoop(Builder, First, Count, Stride,
+			[&](IRBuilder<> &B, Value *V) {
+				return checkMembership(B, Signature, V);
+			});
+}
+
+void SImple::insertRangeOrFill(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride, uint64_t Limit,
+		std::function<void(IRBuilder<> &)> Fill) {
+	Value *full = Builder.CreateICmpUGT(Count, Builder.getInt64(Limit));
+	TerminatorInst *FillTerm, *LoopTerm;
+	SplitBlockAndInsertIfThenElse(full, &*Builder.GetInsertPoint(), &FillTerm,
+			&LoopTerm);
+
+	IRBuilder<> FB(FillTerm);
+	Fill(FB);
+	SImple::insertRange(IRBuilder<>(LoopTerm), Signature, First, Count, Stride);
+}
+
+Value* SImple::checkRangeOrHit(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride, uint64_t Limit, Value *Hit) {
+	BasicBlock *Head = Builder.GetInsertBlock();
+	Value *small = Builder.CreateICmpULE(Count, Builder.getInt64(Limit));
+	TerminatorInst *LoopTerm = SplitBlockAndInsertIfThen(small,
+			&*Builder.GetInsertPoint(), false);
+
+	Value *res = SImple::checkRange(IRBuilder<>(LoopTerm), Signature, First,
+			Count, Stride);
+	BasicBlock *Tail = LoopTerm->getSuccessor(0);
+	IRBuilder<> TB(Tail, Tail->begin());
+	PHINode *phi = TB.CreatePHI(TB.getInt32Ty(), 2);
+	phi->addIncoming(Hit ? Hit : TB.getInt32(1), Head);
+	phi->addIncoming(res, LoopTerm->getParent());
+	return phi;
+}
+
+void SImple::fillSignature(IRBuilder<> &Builder, Value *Sign, uint64_t bytes,
+		Value *DirtyBase, int dirtyShift) {
+	Builder.CreateMemSet(Sign, Builder.getInt8(0xff), Builder.getInt64(bytes),
+			4);
+	if (dirtyShift >= 0) {
+		Value *maskPtr = Builder.CreateGEP(
+				Builder.CreateBitCast(DirtyBase,
+						Builder.getInt64Ty()->getPointerTo()),
+				Builder.getInt32(-1));
+		Builder.CreateStore(Builder.getInt64(-1), maskPtr);
+	}
+}
+
+std::vector<Value*> SImple::checkMembershipMulti(IRBuilder<> Builder,
+		const std::vector<Value*> &Signs, Value *V) {
+	std::vector<Value*> res;
+	Instruction *pos = &*Builder.GetInsertPoint();
+	// checkMembership may split the block, so start over at pos each time.
+	for (auto *Sign : Signs)
+		res.push_back(checkMembership(IRBuilder<>(pos), Sign, V));
+	return res;
+}
+
+///=============================================================================
+
 SimpleSignature::SimpleSignature(int aNumBits, const HashBuilder &hb) :
 																 numBits(aNumBits), Ty(NULL),
-																 hashBuilderLambda(hb) {
-	Ty = Type::getIntNTy(getGlobalContext(), numBits);
+																 hashBuilderLambda(hb), words(NULL) {
+	if (numBits > NativeBits) {
+		assert(numBits % NativeBits == 0 && "Use a multiple of 64 bits");
+		words = new ArraySignature(NativeBits, numBits / NativeBits, hb);
+		Ty = Type::getIntNTy(getGlobalContext(), NativeBits);
+	} else {
+		Ty = Type::getIntNTy(getGlobalContext(), numBits);
+	}
+}
+
+SimpleSignature::~SimpleSignature() {
+	delete words;
 }
 
 Value* SimpleSignature::allocateLocal(IRBuilder<> Builder) {
+	if (words)
+		return words->allocateLocal(Builder);
 	Value *AI = Builder.CreateAlloca(Ty, Builder.getInt32(1), "SimpleSignature");
 	Builder.CreateStore(ConstantInt::get(Ty, 0), AI);
 	return AI;
 }
 
 Value* SimpleSignature::allocateGlobal(IRBuilder<> Builder) {
+	if (words)
+		return words->allocateGlobal(Builder);
 	GlobalVariable *GV = new GlobalVariable(Ty, false, GlobalValue::ExternalLinkage,
 																					ConstantInt::get(Ty, 0));
 	BasicBlock *BB = Builder.GetInsertBlock();
@@ -63,6 +283,10 @@ Value* SimpleSignature::allocateGlobal(IRBuilder<> Builder) {
 
 void SimpleSignature::insertPointer(IRBuilder<> Builder, Value *Sign,
 		Value *V) {
+	if (words) {
+		words->insertPointer(Builder, Sign, V);
+		return;
+	}
 	Value *index = Builder.CreateZExt(hashBuilderLambda(Builder, V), Ty);
 	Value *load = Builder.CreateLoad(Sign);
 	Value *val = Builder.CreateZExt(
@@ -73,6 +297,8 @@ void SimpleSignature::insertPointer(IRBuilder<> Builder, Value *Sign,
 
 Value * SimpleSignature::checkMembership(IRBuilder<> Builder,
 																				 Value *Sign, Value *V) {
+	if (words)
+		return words->checkMembership(Builder, Sign, V);
 	// Probably not as efficient as it could b
 	Value *index = Builder.CreateZExt(hashBuilderLambda(Builder, V), Ty);
 	Value *load = Builder.CreateLoad(Sign);
@@ -85,6 +311,39 @@ Value * SimpleSignature::checkMembership(IRBuilder<> Builder,
 	return Builder.CreateZExt(val, Builder.getInt32Ty());
 }
 
+void SimpleSignature::mergeSignature(IRBuilder<> Builder, Value *Sign,
+		Value *Other) {
+	if (words) {
+		words->mergeSignature(Builder, Sign, Other);
+		return;
+	}
+	Value *load = Builder.CreateLoad(Sign);
+	Builder.CreateStore(Builder.CreateOr(load, Builder.CreateLoad(Other)), Sign);
+}
+
+void SimpleSignature::insertRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	if (words) {
+		words->insertRange(Builder, Sign, First, Count, Stride);
+		return;
+	}
+	insertRangeOrFill(Builder, Sign, First, Count, Stride, numBits,
+			[&](IRBuilder<> &B) {
+				B.CreateStore(Constant::getAllOnesValue(Ty), Sign);
+			});
+}
+
+Value* SimpleSignature::checkRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	if (words)
+		return words->checkRange(Builder, Sign, First, Count, Stride);
+	// The whole signature is one register, so a large range hits exactly
+	// when any bit at all is set.
+	Value *any = Builder.CreateZExt(Builder.CreateICmpNE(Builder.CreateLoad(Sign),
+			ConstantInt::get(Ty, 0)), Builder.getInt32Ty());
+	return checkRangeOrHit(Builder, Sign, First, Count, Stride, numBits, any);
+}
+
 Type * SimpleSignature::getSignatureType() {
 	return PointerType::get(Ty, 0);
 }
@@ -99,7 +358,8 @@ std::string SimpleSignature::getName() {
 
 ArraySignature::ArraySignature(int anumBitsEl, int alength,
 		const HashBuilder &hb) :
-		numBitsEl(anumBitsEl), length(alength), hashBuilderLambda(hb) {
+		numBitsEl(anumBitsEl), length(alength), dirtyShift(-1),
+		hashBuilderLambda(hb) {
 	ElTy = Type::getIntNTy(getGlobalContext(), numBitsEl);
 	SignTy = PointerType::get(ElTy, 0);
 
@@ -141,7 +401,7 @@ Value* ArraySignature::allocateLocal(IRBuilder<> Builder) {
 	Value *AI = Builder.CreateAlloca(ElTy, Builder.getInt32(length),
 																								"ArraySignature");
 	Builder.CreateMemSet(AI, Builder.getInt8(0),
-											 Builder.getInt64(length * 4), 4);
+											 Builder.getInt64(length * numBitsEl / 8), 4);
 	return AI;
 }
 
@@ -157,12 +417,38 @@ Value* ArraySignature::allocateGlobal(IRBuilder<> Builder) {
 	index[1] = Builder.getInt32(0);
 	ArrayRef<Value*> indices(index);
 	Value *gep = Builder.CreateGEP(GV, indices);
-	Builder.CreateMemSet(gep, Builder.getInt8(0), Builder.getInt64(length * 4), 4);
+	Builder.CreateMemSet(gep, Builder.getInt8(0),
+			Builder.getInt64(length * numBitsEl / 8), 4);
 	return gep;
 }
 
+// The element with only the index's bit set. Wide elements shift in their
+// own type: an i32 shift by 32 or more is undefined.
+Value* ArraySignature::bitMask(IRBuilder<> &Builder, Value *index) {
+	Value *bitOffset = Builder.CreateAnd(index, Builder.getInt32(pow2mask));
+	if (numBitsEl > 32)
+		return Builder.CreateShl(ConstantInt::get(ElTy, 1),
+				Builder.CreateZExt(bitOffset, ElTy));
+
+	Value *mask = Builder.CreateBinOp(Instruction::Shl, Builder.getInt32(1),
+			bitOffset);
+	if (numBitsEl < 32)
+		mask = Builder.CreateTrunc(mask, ElTy);
+	return mask;
+}
+
 void ArraySignature::insertPointer(IRBuilder<> Builder, Value *Sign, Value *V) {
-	Value *index = hashBuilderLambda(Builder, V);
+	Value *gep = insertWord(Builder, Sign, V);
+	if (dirtyShift >= 0)
+		markDirtyChunk(Builder, Sign, gep, dirtyShift);
+}
+
+Value* ArraySignature::insertWord(IRBuilder<> Builder, Value *Sign, Value *V) {
+	return insertIndex(Builder, Sign, hashBuilderLambda(Builder, V));
+}
+
+Value* ArraySignature::insertIndex(IRBuilder<> Builder, Value *Sign,
+		Value *index) {
 	assert(isPow2 && "Use element that's power of 2 for now!");
 
 // Turn index into a array index
@@ -183,23 +469,20 @@ void ArraySignature::insertPointer(IRBuilder<> Builder, Value *Sign, Value *V) {
 		gep = Builder.CreateGEP(Sign, arrayOffset);
 	}
 
-	Value *bitOffset = Builder.CreateAnd(index, Builder.getInt32(pow2mask));
-	Value *orVal = Builder.CreateBinOp(Instruction::Shl, Builder.getInt32(1),
-			bitOffset);
-
-	if (numBitsEl > 32)
-		orVal = Builder.CreateZExt(orVal, ElTy);
-	else if (numBitsEl < 32)
-		orVal = Builder.CreateTrunc(orVal, ElTy);
+	Value *orVal = bitMask(Builder, index);
 
 	Value *word = Builder.CreateLoad(gep);
 	Builder.CreateStore(Builder.CreateOr(word, orVal), gep);
+	return gep;
 }
 
 Value* ArraySignature::checkMembership(IRBuilder<> Builder, Value *Sign,
 		Value *V) {
-	Value *index = hashBuilderLambda(Builder, V);
+	return checkIndex(Builder, Sign, hashBuilderLambda(Builder, V));
+}
 
+Value* ArraySignature::checkIndex(IRBuilder<> Builder, Value *Sign,
+		Value *index) {
 	assert(isPow2 && "Use element that's power of 2 for now!");
 
 	// Turn index into a array index
@@ -219,14 +502,7 @@ Value* ArraySignature::checkMembership(IRBuilder<> Builder, Value *Sign,
 		gep = Builder.CreateGEP(Sign, arrayOffset);
 	}
 
-	Value *bitOffset = Builder.CreateAnd(index, Builder.getInt32(pow2mask));
-	Value *andVal = Builder.CreateBinOp(Instruction::Shl, Builder.getInt32(1),
-			bitOffset);
-
-	if (numBitsEl > 32)
-		andVal = Builder.CreateZExt(andVal, ElTy);
-	else if (numBitsEl < 32)
-		andVal = Builder.CreateTrunc(andVal, ElTy);
+	Value *andVal = bitMask(Builder, index);
 
 	Value *word = Builder.CreateLoad(gep);
 	Value *val = Builder.CreateAnd(word, andVal);
@@ -235,6 +511,59 @@ Value* ArraySignature::checkMembership(IRBuilder<> Builder, Value *Sign,
 	return Builder.CreateZExt(val, Builder.getInt32Ty());
 }
 
+void ArraySignature::mergeSignature(IRBuilder<> Builder, Value *Sign,
+		Value *Other) {
+	mergeWords(Builder, Sign, Other, ElTy, length, Sign, dirtyShift);
+}
+
+void ArraySignature::insertRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	insertRangeOrFill(Builder, Sign, First, Count, Stride, length * numBitsEl,
+			[&](IRBuilder<> &B) {
+				fillSignature(B, Sign, length * numBitsEl / 8, Sign, dirtyShift);
+			});
+}
+
+Value* ArraySignature::checkRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	return checkRangeOrHit(Builder, Sign, First, Count, Stride,
+			length * numBitsEl);
+}
+
+std::vector<Value*> ArraySignature::checkIndexMulti(IRBuilder<> Builder,
+		const std::vector<Value*> &Signs, Value *index) {
+	std::vector<Value*> res;
+	if (Signs.size() < MinGatherWidth) {
+		for (auto *Sign : Signs)
+			res.push_back(checkIndex(Builder, Sign, index));
+		return res;
+	}
+
+	// The index, and so the word offset and bit, is the same in every
+	// signature: gather the words and test them all with one vector AND.
+	unsigned n = Signs.size();
+	Value *arrayOffset = Builder.CreateBinOp(Instruction::LShr, index,
+			Builder.getInt32(pow2));
+	Value *ptrs = UndefValue::get(VectorType::get(getSignatureType(), n));
+	for (unsigned i = 0; i < n; i++)
+		ptrs = Builder.CreateInsertElement(ptrs,
+				Builder.CreateGEP(Signs[i], arrayOffset), Builder.getInt32(i));
+	Value *words = Builder.CreateMaskedGather(ptrs, numBitsEl / 8);
+	Value *mask = Builder.CreateVectorSplat(n, bitMask(Builder, index));
+	Value *hits = Builder.CreateICmpNE(Builder.CreateAnd(words, mask),
+			Constant::getNullValue(words->getType()));
+	for (unsigned i = 0; i < n; i++)
+		res.push_back(Builder.CreateZExt(
+				Builder.CreateExtractElement(hits, Builder.getInt32(i)),
+				Builder.getInt32Ty()));
+	return res;
+}
+
+std::vector<Value*> ArraySignature::checkMembershipMulti(IRBuilder<> Builder,
+		const std::vector<Value*> &Signs, Value *V) {
+	return checkIndexMulti(Builder, Signs, hashIndex(Builder, V));
+}
+
 Type *ArraySignature::getSignatureType() {
 	return PointerType::get(ElTy, 0);
 }
@@ -247,7 +576,8 @@ std::string ArraySignature::getName() {
 
 ///=======================================================================
 BankedSignature::BankedSignature(int nBanks, int anumBitsEl, int alength) :
-																	numBanks(nBanks), numBitsEl(anumBitsEl) {
+																	numBanks(nBanks), numBitsEl(anumBitsEl),
+																	dirtyShift(-1) {
 	ElTy = Type::getIntNTy(getGlobalContext(), numBitsEl);
 	SignTy = PointerType::get(ElTy, 0);
 
@@ -267,8 +597,9 @@ BankedSignature::BankedSignature(int nBanks, int anumBitsEl, int alength) :
 }
 
 BankedSignature::BankedSignature(int anumBitsEl, const std::vector<int> &lengths,
-																 std::vector<HashBuilder> &hashes) :
-																												numBitsEl(anumBitsEl) {
+																 const std::vector<HashBuilder> &hashes) :
+																												numBitsEl(anumBitsEl),
+																												dirtyShift(-1) {
 	ElTy = Type::getIntNTy(getGlobalContext(), numBitsEl);
 	SignTy = PointerType::get(ElTy, 0);
 
@@ -300,8 +631,8 @@ Value* BankedSignature::allocateLocal(IRBuilder<> Builder) {
 	}
 	Value *AI = Builder.CreateAlloca(ElTy, Builder.getInt32(totalLength),
 																											"BankedSignature");
-	Builder.CreateMemSet(
-					AI, Builder.getInt8(0), Builder.getInt64(totalLength * 4), 4);
+	Builder.CreateMemSet(AI, Builder.getInt8(0),
+			Builder.getInt64(totalLength * numBitsEl / 8), 4);
 	return AI;
 }
 
@@ -321,12 +652,18 @@ Value* BankedSignature::allocateGlobal(IRBuilder<> Builder) {
 	index[1] = Builder.getInt32(0);
 	ArrayRef<Value*> indices(index);
 	Value *gep = Builder.CreateGEP(GV, indices);
-	Builder.CreateMemSet(gep, Builder.getInt8(0),Builder.getInt64(totalLength * 4), 4);
+	Builder.CreateMemSet(gep, Builder.getInt8(0),
+			Builder.getInt64(totalLength * numBitsEl / 8), 4);
 	return gep;
 }
 
 void BankedSignature::insertPointer(IRBuilder<> Builder,
 																		Value *Sign, Value *V) {
+	insertBanks(Builder, Sign, V, Sign);
+}
+
+void BankedSignature::insertBanks(IRBuilder<> Builder, Value *Sign, Value *V,
+		Value *DirtyBase) {
 	int cumulativeLength = 0;
 	for (int i = 0; i < numBanks; i++) {
 		Value *index[1];
@@ -334,11 +671,59 @@ void BankedSignature::insertPointer(IRBuilder<> Builder,
 		ArrayRef<Value*> indices(index);
 
 		Value *gep = Builder.CreateGEP(Sign, indices);
-		banks[i]->insertPointer(Builder, gep, V);
+		Value *word = banks[i]->insertWord(Builder, gep, V);
+		if (dirtyShift >= 0)
+			markDirtyChunk(Builder, DirtyBase, word, dirtyShift);
 		cumulativeLength += banks[i]->getLength();
 	}
 }
 
+void BankedSignature::mergeSignature(IRBuilder<> Builder, Value *Sign,
+		Value *Other) {
+	mergeWords(Builder, Sign, Other, ElTy, getTotalLength(), Sign, dirtyShift);
+}
+
+unsigned long BankedSignature::getMinBankBits() {
+	unsigned long bits = ~0UL;
+	for (auto &it : banks)
+		bits = std::min(bits, (unsigned long) it->getLength() * numBitsEl);
+	return bits;
+}
+
+void BankedSignature::insertRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	insertBanksRange(Builder, Sign, First, Count, Stride, Sign);
+}
+
+void BankedSignature::insertBanksRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride, Value *DirtyBase) {
+	Value *full = Builder.CreateICmpUGT(Count,
+			Builder.getInt64(getMinBankBits()));
+	TerminatorInst *FillTerm, *LoopTerm;
+	SplitBlockAndInsertIfThenElse(full, &*Builder.GetInsertPoint(), &FillTerm,
+			&LoopTerm);
+
+	IRBuilder<> FB(FillTerm);
+	fillSignature(FB, Sign, getTotalLength() * numBitsEl / 8, DirtyBase,
+			dirtyShift);
+
+	IRBuilder<> LB(LoopTerm);
+	emitRangeLoop(LB, First, Count, Stride,
+			[&](IRBuilder<> &B, Value *V) -> Value* {
+				if (DirtyBase == Sign)
+					insertPointer(B, Sign, V);
+				else
+					insertBanks(B, Sign, V, DirtyBase);
+				return nullptr;
+			});
+}
+
+Value* BankedSignature::checkRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	return checkRangeOrHit(Builder, Sign, First, Count, Stride,
+			getMinBankBits());
+}
+
 Value* BankedSignature::checkMembership(IRBuilder<> Builder,
 																				Value *Sign, Value *V) {
 	Value *a = NULL;
@@ -358,6 +743,25 @@ Value* BankedSignature::checkMembership(IRBuilder<> Builder,
 	return a;
 }
 
+// Each bank hashes V once for all of the signatures.
+std::vector<Value*> BankedSignature::checkMembershipMulti(IRBuilder<> Builder,
+		const std::vector<Value*> &Signs, Value *V) {
+	std::vector<Value*> res(Signs.size(), NULL);
+	int cumulativeLength = 0;
+	for (int i = 0; i < numBanks; i++) {
+		std::vector<Value*> bankSigns;
+		for (auto *Sign : Signs)
+			bankSigns.push_back(Builder.CreateGEP(Sign,
+					Builder.getInt32(cumulativeLength)));
+		std::vector<Value*> bankRes = banks[i]->checkIndexMulti(Builder,
+				bankSigns, banks[i]->hashIndex(Builder, V));
+		for (unsigned s = 0; s < Signs.size(); s++)
+			res[s] = res[s] ? Builder.CreateAnd(res[s], bankRes[s]) : bankRes[s];
+		cumulativeLength += banks[i]->getLength();
+	}
+	return res;
+}
+
 Value* BankedSignature::getSignatureInfo(sigInfoType infoType,
 																				 IRBuilder<> Builder,
 																				 Value *Signature,
@@ -405,17 +809,282 @@ std::string BankedSignature::getName() {
 
 ///=============================================================================
 
-LibCallSignature::LibCallSignature() {}
+// The banks only provide storage and bit access; their own hash is unused.
+DoubleHashSignature::DoubleHashSignature(int nBanks, int anumBitsEl,
+		int alength, uint64_t aseed) :
+		BankedSignature(anumBitsEl, std::vector<int>(nBanks, alength),
+				std::vector<HashBuilder>(nBanks,
+						HashBuilderFactory::CreateZeroIndex())),
+		seed(aseed) {
+	int tot = anumBitsEl * alength;
+	indexBits = 0;
+	while (tot >>= 1)
+		++indexBits;
+	assert(indexBits > 0 && indexBits < 32 && "Unsupported bank size");
+}
+
+// One multiply hashes the address: h1 is the top indexBits bits of the
+// product and h2 the indexBits bits below them. h2 is made odd so that, for
+// power of 2 banks, h1 + i*h2 never repeats an index within a cycle.
+void DoubleHashSignature::hashPair(IRBuilder<> &Builder, Value *V,
+		Value *&h1, Value *&h2) {
+	Value *x = HashBuilderFactory::CreateAddress64(Builder, V);
+	x = Builder.CreateLShr(x, Builder.getInt64(2));
+	x = Builder.CreateMul(x, Builder.getInt64(seed));
+	h1 = Builder.CreateTrunc(Builder.CreateLShr(x,
+			Builder.getInt64(64 - indexBits)), Builder.getInt32Ty());
+	h2 = Builder.CreateTrunc(Builder.CreateLShr(x,
+			Builder.getInt64(64 - 2 * indexBits)), Builder.getInt32Ty());
+	h2 = Builder.CreateOr(h2, Builder.getInt32(1));
+}
+
+// Bank i+1 adds h2 to the running sum of bank i; only the masked value is
+// used to index, so wrapping around 2^32 does not matter.
+Value* DoubleHashSignature::nextIndex(IRBuilder<> &Builder, Value *&sum,
+		Value *h2) {
+	sum = Builder.CreateAdd(sum, h2);
+	return Builder.CreateAnd(sum, Builder.getInt32((1 << indexBits) - 1));
+}
+
+void DoubleHashSignature::insertPointer(IRBuilder<> Builder,
+		Value *Sign, Value *V) {
+	Value *h1, *h2;
+	hashPair(Builder, V, h1, h2);
+	Value *sum = h1;
+	int cumulativeLength = 0;
+	for (int i = 0; i < numBanks; i++) {
+		Value *gep = Builder.CreateGEP(Sign, Builder.getInt32(cumulativeLength));
+		Value *word = banks[i]->insertIndex(Builder, gep,
+				i == 0 ? h1 : nextIndex(Builder, sum, h2));
+		if (dirtyShift >= 0)
+			markDirtyChunk(Builder, Sign, word, dirtyShift);
+		cumulativeLength += banks[i]->getLength();
+	}
+}
+
+Value* DoubleHashSignature::checkMembership(IRBuilder<> Builder,
+		Value *Sign, Value *V) {
+	Value *h1, *h2;
+	hashPair(Builder, V, h1, h2);
+	Value *sum = h1;
+	Value *a = NULL;
+	int cumulativeLength = 0;
+	for (int i = 0; i < numBanks; i++) {
+		Value *gep = Builder.CreateGEP(Sign, Builder.getInt32(cumulativeLength));
+		Value *res = banks[i]->checkIndex(Builder, gep,
+				i == 0 ? h1 : nextIndex(Builder, sum, h2));
+		if (a == NULL)
+			a = res;
+		else
+			a = Builder.CreateAnd(a, res);
+		cumulativeLength += banks[i]->getLength();
+	}
+	return a;
+}
+
+std::vector<Value*> DoubleHashSignature::checkMembershipMulti(
+		IRBuilder<> Builder, const std::vector<Value*> &Signs, Value *V) {
+	Value *h1, *h2;
+	hashPair(Builder, V, h1, h2);
+	Value *sum = h1;
+	std::vector<Value*> res(Signs.size(), NULL);
+	int cumulativeLength = 0;
+	for (int i = 0; i < numBanks; i++) {
+		Value *index = i == 0 ? h1 : nextIndex(Builder, sum, h2);
+		std::vector<Value*> bankSigns;
+		for (auto *Sign : Signs)
+			bankSigns.push_back(Builder.CreateGEP(Sign,
+					Builder.getInt32(cumulativeLength)));
+		std::vector<Value*> bankRes = banks[i]->checkIndexMulti(Builder,
+				bankSigns, index);
+		for (unsigned s = 0; s < Signs.size(); s++)
+			res[s] = res[s] ? Builder.CreateAnd(res[s], bankRes[s]) : bankRes[s];
+		cumulativeLength += banks[i]->getLength();
+	}
+	return res;
+}
+
+std::string DoubleHashSignature::getName() {
+	std::stringstream ss;
+	ss << "DoubleHashSignature_" << numBanks << "x"
+		 << numBitsEl * banks[0]->getLength();
+	return ss.str();
+}
+
+///=============================================================================
+
+BlockedSignature::BlockedSignature(int anumBlocks, int anumHashes,
+		uint64_t aseed) :
+		numBlocks(anumBlocks), numHashes(anumHashes), dirtyShift(-1),
+		seed(aseed) {
+	int tot = numBlocks;
+	blockBits = 0;
+	while (tot >>= 1)
+		++blockBits;
+	assert((1 << blockBits) == numBlocks && "Use a power of 2 blocks");
+	assert(blockBits + 9 * numHashes <= 64 && "Too many hashes per block");
+
+	Type *Int32Ty = Type::getInt32Ty(getGlobalContext());
+	BlockTy = VectorType::get(Int32Ty, BitsPerBlock / 32);
+	SignTy = PointerType::get(BlockTy, 0);
+}
+
+Value* BlockedSignature::allocateLocal(IRBuilder<> Builder) {
+	AllocaInst *AI = Builder.CreateAlloca(BlockTy, Builder.getInt32(numBlocks),
+			"BlockedSignature");
+	AI->setAlignment(BytesPerBlock);
+	Builder.CreateMemSet(AI, Builder.getInt8(0),
+			Builder.getInt64(numBlocks * BytesPerBlock), BytesPerBlock);
+	return AI;
+}
+
+void BlockedSignature::mergeSignature(IRBuilder<> Builder, Value *Sign,
+		Value *Other) {
+	mergeWords(Builder, Sign, Other, Builder.getInt32Ty(),
+			numBlocks * BitsPerBlock / 32, Sign, dirtyShift);
+}
+
+Value* BlockedSignature::allocateGlobal(IRBuilder<> Builder) {
+	ArrayType *AT = ArrayType::get(BlockTy, numBlocks);
+	GlobalVariable *GV = new GlobalVariable(AT, false, GlobalValue::ExternalLinkage,
+			Constant::getNullValue(AT));
+	GV->setAlignment(BytesPerBlock);
+	BasicBlock *BB = Builder.GetInsertBlock();
+	Module *M = BB->getParent()->getParent();
+	M->getGlobalList().push_back(GV);
+	Value *index[2];
+	index[0] = Builder.getInt32(0);
+	index[1] = Builder.getInt32(0);
+	ArrayRef<Value*> indices(index);
+	Value *gep = Builder.CreateGEP(GV, indices);
+	Builder.CreateMemSet(gep, Builder.getInt8(0),
+			Builder.getInt64(numBlocks * BytesPerBlock), BytesPerBlock);
+	return gep;
+}
+
+// Returns a pointer to the address's block and sets mask to the vector with
+// its k bits set. Bit j of the block is word j/32, bit j%32 of the vector.
+Value* BlockedSignature::blockAndMask(IRBuilder<> &Builder, Value *Sign,
+		Value *V, Value *&mask) {
+	const int lanes = BitsPerBlock / 32;
+	Value *x = HashBuilderFactory::CreateAddress64(Builder, V);
+	x = Builder.CreateLShr(x, Builder.getInt64(2));
+	x = Builder.CreateMul(x, Builder.getInt64(seed));
+
+	Value *block = Builder.getInt32(0);
+	if (blockBits > 0)
+		block = Builder.CreateTrunc(Builder.CreateLShr(x,
+				Builder.getInt64(64 - blockBits)), Builder.getInt32Ty());
+
+	std::vector<Constant*> laneIds;
+	for (int i = 0; i < lanes; i++)
+		laneIds.push_back(Builder.getInt32(i));
+	Value *lane = ConstantVector::get(laneIds);
+	Value *zero = Constant::getNullValue(BlockTy);
+
+	mask = zero;
+	for (int j = 0; j < numHashes; j++) {
+		int shift = 64 - blockBits - 9 * (j + 1);
+		Value *bit = Builder.CreateTrunc(Builder.CreateLShr(x,
+				Builder.getInt64(shift)), Builder.getInt32Ty());
+		bit = Builder.CreateAnd(bit, Builder.getInt32(BitsPerBlock - 1));
+		Value *word = Builder.CreateLShr(bit, Builder.getInt32(5));
+		Value *one = Builder.CreateShl(Builder.getInt32(1),
+				Builder.CreateAnd(bit, Builder.getInt32(31)));
+		Value *inWord = Builder.CreateICmpEQ(lane,
+				Builder.CreateVectorSplat(lanes, word));
+		mask = Builder.CreateOr(mask, Builder.CreateSelect(inWord,
+				Builder.CreateVectorSplat(lanes, one), zero));
+	}
+	return Builder.CreateGEP(Sign, block);
+}
+
+void BlockedSignature::insertRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	insertRangeOrFill(Builder, Sign, First, Count, Stride,
+			numBlocks * BitsPerBlock / numHashes,
+			[&](IRBuilder<> &B) {
+				fillSignature(B, Sign, numBlocks * BytesPerBlock, Sign, dirtyShift);
+			});
+}
+
+Value* BlockedSignature::checkRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	return checkRangeOrHit(Builder, Sign, First, Count, Stride,
+			numBlocks * BitsPerBlock / numHashes);
+}
+
+void BlockedSignature::insertPointer(IRBuilder<> Builder, Value *Sign,
+		Value *V) {
+	Value *mask;
+	Value *gep = blockAndMask(Builder, Sign, V, mask);
+	Value *block = Builder.CreateAlignedLoad(gep, BytesPerBlock);
+	Builder.CreateAlignedStore(Builder.CreateOr(block, mask), gep,
+			BytesPerBlock);
+	if (dirtyShift >= 0)
+		markDirtyChunk(Builder, Sign, gep, dirtyShift);
+}
+
+Value* BlockedSignature::checkMembership(IRBuilder<> Builder, Value *Sign,
+		Value *V) {
+	const int lanes = BitsPerBlock / 32;
+	Value *mask;
+	Value *gep = blockAndMask(Builder, Sign, V, mask);
+	Value *block = Builder.CreateAlignedLoad(gep, BytesPerBlock);
+	Value *hit = Builder.CreateICmpEQ(Builder.CreateAnd(block, mask), mask);
+	// All lanes must match: reduce the <16 x i1> compare through an i16.
+	hit = Builder.CreateBitCast(hit, Builder.getIntNTy(lanes));
+	hit = Builder.CreateICmpEQ(hit,
+			ConstantInt::get(Builder.getIntNTy(lanes), (1ULL << lanes) - 1));
+	return Builder.CreateZExt(hit, Builder.getInt32Ty());
+}
+
+Value* BlockedSignature::getSignatureInfo(sigInfoType infoType,
+		IRBuilder<> Builder, Value *Signature, Value *V /* = nullptr */) {
+	if (infoType == population) {
+		Module *M =
+				(Module*) Builder.GetInsertBlock()->getParent()->getParent();
+		Type *WordPtrTy = Builder.getInt32Ty()->getPointerTo();
+		Constant* BitCountFn = M->getOrInsertFunction("Count_Bits",
+				Builder.getInt32Ty(), WordPtrTy, Builder.getInt32Ty(), (Type*) 0);
+		std::vector<Value *> Args(2);
+		Args[0] = Builder.CreateBitCast(Signature, WordPtrTy);
+		Args[1] = Builder.getInt32(numBlocks * BitsPerBlock / 32);
+		ArrayRef<Value*> args(Args);
+		return Builder.CreateCall(BitCountFn, args);
+	} else {
+		return Builder.getInt32(0);
+	}
+}
+
+Type *BlockedSignature::getSignatureType() {
+	return SignTy;
+}
+
+std::string BlockedSignature::getName() {
+	std::stringstream ss;
+	ss << "BlockedSignature_" << numBlocks << "x" << BitsPerBlock << "_k"
+		 << numHashes;
+	return ss.str();
+}
+
+///=============================================================================
+
+LibCallSignature::LibCallSignature(int numBits) : numWords(4) {
+	while (numWords * 32 < numBits)
+		numWords <<= 1;
+}
 
 Value* LibCallSignature::allocateLocal(IRBuilder<> Builder) {
 	Value *AI = Builder.CreateAlloca(Builder.getInt32Ty(),
-																	 Builder.getInt32(64), "Signature_2K");
-	Builder.CreateMemSet(AI, Builder.getInt8(0), Builder.getInt64(64), 4);
+																	 Builder.getInt32(numWords), "Signature_Lib");
+	Builder.CreateMemSet(AI, Builder.getInt8(0), Builder.getInt64(numWords * 4),
+			4);
 	return AI;
 }
 
 Value* LibCallSignature::allocateGlobal(IRBuilder<> Builder) {
-	ArrayType *AT = ArrayType::get(Builder.getInt32Ty(), 64);
+	ArrayType *AT = ArrayType::get(Builder.getInt32Ty(), numWords);
 	GlobalVariable *GV = new GlobalVariable(AT, false,
 			GlobalValue::ExternalLinkage, Constant::getNullValue(AT));
 	BasicBlock *BB = Builder.GetInsertBlock();
@@ -426,81 +1095,70 @@ Value* LibCallSignature::allocateGlobal(IRBuilder<> Builder) {
 	index[1] = Builder.getInt32(0);
 	ArrayRef<Value*> indices(index);
 	Value *gep = Builder.CreateGEP(GV, indices);
+	// Cleared on each entry, like the other global signatures.
+	Builder.CreateMemSet(gep, Builder.getInt8(0), Builder.getInt64(numWords * 4),
+			4);
 	return gep;
 }
 
+// The runtime takes addresses as i8*, so every access shares one prototype.
 void LibCallSignature::insertPointer(IRBuilder<> Builder,
 																		 Value *Sign, Value *V) {
-	Constant* SetInsertFn;
-	std::stringstream InsertValFnName;
-	InsertValFnName << "Insert_Value_2K";
-
 	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
-
-	SetInsertFn = M->getOrInsertFunction(InsertValFnName.str(),
-			Builder.getVoidTy(), Sign->getType(), V->getType(), (Type*) 0);
-	Value *gep;
-	/*if (isa<GlobalVariable>(Sign))
-	 {
-	 Value *index[2];
-	 index[0] = Builder.getInt32(0);
-	 index[1] = Builder.getInt32(0);
-	 ArrayRef<Value*> indices(index);
-	 gep = Builder.CreateGEP(Sign,indices);
-	 }
-	 else*/
-	{
-		gep = Sign;
+	Value *Addr = Builder.CreatePointerCast(V, Builder.getInt8PtrTy());
+	if (numWords == Words2K) {
+		Constant *SetInsertFn = M->getOrInsertFunction("Insert_Value_2K",
+				Builder.getVoidTy(), Sign->getType(), Addr->getType(), (Type*) 0);
+		Builder.CreateCall(SetInsertFn, {Sign, Addr});
+	} else {
+		Constant *SetInsertFn = M->getOrInsertFunction("Insert_Value_Sig",
+				Builder.getVoidTy(), Sign->getType(), Addr->getType(),
+				Builder.getInt32Ty(), (Type*) 0);
+		Builder.CreateCall(SetInsertFn, {Sign, Addr, Builder.getInt32(numWords)});
 	}
-
-	Value * args[2] = { gep, V };
-	ArrayRef<Value*> Args(args);
-	Builder.CreateCall(SetInsertFn, Args);
 }
 
 Value* LibCallSignature::checkMembership(IRBuilder<> Builder,
 																				 Value *Sign, Value *V) {
-	//const Type *LoadTy = V->getType();
-	Type *LoadTy = V->getType();
-	Type *IntTy = Builder.getInt32Ty();
-	Constant* MembCheckFn;
-	std::stringstream ss;
-	ss << "MembershipCheck_2K";
-
 	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Value *Addr = Builder.CreatePointerCast(V, Builder.getInt8PtrTy());
 	std::vector<Type *> type_vect;
-	type_vect.push_back(LoadTy);
+	type_vect.push_back(Addr->getType());
 	type_vect.push_back(Sign->getType());
-	type_vect.push_back((Type *) 0);
-	ArrayRef<Type *> typeArray(type_vect);
-	FunctionType *funcType = FunctionType::get(IntTy, typeArray, 0);
-	MembCheckFn = M->getOrInsertFunction(StringRef(ss.str()), funcType);
-	/*
-	 MembCheckFn = M->getOrInsertFunction(ss.str(),
-	 IntTy,
-	 LoadTy,
-	 Sign->getType(),
-	 (Type*)0);
-	 */
-	Value *gep;
-	/*if (isa<GlobalVariable>(Sign))
-	 {
-	 Value *index[2];
-	 index[0] = Builder.getInt32(0);
-	 index[1] = Builder.getInt32(0);
-	 ArrayRef<Value*> indices(index);
-	 gep = Builder.CreateGEP(Sign,indices);
-	 }
-	 else*/
-	{
-		gep = Sign;
+	std::vector<Value *> Args;
+	Args.push_back(Addr);
+	Args.push_back(Sign);
+	if (numWords != Words2K) {
+		type_vect.push_back(Builder.getInt32Ty());
+		Args.push_back(Builder.getInt32(numWords));
 	}
+	FunctionType *funcType = FunctionType::get(Builder.getInt32Ty(), type_vect,
+			false);
+	Constant *MembCheckFn = M->getOrInsertFunction(numWords == Words2K
+			? "MembershipCheck_2K" : "MembershipCheck_Sig", funcType);
+	return Builder.CreateCall(MembCheckFn, Args);
+}
 
-	Value* Args[2] = { V, gep };
-	ArrayRef<Value*> args(Args);
-	std::stringstream call;
-	call << "MembCheck_Set"; // << SetNum;
-	return Builder.CreateCall(MembCheckFn, args);
+void LibCallSignature::insertRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant *InsertRangeFn = M->getOrInsertFunction("Insert_Range_Sig",
+			Builder.getVoidTy(), Sign->getType(), PtrTy, Builder.getInt64Ty(),
+			Builder.getInt64Ty(), Builder.getInt32Ty(), (Type*) 0);
+	Builder.CreateCall(InsertRangeFn, {Sign, Builder.CreatePointerCast(First,
+			PtrTy), Count, Stride, Builder.getInt32(numWords)});
+}
+
+Value* LibCallSignature::checkRange(IRBuilder<> Builder, Value *Sign,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant *CheckRangeFn = M->getOrInsertFunction("Check_Range_Sig",
+			Builder.getInt32Ty(), PtrTy, Builder.getInt64Ty(),
+			Builder.getInt64Ty(), Sign->getType(), Builder.getInt32Ty(), (Type*) 0);
+	return Builder.CreateCall(CheckRangeFn, {Builder.CreatePointerCast(First,
+			PtrTy), Count, Stride, Sign, Builder.getInt32(numWords)});
 }
 
 Type *LibCallSignature::getSignatureType() {
@@ -508,7 +1166,9 @@ Type *LibCallSignature::getSignatureType() {
 }
 
 std::string LibCallSignature::getName() {
-	return std::string("DDPLibraryRuntime_2K");
+	std::stringstream ss;
+	ss << "DDPLibraryRuntime_" << numWords * 32;
+	return ss.str();
 }
 
 ///=======================================================================
@@ -611,6 +1271,50 @@ Value* PerfectSet::getSignatureInfo(sigInfoType infoType,
 	}
 }
 
+void PerfectSet::insertRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = (Module*) Builder.GetInsertBlock()->getParent()->getParent();
+	std::vector<Type *> type_vect;
+	type_vect.push_back(Signature->getType());
+	type_vect.push_back(Builder.getInt8PtrTy());
+	type_vect.push_back(Builder.getInt64Ty());
+	type_vect.push_back(Builder.getInt64Ty());
+	ArrayRef<Type *> typeArray(type_vect);
+	FunctionType *funcType = FunctionType::get(Builder.getVoidTy(), typeArray,
+			0);
+	Constant* InsertRangeFn = M->getOrInsertFunction("PerfectSet_Insert_Range",
+			funcType);
+
+	std::vector<Value *> Args(4);
+	Args[0] = Signature;
+	Args[1] = Builder.CreateBitCast(First, Builder.getInt8PtrTy());
+	Args[2] = Count;
+	Args[3] = Stride;
+	Builder.CreateCall(InsertRangeFn, ArrayRef<Value*>(Args));
+}
+
+Value* PerfectSet::checkRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = (Module*) Builder.GetInsertBlock()->getParent()->getParent();
+	std::vector<Type *> type_vect;
+	type_vect.push_back(Builder.getInt8PtrTy());
+	type_vect.push_back(Builder.getInt64Ty());
+	type_vect.push_back(Builder.getInt64Ty());
+	type_vect.push_back(Signature->getType());
+	ArrayRef<Type *> typeArray(type_vect);
+	FunctionType *funcType = FunctionType::get(Builder.getInt32Ty(), typeArray,
+			0);
+	Constant* CheckRangeFn = M->getOrInsertFunction("PerfectSet_Check_Range",
+			funcType);
+
+	std::vector<Value *> Args(4);
+	Args[0] = Builder.CreateBitCast(First, Builder.getInt8PtrTy());
+	Args[1] = Count;
+	Args[2] = Stride;
+	Args[3] = Signature;
+	return Builder.CreateCall(CheckRangeFn, ArrayRef<Value*>(Args));
+}
+
 void PerfectSet::freeSet(IRBuilder<> Builder, Value *Signature) {
 	std::vector<Type *> type_vect;
 	type_vect.push_back(Signature->getType());
@@ -637,11 +1341,328 @@ std::string PerfectSet::getName() {
 	return std::string("DDPPerfectSet");
 }
 
+/// CuckooSet ============================================================
+
+CuckooSet::CuckooSet(int alog2Buckets) :
+		log2Buckets(alog2Buckets), granuleShift(2) {}
+
+Value* CuckooSet::allocateLocal(IRBuilder<> Builder) {
+	return allocateHeap(Builder);
+}
+
+Value* CuckooSet::allocateGlobal(IRBuilder<> Builder) {
+	return allocateHeap(Builder);
+}
+
+Value* CuckooSet::allocateHeap(IRBuilder<> Builder) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Constant* NewSetFn = M->getOrInsertFunction("CuckooSet_New",
+			getSignatureType(), Builder.getInt32Ty(), Builder.getInt32Ty(),
+			(Type*) 0);
+	std::vector<Value *> Args(2);
+	Args[0] = Builder.getInt32(log2Buckets);
+	Args[1] = Builder.getInt32(granuleShift);
+	return Builder.CreateCall(NewSetFn, ArrayRef<Value*>(Args));
+}
+
+void CuckooSet::insertPointer(IRBuilder<> Builder, Value *Signature,
+		Value *V) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant* InsertFn = M->getOrInsertFunction("CuckooSet_Insert_Value",
+			Builder.getVoidTy(), getSignatureType(), PtrTy, (Type*) 0);
+	std::vector<Value *> Args(2);
+	Args[0] = Signature;
+	Args[1] = Builder.CreatePointerCast(V, PtrTy);
+	Builder.CreateCall(InsertFn, ArrayRef<Value*>(Args));
+}
+
+Value* CuckooSet::checkMembership(IRBuilder<> Builder, Value *Signature,
+		Value *V) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant* MembCheckFn = M->getOrInsertFunction("CuckooSet_MembershipCheck",
+			Builder.getInt32Ty(), PtrTy, getSignatureType(), (Type*) 0);
+	std::vector<Value *> Args(2);
+	Args[0] = Builder.CreatePointerCast(V, PtrTy);
+	Args[1] = Signature;
+	return Builder.CreateCall(MembCheckFn, ArrayRef<Value*>(Args));
+}
+
+Value* CuckooSet::getSignatureInfo(sigInfoType infoType, IRBuilder<> Builder,
+		Value *Signature, Value *V /* = nullptr */) {
+	if (infoType == population) {
+		Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+		Constant* PopulationFn = M->getOrInsertFunction("CuckooSet_Population",
+				Builder.getInt32Ty(), getSignatureType(), (Type*) 0);
+		std::vector<Value *> Args(1);
+		Args[0] = Signature;
+		return Builder.CreateCall(PopulationFn, ArrayRef<Value*>(Args));
+	} else {
+		return Builder.getInt32(0);
+	}
+}
+
+void CuckooSet::freeSet(IRBuilder<> Builder, Value *Signature) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Constant* FreeSetFn = M->getOrInsertFunction("CuckooSet_Free",
+			Builder.getVoidTy(), getSignatureType(), (Type*) 0);
+	std::vector<Value *> Args(1);
+	Args[0] = Signature;
+	Builder.CreateCall(FreeSetFn, ArrayRef<Value*>(Args));
+}
+
+void CuckooSet::insertRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant* InsertRangeFn = M->getOrInsertFunction("CuckooSet_Insert_Range",
+			Builder.getVoidTy(), getSignatureType(), PtrTy, Builder.getInt64Ty(),
+			Builder.getInt64Ty(), (Type*) 0);
+	std::vector<Value *> Args(4);
+	Args[0] = Signature;
+	Args[1] = Builder.CreatePointerCast(First, PtrTy);
+	Args[2] = Count;
+	Args[3] = Stride;
+	Builder.CreateCall(InsertRangeFn, ArrayRef<Value*>(Args));
+}
+
+Value* CuckooSet::checkRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant* CheckRangeFn = M->getOrInsertFunction("CuckooSet_Check_Range",
+			Builder.getInt32Ty(), PtrTy, Builder.getInt64Ty(), Builder.getInt64Ty(),
+			getSignatureType(), (Type*) 0);
+	std::vector<Value *> Args(4);
+	Args[0] = Builder.CreatePointerCast(First, PtrTy);
+	Args[1] = Count;
+	Args[2] = Stride;
+	Args[3] = Signature;
+	return Builder.CreateCall(CheckRangeFn, ArrayRef<Value*>(Args));
+}
+
+Type *CuckooSet::getSignatureType() {
+	return Type::getInt8PtrTy(getGlobalContext());
+}
+
+std::string CuckooSet::getName() {
+	std::stringstream ss;
+	ss << "DDPCuckooSet_" << (BitsPerBucket << log2Buckets);
+	return ss.str();
+}
+
+/// ShadowSet =============================================================
+
+ShadowSet::ShadowSet(int agranuleShift) : granuleShift(agranuleShift) {}
+
+bool ShadowSet::takeGranularity(int shift) {
+	if (shift > MaxGranuleShift) {
+		errs() << "DDP WARN: shadow granules are at most "
+				<< (1ULL << MaxGranuleShift) << " bytes, not " << (1ULL << shift)
+				<< "; using that\n";
+		shift = MaxGranuleShift;
+	}
+	granuleShift = shift;
+	return true;
+}
+
+// A fresh epoch from the runtime, which also maps the chunk table on first
+// use.
+Value* ShadowSet::newEpoch(IRBuilder<> &Builder) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Constant* NewFn = M->getOrInsertFunction("ShadowSet_New",
+			Builder.getInt64Ty(), Builder.getInt32Ty(), (Type*) 0);
+	std::vector<Value *> Args(1);
+	Args[0] = Builder.getInt32(granuleShift);
+	return Builder.CreateCall(NewFn, ArrayRef<Value*>(Args));
+}
+
+Value* ShadowSet::allocateLocal(IRBuilder<> Builder) {
+	Value *AI = Builder.CreateAlloca(Builder.getInt64Ty(), Builder.getInt32(1),
+			"ShadowSet");
+	Builder.CreateStore(newEpoch(Builder), AI);
+	return AI;
+}
+
+Value* ShadowSet::allocateGlobal(IRBuilder<> Builder) {
+	Type *TagTy = Builder.getInt64Ty();
+	GlobalVariable *GV = new GlobalVariable(TagTy, false,
+			GlobalValue::ExternalLinkage, ConstantInt::get(TagTy, 0));
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	M->getGlobalList().push_back(GV);
+	Builder.CreateStore(newEpoch(Builder), GV);
+	return GV;
+}
+
+// Load the slot of the chunk table holding V's granule, and compute the
+// chunk's index and the granule's offset within it. The slot is null
+// until the runtime maps the chunk. The table only covers 48-bit
+// addresses, so the bits above are dropped, as the runtime does for
+// ranges; a tagged pointer shares its untagged address's granule.
+Value* ShadowSet::getChunkSlot(IRBuilder<> &Builder, Value *V, Value *&Chunk,
+		Value *&Offset) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *TagTy = Builder.getInt64Ty();
+	Type *TableTy = TagTy->getPointerTo()->getPointerTo();
+	ArrayType *TablesTy = ArrayType::get(TableTy, MaxGranuleShift + 1);
+	Constant *Tables = M->getOrInsertGlobal("ShadowSet_Tables", TablesTy);
+	Value *Table = Builder.CreateLoad(Builder.CreateConstGEP2_32(TablesTy,
+			Tables, 0, granuleShift));
+
+	Value *addr = Builder.CreateAnd(Builder.CreatePtrToInt(V, TagTy),
+			(1ULL << AddressBits) - 1);
+	Value *granule = Builder.CreateLShr(addr, granuleShift);
+	Chunk = Builder.CreateLShr(granule, ChunkBits);
+	Offset = Builder.CreateAnd(granule, (1ULL << ChunkBits) - 1);
+	return Builder.CreateLoad(Builder.CreateGEP(Table, Chunk));
+}
+
+void ShadowSet::insertPointer(IRBuilder<> Builder, Value *Signature,
+		Value *V) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Value *tag = Builder.CreateLoad(Signature);
+	Value *Chunk, *Offset;
+	Value *slot = getChunkSlot(Builder, V, Chunk, Offset);
+
+	// Map the chunk on its first insert; checks never need it mapped.
+	BasicBlock *Head = Builder.GetInsertBlock();
+	TerminatorInst *MapTerm = SplitBlockAndInsertIfThen(
+			Builder.CreateIsNull(slot), &*Builder.GetInsertPoint(), false);
+	IRBuilder<> MB(MapTerm);
+	Constant* MapFn = M->getOrInsertFunction("ShadowSet_Map_Chunk",
+			slot->getType(), MB.getInt32Ty(), MB.getInt64Ty(), (Type*) 0);
+	std::vector<Value *> Args(2);
+	Args[0] = MB.getInt32(granuleShift);
+	Args[1] = Chunk;
+	Value *mapped = MB.CreateCall(MapFn, ArrayRef<Value*>(Args));
+
+	BasicBlock *Tail = MapTerm->getSuccessor(0);
+	IRBuilder<> TB(Tail, Tail->begin());
+	PHINode *phi = TB.CreatePHI(slot->getType(), 2);
+	phi->addIncoming(slot, Head);
+	phi->addIncoming(mapped, MapTerm->getParent());
+	TB.CreateStore(tag, TB.CreateGEP(phi, Offset));
+}
+
+Value* ShadowSet::checkMembership(IRBuilder<> Builder, Value *Signature,
+		Value *V) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Value *Chunk, *Offset;
+	Value *slot = getChunkSlot(Builder, V, Chunk, Offset);
+
+	// A granule in an unmapped chunk reads the runtime's zero tag instead,
+	// which no epoch matches.
+	Constant *NoTag = M->getOrInsertGlobal("ShadowSet_No_Tag",
+			Builder.getInt64Ty());
+	Value *tagPtr = Builder.CreateSelect(Builder.CreateIsNull(slot), NoTag,
+			Builder.CreateGEP(slot, Offset));
+	Value *hit = Builder.CreateICmpEQ(Builder.CreateLoad(tagPtr),
+			Builder.CreateLoad(Signature));
+	return Builder.CreateZExt(hit, Builder.getInt32Ty());
+}
+
+void ShadowSet::insertRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant* InsertRangeFn = M->getOrInsertFunction("ShadowSet_Insert_Range",
+			Builder.getVoidTy(), Builder.getInt64Ty(), Builder.getInt32Ty(), PtrTy,
+			Builder.getInt64Ty(), Builder.getInt64Ty(), (Type*) 0);
+	std::vector<Value *> Args(5);
+	Args[0] = Builder.CreateLoad(Signature);
+	Args[1] = Builder.getInt32(granuleShift);
+	Args[2] = Builder.CreatePointerCast(First, PtrTy);
+	Args[3] = Count;
+	Args[4] = Stride;
+	Builder.CreateCall(InsertRangeFn, ArrayRef<Value*>(Args));
+}
+
+Value* ShadowSet::checkRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant* CheckRangeFn = M->getOrInsertFunction("ShadowSet_Check_Range",
+			Builder.getInt32Ty(), PtrTy, Builder.getInt64Ty(), Builder.getInt64Ty(),
+			Builder.getInt64Ty(), Builder.getInt32Ty(), (Type*) 0);
+	std::vector<Value *> Args(5);
+	Args[0] = Builder.CreatePointerCast(First, PtrTy);
+	Args[1] = Count;
+	Args[2] = Stride;
+	Args[3] = Builder.CreateLoad(Signature);
+	Args[4] = Builder.getInt32(granuleShift);
+	return Builder.CreateCall(CheckRangeFn, ArrayRef<Value*>(Args));
+}
+
+Type *ShadowSet::getSignatureType() {
+	return Type::getInt64PtrTy(getGlobalContext());
+}
+
+std::string ShadowSet::getName() {
+	std::stringstream ss;
+	ss << "DDPShadowSet_" << (1 << granuleShift);
+	return ss.str();
+}
+
+/// Ranges of RangeSet and RangeAndBankedSignature =======================
+
+// The first and last address of a range, truncated to the 32 bits the
+// range sets keep. A range whose truncation wraps around covers them all.
+static void getRangeBounds(IRBuilder<> &Builder, Value *First, Value *Count,
+		Value *Stride, Value *&Lo, Value *&Hi) {
+	Value *first = Builder.CreatePtrToInt(First, Builder.getInt64Ty());
+	Value *last = Builder.CreateAdd(first,
+			Builder.CreateMul(Builder.CreateSub(Count, Builder.getInt64(1)),
+					Stride));
+	Value *wraps = Builder.CreateICmpNE(Builder.CreateLShr(first, 32),
+			Builder.CreateLShr(last, 32));
+	Lo = Builder.CreateSelect(wraps, Builder.getInt32(0),
+			Builder.CreateTrunc(first, Builder.getInt32Ty()));
+	Hi = Builder.CreateSelect(wraps, Builder.getInt32(-1),
+			Builder.CreateTrunc(last, Builder.getInt32Ty()));
+}
+
+// Widen the min/max pair at the start of sig to cover [Lo, Hi].
+static void insertRangeBounds(IRBuilder<> &Builder, Value *sig, Value *Lo,
+		Value *Hi) {
+	Value *index[2] = { Builder.getInt32(0), Builder.getInt32(0) };
+	ArrayRef<Value*> indices(index);
+	Value *minPtr = Builder.CreateGEP(sig, indices);
+	Value *minVal = Builder.CreateLoad(minPtr);
+	minVal = Builder.CreateSelect(Builder.CreateICmpULT(Lo, minVal, "minCmp"),
+			Lo, minVal);
+	Builder.CreateStore(minVal, minPtr);
+
+	Value *index2[2] = { Builder.getInt32(0), Builder.getInt32(1) };
+	ArrayRef<Value*> indices2(index2);
+	Value *maxPtr = Builder.CreateGEP(sig, indices2);
+	Value *maxVal = Builder.CreateLoad(maxPtr);
+	maxVal = Builder.CreateSelect(Builder.CreateICmpUGT(Hi, maxVal, "maxCmp"),
+			Hi, maxVal);
+	Builder.CreateStore(maxVal, maxPtr);
+}
+
+// Whether [Lo, Hi] overlaps the min/max pair at the start of sig, as an i32.
+static Value* checkRangeBounds(IRBuilder<> &Builder, Value *sig, Value *Lo,
+		Value *Hi) {
+	Value *index[2] = { Builder.getInt32(0), Builder.getInt32(0) };
+	ArrayRef<Value*> indices(index);
+	Value *minVal = Builder.CreateLoad(Builder.CreateGEP(sig, indices));
+	Value *index2[2] = { Builder.getInt32(0), Builder.getInt32(1) };
+	ArrayRef<Value*> indices2(index2);
+	Value *maxVal = Builder.CreateLoad(Builder.CreateGEP(sig, indices2));
+	Value *overlap = Builder.CreateAnd(
+			Builder.CreateICmpUGE(Hi, minVal, "minCmp"),
+			Builder.CreateICmpULE(Lo, maxVal, "maxCmp"), "andMinMax");
+	return Builder.CreateZExt(overlap, Builder.getInt32Ty());
+}
+
 /// RangeAndBankedSignature ==============================================
 
 RangeAndBankedSignature::RangeAndBankedSignature(int nBanks, int numBitsEl,
 		int length) :
-		bankSig(nBanks, numBitsEl, length), internalType(NULL) {
+		bankSig(nBanks, numBitsEl, length), internalType(NULL), dirtyShift(-1),
+		predicated(true) {
 	//Nothing to do here. Just initializer lists.
 }
 
@@ -688,6 +1709,26 @@ Value* RangeAndBankedSignature::allocateLocal(IRBuilder<> Builder) {
 	return sig;
 }
 
+// The banks are already zero; only the range needs its empty value.
+Value* RangeAndBankedSignature::initPooled(IRBuilder<> Builder,
+		Value *Buffer) {
+	BasicBlock *BB = Builder.GetInsertBlock();
+	Module *M = BB->getParent()->getParent();
+	setInternalType(M);
+	assert(internalType != NULL);
+	Value *sig = Builder.CreateBitCast(Buffer, internalType->getPointerTo());
+	Value *index[2] = { Builder.getInt32(0), Builder.getInt32(0) };
+	ArrayRef<Value*> indices(index);
+	Value *minPtr = Builder.CreateGEP(sig, indices);
+	Builder.CreateStore(Builder.getInt32(-1), minPtr);
+	if (dirtyShift >= 0)
+		markDirtyChunk(Builder, sig, minPtr, dirtyShift);
+	Value *index2[2] = { Builder.getInt32(0), Builder.getInt32(1) };
+	ArrayRef<Value*> indices2(index2);
+	Builder.CreateStore(Builder.getInt32(0), Builder.CreateGEP(sig, indices2));
+	return sig;
+}
+
 Value* RangeAndBankedSignature::allocateGlobal(IRBuilder<> Builder) {
 	BasicBlock *BB = Builder.GetInsertBlock();
 	Module *M = BB->getParent()->getParent();
@@ -746,7 +1787,7 @@ void RangeAndBankedSignature::insertPointer(IRBuilder<> Builder,
 	Value *bankSignPtr = Builder.CreateBitCast(Builder.CreateGEP(sig, indices3),
 			bankSig.getSignatureType());
 
-	bankSig.insertPointer(Builder, bankSignPtr, V);
+	bankSig.insertBanks(Builder, bankSignPtr, V, sig);
 }
 
 Value* RangeAndBankedSignature::checkMembership(IRBuilder<> Builder,
@@ -769,6 +1810,16 @@ Value* RangeAndBankedSignature::checkMembership(IRBuilder<> Builder,
 			"andMinMax");
 	//Value* rangeCheckResult32 = Builder.CreateZExt(rangeCheckResult,Builder.getInt32Ty());
 
+	if (predicated) {
+		Value *index3[2] = { Builder.getInt32(0), Builder.getInt32(2) };
+		ArrayRef<Value*> indices3(index3);
+		Value *bankSignPtr = Builder.CreateBitCast(
+				Builder.CreateGEP(sig, indices3), bankSig.getSignatureType());
+		Value *sigCheck = bankSig.checkMembership(Builder, bankSignPtr, V);
+		return Builder.CreateSelect(rangeCheckResult, sigCheck,
+				Builder.getInt32(0));
+	}
+
 	BasicBlock *Old = Builder.GetInsertBlock();
 	BasicBlock *split = Old->splitBasicBlock(Builder.GetInsertPoint(),
 			Old->getName() + ".split");
@@ -803,6 +1854,54 @@ Value* RangeAndBankedSignature::checkMembership(IRBuilder<> Builder,
 	return phi;
 }
 
+// The range of the union spans both ranges; an empty one (min -1, max 0)
+// leaves the other as it is.
+void RangeAndBankedSignature::mergeSignature(IRBuilder<> Builder,
+		Value *Sign, Value *Other) {
+	Value *index[2] = { Builder.getInt32(0), Builder.getInt32(0) };
+	Value *minPtr = Builder.CreateGEP(Sign, index);
+	Value *min = Builder.CreateLoad(minPtr);
+	Value *otherMin = Builder.CreateLoad(Builder.CreateGEP(Other, index));
+	Builder.CreateStore(Builder.CreateSelect(Builder.CreateICmpULT(otherMin,
+			min), otherMin, min), minPtr);
+
+	index[1] = Builder.getInt32(1);
+	Value *maxPtr = Builder.CreateGEP(Sign, index);
+	Value *max = Builder.CreateLoad(maxPtr);
+	Value *otherMax = Builder.CreateLoad(Builder.CreateGEP(Other, index));
+	Builder.CreateStore(Builder.CreateSelect(Builder.CreateICmpUGT(otherMax,
+			max), otherMax, max), maxPtr);
+
+	index[1] = Builder.getInt32(2);
+	mergeWords(Builder, Builder.CreateGEP(Sign, index),
+			Builder.CreateGEP(Other, index), bankSig.getElementType(),
+			bankSig.getTotalLength(), Sign, dirtyShift);
+}
+
+void RangeAndBankedSignature::insertRange(IRBuilder<> Builder,
+		Value *Signature, Value *First, Value *Count, Value *Stride) {
+	Value *Lo, *Hi;
+	getRangeBounds(Builder, First, Count, Stride, Lo, Hi);
+	insertRangeBounds(Builder, Signature, Lo, Hi);
+
+	// Last, since it splits the block.
+	Value *index3[2] = { Builder.getInt32(0), Builder.getInt32(2) };
+	ArrayRef<Value*> indices3(index3);
+	Value *bankSignPtr = Builder.CreateBitCast(
+			Builder.CreateGEP(Signature, indices3), bankSig.getSignatureType());
+	bankSig.insertBanksRange(Builder, bankSignPtr, First, Count, Stride,
+			Signature);
+}
+
+// Looking in the banks would mean a loop over the range; the range test is
+// enough to rule out most of the ranges that miss.
+Value* RangeAndBankedSignature::checkRange(IRBuilder<> Builder,
+		Value *Signature, Value *First, Value *Count, Value *Stride) {
+	Value *Lo, *Hi;
+	getRangeBounds(Builder, First, Count, Stride, Lo, Hi);
+	return checkRangeBounds(Builder, Signature, Lo, Hi);
+}
+
 Value* RangeAndBankedSignature::getSignatureInfo(sigInfoType infoType,
 		IRBuilder<> Builder, Value *Signature, Value *V /* = nullptr */) {
 	return bankSig.getSignatureInfo(infoType, Builder, Signature, V);
@@ -909,6 +2008,20 @@ Value* RangeSet::checkMembership(IRBuilder<> Builder,
 	return Builder.CreateZExt(rangeCheckResult, Builder.getInt32Ty());
 }
 
+void RangeSet::insertRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Value *Lo, *Hi;
+	getRangeBounds(Builder, First, Count, Stride, Lo, Hi);
+	insertRangeBounds(Builder, Signature, Lo, Hi);
+}
+
+Value* RangeSet::checkRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Value *Lo, *Hi;
+	getRangeBounds(Builder, First, Count, Stride, Lo, Hi);
+	return checkRangeBounds(Builder, Signature, Lo, Hi);
+}
+
 Value* RangeSet::getSignatureInfo(sigInfoType infoType, IRBuilder<> Builder,
 		Value *Signature, Value *V /* = nullptr */) {
 	if (infoType == population) {
@@ -1225,6 +2338,80 @@ std::string DumpSet::getName() {
 	return temp.str();
 }
 
+///=== TraceSet ==========================================================
+
+void TraceSet::recordRegion(IRBuilder<> Builder) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+
+	Constant* RegionFn = M->getOrInsertFunction("TraceSet_Region",
+			Builder.getVoidTy(),
+			Builder.getInt32Ty(), (Type*) 0);
+
+	Builder.CreateCall(RegionFn, Builder.getInt32(refid));
+}
+
+void TraceSet::recordAccess(IRBuilder<> Builder, const char *FnName,
+														Value *V) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *VoidPtrTy = Builder.getInt8PtrTy();
+
+	Constant* RecordFn = M->getOrInsertFunction(FnName,
+			Builder.getVoidTy(),
+			Builder.getInt32Ty(),
+			VoidPtrTy, (Type*) 0);
+
+	Value *Addr;
+	if (V->getType()->isPointerTy())
+		Addr = Builder.CreatePointerCast(V, VoidPtrTy);
+	else
+		Addr = Builder.CreateIntToPtr(V, VoidPtrTy);
+
+	Value *Args[2] = { Builder.getInt32(refid), Addr };
+	Builder.CreateCall(RecordFn, Args);
+}
+
+Value* TraceSet::allocateLocal(IRBuilder<> Builder) {
+	recordRegion(Builder);
+	return set->allocateLocal(Builder);
+}
+
+Value* TraceSet::allocateGlobal(IRBuilder<> Builder) {
+	recordRegion(Builder);
+	return set->allocateGlobal(Builder);
+}
+
+Value* TraceSet::allocateHeap(IRBuilder<> Builder) {
+	recordRegion(Builder);
+	return set->allocateHeap(Builder);
+}
+
+void TraceSet::insertPointer(IRBuilder<> Builder, Value *Signature, Value *V) {
+	recordAccess(Builder, "TraceSet_Store", V);
+	set->insertPointer(Builder, Signature, V);
+}
+
+Value* TraceSet::checkMembership(IRBuilder<> Builder,
+																 Value *Signature, Value *V) {
+	// Record before delegating: the wrapped check may leave the builder in a
+	// different block.
+	recordAccess(Builder, "TraceSet_Load", V);
+	return set->checkMembership(Builder, Signature, V);
+}
+
+void TraceSet::freeSet(IRBuilder<> Builder, Value *Signature) {
+	set->freeSet(Builder, Signature);
+}
+
+Type *TraceSet::getSignatureType() {
+	return set->getSignatureType();
+}
+
+std::string TraceSet::getName() {
+	std::stringstream temp;
+	temp << "TraceSet_" << set->getName();
+	return temp.str();
+}
+
 ///=======================================================================
 
 #define HASH_TABLE_SIZE 50000
@@ -1315,6 +2502,41 @@ void HashTableSet::freeSet(IRBuilder<> Builder, Value *Signature) {
 	// nothing needed since it's an alloca
 }
 
+void HashTableSet::insertRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant* HTInsertRangeFn = M->getOrInsertFunction("HT_Insert_Range",
+			Builder.getVoidTy(), PtrTy, Builder.getInt64Ty(), Builder.getInt64Ty(),
+			Signature->getType(), Builder.getInt64Ty(), (Type*) 0);
+
+	std::vector<Value*> Args(5);
+	Args[0] = Builder.CreatePointerCast(First, PtrTy);
+	Args[1] = Count;
+	Args[2] = Stride;
+	Args[3] = Signature;
+	Args[4] = Builder.getInt64(TableSize);
+	Builder.CreateCall(HTInsertRangeFn, ArrayRef<Value*>(Args));
+}
+
+Value* HashTableSet::checkRange(IRBuilder<> Builder, Value *Signature,
+		Value *First, Value *Count, Value *Stride) {
+	Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+	Type *PtrTy = Builder.getInt8PtrTy();
+	Constant* HTCheckRangeFn = M->getOrInsertFunction("HT_Check_Range",
+			Builder.getInt64Ty(), PtrTy, Builder.getInt64Ty(), Builder.getInt64Ty(),
+			Signature->getType(), Builder.getInt64Ty(), (Type*) 0);
+
+	std::vector<Value*> Args(5);
+	Args[0] = Builder.CreatePointerCast(First, PtrTy);
+	Args[1] = Count;
+	Args[2] = Stride;
+	Args[3] = Signature;
+	Args[4] = Builder.getInt64(TableSize);
+	return Builder.CreateTrunc(Builder.CreateCall(HTCheckRangeFn,
+			ArrayRef<Value*>(Args)), Builder.getInt32Ty());
+}
+
 Type *HashTableSet::getSignatureType() {
 	return PointerType::get(Type::getIntNTy(getGlobalContext(), 32), 0);
 }
@@ -1323,8 +2545,121 @@ std::string HashTableSet::getName() {
 	return std::string("DDPHashTableSet");
 }
 
+/// LazyFunctionRegion ===================================================
+
+// Blocks reachable from BB through at least one edge; BB itself is among
+// them only if it is on a cycle.
+static void collectReachable(BasicBlock *BB, std::set<BasicBlock*> &reach) {
+	std::vector<BasicBlock*> work(succ_begin(BB), succ_end(BB));
+	while (!work.empty()) {
+		BasicBlock *B = work.back();
+		work.pop_back();
+		if (!reach.insert(B).second)
+			continue;
+		work.insert(work.end(), succ_begin(B), succ_end(B));
+	}
+}
+
+LazyFunctionRegion::LazyFunctionRegion(Function &aF, DominatorTree &DT,
+		const std::vector<Instruction*> &uses) : F(aF) {
+	BasicBlock *Entry = &F.getEntryBlock();
+	BasicBlock *BB = NULL;
+	for (auto *I : uses) {
+		if (!DT.isReachableFromEntry(I->getParent()))
+			continue;
+		BB = BB ? DT.findNearestCommonDominator(BB, I->getParent())
+				: I->getParent();
+	}
+
+	std::set<BasicBlock*> reach;
+	while (BB && BB != Entry) {
+		reach.clear();
+		collectReachable(BB, reach);
+		if (!reach.count(BB))
+			break;
+		BB = DT.getNode(BB)->getIDom()->getBlock();
+	}
+
+	if (!BB || BB == Entry) {
+		useWholeFunction();
+		return;
+	}
+
+	// Before the first use in BB, so it precedes that use's instrumentation.
+	std::set<Instruction*> useSet(uses.begin(), uses.end());
+	entry = BB->getTerminator();
+	for (auto &I : *BB)
+		if (useSet.count(&I)) {
+			entry = &I;
+			break;
+		}
+
+	for (auto &B : F) {
+		if (!DT.isReachableFromEntry(&B) || !DT.dominates(BB, &B))
+			continue;
+		if (isa<ReturnInst>(B.getTerminator()))
+			exits.push_back(B.getTerminator());
+		for (auto *S : successors(&B))
+			if (!DT.dominates(BB, S) && std::find(exitEdges.begin(),
+					exitEdges.end(), Edge(&B, S)) == exitEdges.end())
+				exitEdges.push_back(Edge(&B, S));
+	}
+}
+
+void LazyFunctionRegion::useWholeFunction() {
+	entry = &*F.getEntryBlock().begin();
+	exits.clear();
+	exitEdges.clear();
+	for (auto &B : F)
+		if (isa<ReturnInst>(B.getTerminator()))
+			exits.push_back(B.getTerminator());
+}
+
+// A block of its own on the edge From -> To, which PHIs in To now come from.
+static BasicBlock *splitExitEdge(BasicBlock *From, BasicBlock *To) {
+	BasicBlock *N = BasicBlock::Create(To->getContext(),
+			From->getName() + ".region.exit", To->getParent(), To);
+	BranchInst::Create(To, N);
+	TerminatorInst *T = From->getTerminator();
+	for (unsigned i = 0; i < T->getNumSuccessors(); i++)
+		if (T->getSuccessor(i) == To)
+			T->setSuccessor(i, N);
+	for (auto &I : *To) {
+		PHINode *P = dyn_cast<PHINode>(&I);
+		if (!P)
+			break;
+		// A switch may have had several edges to To; N has one.
+		int i = P->getBasicBlockIndex(From);
+		P->setIncomingBlock(i, N);
+		while ((i = P->getBasicBlockIndex(From)) >= 0)
+			P->removeIncomingValue(i, false);
+	}
+	return N;
+}
+
+void LazyFunctionRegion::placeFrees(std::map<Edge, BasicBlock*> &split) {
+	// Unwind and indirectbr edges cannot take a block of their own.
+	for (auto &E : exitEdges)
+		if (E.second->isEHPad() || isa<IndirectBrInst>(E.first->getTerminator())) {
+			useWholeFunction();
+			return;
+		}
+
+	for (auto &E : exitEdges) {
+		BasicBlock *&N = split[E];
+		if (!N)
+			N = splitExitEdge(E.first, E.second);
+		exits.push_back(N->getTerminator());
+	}
+	exitEdges.clear();
+}
+
 ///=======================================================================
 
+LLVMContext &SImpleFactory::getContext() {
+	return getGlobalContext();
+}
+
 SImple *SImpleFactory::CreatePerfectSet() {
 	return new PerfectSet();
 }
@@ -1337,35 +2672,65 @@ SImple *SImpleFactory::CreateHashTableSet() {
 	return new HashTableSet();
 }
 
+// Banked signatures whose banks hash the full 64-bit address. Multiply-shift
+// banks differ by multiplier; fold banks, like BankedSignature(n, 32, L),
+// by how far the address is shifted.
+static SImple *CreateMultiplyShiftBanked(int nBanks, int length) {
+	std::vector<int> lengths(nBanks, length);
+	std::vector<HashBuilder> hashes;
+	for (int i = 0; i < nBanks; i++)
+		hashes.push_back(HashBuilderFactory::CreateMultiplyShiftIndex64(2,
+				32 * length - 1, ddphash::multiplyShiftSeed(i)));
+	return new BankedSignature(32, lengths, hashes);
+}
+
+static SImple *CreateFoldBanked(int nBanks, int length) {
+	int tot = 32 * length;
+	int targetlevel = 0;
+	while (tot >>= 1)
+		++targetlevel;
+
+	std::vector<int> lengths(nBanks, length);
+	std::vector<HashBuilder> hashes;
+	int offset = 2;
+	for (int i = 0; i < nBanks; i++) {
+		hashes.push_back(HashBuilderFactory::CreateFoldIndex64(offset,
+				(1 << targetlevel) - 1));
+		offset += targetlevel;
+	}
+	return new BankedSignature(32, lengths, hashes);
+}
+
 SImple *SImpleFactory::CreateFastSignature(unsigned int bits) {
 	SImple *S;
 	if (bits <= 32) {
 		S = new SimpleSignature(32,
-				HashBuilderFactory::CreateShiftMaskIndex(2, 0x1F));
+				HashBuilderFactory::CreateFoldIndex64(2, 0x1F));
 	} else if (bits <= 64) {
 		S = new SimpleSignature(64,
-				HashBuilderFactory::CreateShiftMaskIndex(2, 0x3F));
+				HashBuilderFactory::CreateFoldIndex64(2, 0x3F));
 	} else if (bits <= 128) {
 		S = new SimpleSignature(128,
-				HashBuilderFactory::CreateShiftMaskIndex(2, 0x7F));
+				HashBuilderFactory::CreateFoldIndex64(2, 0x7F));
 	} else if (bits <= 256) {
 		S = new SimpleSignature(256,
-				HashBuilderFactory::CreateShiftMaskIndex(2, 0xFF));
+				HashBuilderFactory::CreateFoldIndex64(2, 0xFF));
 	} else if (bits <= 512) {
 		S = new ArraySignature(32, 16,
-				HashBuilderFactory::CreateShiftMaskIndex(2, 0x1FF));
+				HashBuilderFactory::CreateFoldIndex64(2, 0x1FF));
 	} else if (bits <= 1024) {
-		S = new BankedSignature(2, 32, 16);
+		S = CreateFoldBanked(2, 16);
 	} else if (bits <= 2048) {
 		S = new ArraySignature(32, 64,
-				HashBuilderFactory::CreateShiftMaskIndex(2, 0x7FF));
+				HashBuilderFactory::CreateFoldIndex64(2, 0x7FF));
 		//S = new BankedSignature(2,32,32);
 	} else {
 		//S = new BankedSignature(3,32,32);
 		// requesting really big signature
 		S = new ArraySignature(32, 128,
-				HashBuilderFactory::CreateShiftMaskIndex(2, 0xFFF));
+				HashBuilderFactory::CreateFoldIndex64(2, 0xFFF));
 	}
+	S->setHashFamily("fold");
 	return S;
 }
 
@@ -1436,6 +2801,9 @@ SImple *SImpleFactory::CreateDynStructSignature(unsigned int bits,
 
 	//Just shift by 4 because probably most of the struct elements will be 4 bytes wide.
 		V = Builder.CreateLShr(V,Builder.getInt32(2));
+		// Past 1K the xor leaves up to 16 bits; keep the index in the bank.
+		if(structSize > 256*4)
+			V = Builder.CreateAnd(V,Builder.getInt32(extraBankSize * 32 - 1));
 	}
 	return V;
 }	;
@@ -1469,36 +2837,93 @@ SImple *SImpleFactory::CreateAccurateSignature(unsigned int bits) {
 	SImple *S;
 	if (bits <= 32) {
 		S = new SimpleSignature(32,
-				HashBuilderFactory::CreateKnuthIndex(2, 0x1F));
+				HashBuilderFactory::CreateMultiplyShiftIndex64(2, 0x1F));
 	} else if (bits <= 64) {
 		S = new SimpleSignature(64,
-				HashBuilderFactory::CreateKnuthIndex(2, 0x3F));
+				HashBuilderFactory::CreateMultiplyShiftIndex64(2, 0x3F));
 	} else if (bits <= 128) {
 		S = new SimpleSignature(128,
-				HashBuilderFactory::CreateKnuthIndex(2, 0x7F));
+				HashBuilderFactory::CreateMultiplyShiftIndex64(2, 0x7F));
 	} else if (bits <= 256) {
 		S = new SimpleSignature(256,
-				HashBuilderFactory::CreateKnuthIndex(2, 0xFF));
+				HashBuilderFactory::CreateMultiplyShiftIndex64(2, 0xFF));
 	} else if (bits <= 512) {
 		S = new ArraySignature(32, 16,
-				HashBuilderFactory::CreateKnuthIndex(2, 0x1FF));
+				HashBuilderFactory::CreateMultiplyShiftIndex64(2, 0x1FF));
+	} else if (bits <= 1024) {
+		S = CreateMultiplyShiftBanked(2, 16);
+	} else if (bits <= 2048) {
+		S = CreateMultiplyShiftBanked(2, 32);
+	} else if (bits <= 3072) {
+		S = CreateMultiplyShiftBanked(3, 32);
+	} else if (bits <= 4096) {
+		S = CreateMultiplyShiftBanked(2, 32 * 2);
+	} else {
+		// FIXME: do something smarter here
+		// requesting really big signature
+		S = CreateMultiplyShiftBanked(2, 32 * 4);
+	}
+	S->setHashFamily("multiply-shift");
+	return S;
+}
+
+SImple *SImpleFactory::CreateDoubleHashSignature(unsigned int bits) {
+	SImple *S;
+	if (bits <= 512) {
+		// One bank; nothing to share the hash with.
+		S = CreateAccurateSignature(bits);
 	} else if (bits <= 1024) {
-		S = new BankedSignature(2, 32, 16);
+		S = new DoubleHashSignature(2, 32, 16);
 	} else if (bits <= 2048) {
-		S = new BankedSignature(2, 32, 32);
+		S = new DoubleHashSignature(2, 32, 32);
 	} else if (bits <= 3072) {
-		S = new BankedSignature(3, 32, 32);
+		S = new DoubleHashSignature(3, 32, 32);
 	} else if (bits <= 4096) {
-		S = new BankedSignature(2, 32, 32 * 2);
+		S = new DoubleHashSignature(2, 32, 32 * 2);
 	} else {
 		// FIXME: do something smarter here
 		// requesting really big signature
-		S = new BankedSignature(2, 32, 32 * 4);
+		S = new DoubleHashSignature(2, 32, 32 * 4);
 	}
+	S->setHashFamily("double-hash");
+	return S;
+}
+
+SImple *SImpleFactory::CreateBlockedSignature(unsigned int bits) {
+	int numBlocks = 1;
+	while (numBlocks * BlockedSignature::BitsPerBlock < (int) bits)
+		numBlocks <<= 1;
+	// Large signatures are for low false positive rates; spend more bits,
+	// as long as the product still has 9 bits for each of them.
+	int blockBits = 0;
+	for (int n = numBlocks; n >>= 1;)
+		++blockBits;
+	int k = std::min(bits > 2048 ? 6 : 4, (64 - blockBits) / 9);
+	return new BlockedSignature(numBlocks, k);
+}
+
+SImple *SImpleFactory::CreateCuckooSet(unsigned int bits) {
+	int log2Buckets = 0;
+	while ((CuckooSet::BitsPerBucket << log2Buckets) < (int) bits)
+		++log2Buckets;
+	return new CuckooSet(log2Buckets);
+}
+
+SImple *SImpleFactory::CreateShadowSet(unsigned int granuleBytes) {
+	if (granuleBytes != 4 && granuleBytes != 8) {
+		errs() << "DDP WARN: shadow granules are 4 or 8 bytes, not "
+				<< granuleBytes << "; using 4\n";
+		granuleBytes = 4;
+	}
+	return new ShadowSet(granuleBytes == 8 ? 3 : 2);
+}
+
+SImple *SImpleFactory::WithPredicatedChecks(SImple *S, bool predicated) {
+	S->setPredicatedChecks(predicated);
 	return S;
 }
 
-SImple *SImpleFactory::CreateLibCallSignature() {
-	SImple *S = new LibCallSignature();
+SImple *SImpleFactory::CreateLibCallSignature(unsigned int bits) {
+	SImple *S = new LibCallSignature(bits);
 	return S;
 }
@@ -30,37 +30,50 @@
 
 using namespace llvm;
 
-BuildSignatureAPI::BuildSignatureAPI(SImple &aBS) : BS(aBS) {}
+BuildSignatureAPI::BuildSignatureAPI(SImple &aBS, std::string aName)
+    : BS(aBS), Name(aName), StaticBytes(0) {
+  if (Name.empty())
+    Name = BS.getName();
+}
+
+Type *BuildSignatureAPI::getHandleType(LLVMContext &C) {
+  return Type::getInt32PtrTy(C);
+}
+
+// The SImple's view of the handle. Sets that describe themselves with a
+// struct type (RangeSet, RangeAndBankedSignature) are accessed through a
+// pointer to that struct.
+Value *BuildSignatureAPI::castToSignature(IRBuilder<> &Builder, Value *Handle) {
+  Type *SigTy = BS.getSignatureType();
+  if (!SigTy->isPointerTy())
+    SigTy = PointerType::get(SigTy, 0);
+  return Builder.CreatePointerCast(Handle, SigTy);
+}
 
 void BuildSignatureAPI::CreateAllocateFn(Module *M) {
   std::stringstream ss;
-  ss << BS.getName() << "AllocateFn";
-  FunctionType *FnTy = FunctionType::get(BS.getSignatureType(), false);
+  ss << Name << "AllocateFn";
+  FunctionType *FnTy = FunctionType::get(getHandleType(M->getContext()), false);
   Function *F = Function::Create(
                         FnTy, GlobalValue::ExternalLinkage, ss.str(), M);
   BasicBlock *BB = BasicBlock::Create(M->getContext(), "entry",  F,  NULL);
   IRBuilder<> Builder(BB);
-  Value *ret = (GlobalVariable*)BS.allocateGlobal(Builder);
-  //M->getGlobalList().push_back(ret);
-  PointerType *pt = dyn_cast<PointerType>(ret->getType());
-  if(pt->getElementType()->isIntegerTy()) {
-      Builder.CreateRet( ret );
-  } else {
-      Value *ind[2];
-      ind[0] = Builder.getInt32(0);
-      ind[1] = Builder.getInt32(0);
-      ArrayRef<Value*> indices(ind);
-      Builder.CreateRet(Builder.CreateGEP(ret,indices));
-  }
+  Value *ret = BS.allocateGlobal(Builder);
+
+  // Remember how much static storage the set needs, for benchmarking.
+  if (GlobalVariable *GV = dyn_cast<GlobalVariable>(ret->stripPointerCasts()))
+    StaticBytes = M->getDataLayout().getTypeAllocSize(GV->getValueType());
+
+  Builder.CreateRet(Builder.CreatePointerCast(ret, FnTy->getReturnType()));
 }
 
 void BuildSignatureAPI::CreateInsertFn(Module *M) {
   std::stringstream ss;
-  ss << BS.getName() << "InsertFn";
+  ss << Name << "InsertFn";
 
   IRBuilder<> Builder(M->getContext());
   Type* arr[2];
-  arr[0] = BS.getSignatureType();
+  arr[0] = getHandleType(M->getContext());
   arr[1] = PointerType::get(Builder.getInt8Ty(),0);
   ArrayRef<Type*> args(arr);
 
@@ -68,18 +81,21 @@ void BuildSignatureAPI::CreateInsertFn(Module *M) {
   Function *F = Function::Create(FnTy,GlobalValue::ExternalLinkage,ss.str(),M);
   BasicBlock *BB = BasicBlock::Create(M->getContext(),"entry",F,NULL);
 
+  // Some sets split the block while inserting, so insert ahead of the
+  // return rather than at the end of the block.
   Builder.SetInsertPoint(BB);
-  ++F;
-  //BS.insertPointer(Builder,(Value*)&*(F->arg_begin()),(Value*)&*(++F->arg_begin()));
-  BS.insertPointer(Builder,(Value*)&*(F->arg_begin()),(Value*)&*(F->arg_begin()));
-  Builder.CreateRetVoid();
+  Builder.SetInsertPoint(Builder.CreateRetVoid());
+  Function::arg_iterator arg = F->arg_begin();
+  Value *Sign = castToSignature(Builder, &*arg++);
+  Value *Ptr = &*arg;
+  BS.insertPointer(Builder, Sign, Ptr);
 }
 
 void BuildSignatureAPI::CreateMembershipFn(Module *M) {
   std::stringstream ss;
-  ss << BS.getName() << "MembershipFn";
+  ss << Name << "MembershipFn";
   IRBuilder<> Builder(M->getContext());
-  Type* arr[2] = {BS.getSignatureType(),
+  Type* arr[2] = {getHandleType(M->getContext()),
                   PointerType::get(Builder.getInt8Ty(),0)};
   ArrayRef<Type*> args(arr);
   FunctionType *FnTy = FunctionType::get(Builder.getInt32Ty(),args,false);
@@ -88,10 +104,38 @@ void BuildSignatureAPI::CreateMembershipFn(Module *M) {
   Builder.SetInsertPoint(BB);
   Instruction* initRet = Builder.CreateRet(Builder.getInt32(0));
   Builder.SetInsertPoint(initRet);
-  ++F;
-  Instruction *ret = cast<Instruction>(BS.checkMembership(Builder,
-                        (Value*)&*(F->arg_begin()), (Value*)&*(F->arg_begin())));
+  Function::arg_iterator arg = F->arg_begin();
+  Value *Sign = castToSignature(Builder, &*arg++);
+  Value *Ptr = &*arg;
+  Value *ret = BS.checkMembership(Builder, Sign, Ptr);
+  // Some sets split the block while checking, so return from wherever the
+  // builder ended up.
   Builder.SetInsertPoint(initRet);
-  Builder.CreateRet(ret);
+  Builder.CreateRet(Builder.CreateZExtOrTrunc(ret, Builder.getInt32Ty()));
   initRet->eraseFromParent();
 }
+
+void BuildSignatureAPI::CreateFreeFn(Module *M) {
+  std::stringstream ss;
+  ss << Name << "FreeFn";
+  IRBuilder<> Builder(M->getContext());
+  Type* arr[1] = {getHandleType(M->getContext())};
+  ArrayRef<Type*> args(arr);
+  FunctionType *FnTy = FunctionType::get(Builder.getVoidTy(),args,false);
+  Function *F = Function::Create(FnTy,GlobalValue::ExternalLinkage,ss.str(),M);
+  BasicBlock *BB = BasicBlock::Create(M->getContext(),"entry",F,NULL);
+  Builder.SetInsertPoint(BB);
+  BS.freeSet(Builder, castToSignature(Builder, &*F->arg_begin()));
+  Builder.CreateRetVoid();
+}
+
+void BuildSignatureAPI::CreateSizeFn(Module *M) {
+  std::stringstream ss;
+  ss << Name << "SizeFn";
+  IRBuilder<> Builder(M->getContext());
+  FunctionType *FnTy = FunctionType::get(Builder.getInt64Ty(),false);
+  Function *F = Function::Create(FnTy,GlobalValue::ExternalLinkage,ss.str(),M);
+  BasicBlock *BB = BasicBlock::Create(M->getContext(),"entry",F,NULL);
+  Builder.SetInsertPoint(BB);
+  Builder.CreateRet(Builder.getInt64(StaticBytes));
+}
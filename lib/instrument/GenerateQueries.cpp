@@ -19,6 +19,13 @@
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
@@ -40,6 +47,10 @@
 STATISTIC(NoMayAliasQueries, "Number of May Alias Queries recorded");
 STATISTIC(NoLoads, "Number of stores recorded");
 STATISTIC(NoStores, "Number of laods recorded");
+STATISTIC(NoIndependentQueries, "Number of queries proven independent");
+STATISTIC(NoStaticHitQueries, "Number of queries proven dependent");
+STATISTIC(NoKilledQueries, "Number of queries whose store is always overwritten");
+STATISTIC(NoSharedChecks, "Number of queries reusing an earlier load's check");
 
 using namespace llvm;
 using namespace ddp;
@@ -95,6 +106,19 @@ void getInstructions(const std::vector<BasicBlock*> &bbs,
     }
 }
 
+// The reads and writes in bbs that queries are made for.
+static void getAccesses(const std::vector<BasicBlock*> &bbs,
+                        std::vector<Instruction*> &reads,
+                        std::vector<Instruction*> &writes) {
+  for (BasicBlock *BB : bbs)
+    for (Instruction &I : *BB) {
+      if (isTrackedRead(&I))
+        reads.push_back(&I);
+      if (isTrackedWrite(&I))
+        writes.push_back(&I);
+    }
+}
+
 static bool comesAfter(const DominatorTreeBase<BasicBlock, false> *DT,
 					   const DominatorTreeBase<BasicBlock, true> *PDT,
 					   const BasicBlock *a, const BasicBlock *b) {
@@ -110,28 +134,24 @@ static bool comesAfter(const DominatorTreeBase<BasicBlock, false> *DT,
 void MayAliasQueries::run(Function &F, AAResultsWrapperPass &AA,
                                        ProfileDBHelper &dbHelper) {
 #define AliasResultScope  AliasResult
-  std::vector<LoadInst*> nl_loads;
-  std::vector<StoreInst*> nl_stores;
   std::vector< std::vector<BasicBlock*> > bbs;
   for(scc_iterator<Function*> it = scc_begin(&F); !it.isAtEnd(); ++it) {
       if (it.hasLoop()) {
 	// perform cross product of loads and stores
 	     const std::vector<BasicBlock*> &scc = *it;
-	      std::vector<LoadInst*> loads;
-	      getInstructions<LoadInst>(scc,loads);
-	      std::vector<StoreInst*> stores;
-	      getInstructions<StoreInst>(scc,stores);
+	      std::vector<Instruction*> loads, stores;
+	      getAccesses(scc,loads,stores);
       	NoStores += stores.size();
       	NoLoads += loads.size();
 
 	for(size_t i=0,lsize=loads.size(); i<lsize; i++) {
-	    LoadInst *LI = loads[i];
-        const MemoryLocation loadLoc = MemoryLocation::get(LI);
+	    Instruction *LI = loads[i];
+        const MemoryLocation loadLoc = getReadLocation(LI);
         //AliasAnalysis::Location loadLoc = AA.getLocation(LI);
 	    for(size_t j=0,ssize=stores.size(); j<ssize; j++)
 	      {
-		StoreInst *SI = stores[j];
-        const MemoryLocation storeLoc = MemoryLocation::get(SI);
+		Instruction *SI = stores[j];
+        const MemoryLocation storeLoc = getWriteLocation(SI);
 		//AliasAnalysis::Location storeLoc = AA.getLocation(SI);
 		//AliasResult res = AA.alias(loadLoc,storeLoc);
         AliasResult res = AA.getAAResults().alias(loadLoc,storeLoc);
@@ -182,23 +202,21 @@ void MayAliasQueries::run(Function &F, AAResultsWrapperPass &AA,
 	  continue;
 	}
 
-	std::vector<Instruction*> befores;
-	//getInstructions<LoadInst>(*before,befores);
-	getInstructions<StoreInst>(*before,befores);
+	std::vector<Instruction*> befores, beforeReads;
+	getAccesses(*before,beforeReads,befores);
 
-	std::vector<Instruction*> afters;
-	getInstructions<LoadInst>(*after,afters);
-	//getInstructions<StoreInst>(*after,afters);
+	std::vector<Instruction*> afters, afterWrites;
+	getAccesses(*after,afters,afterWrites);
 
 	for(size_t i=0,lsize=afters.size(); i<lsize; i++)
 	  {
 	    Instruction *LI = afters[i];
-	    const MemoryLocation loadLoc = MemoryLocation::get(LI);
+	    const MemoryLocation loadLoc = getReadLocation(LI);
 	    //AliasAnalysis::Location loadLoc = AA.getLocation(LI);
 	    for(size_t j=0,ssize=befores.size(); j<ssize; j++)
 	      {
 		Instruction *SI = befores[j];
-		 const MemoryLocation storeLoc = MemoryLocation::get(SI);
+		 const MemoryLocation storeLoc = getWriteLocation(SI);
 		//AliasAnalysis::Location storeLoc = AA.getLocation(SI);
 		//AliasResult res = AA.alias(LI,SI);
 		AliasResult res = AA.getAAResults().alias(loadLoc,storeLoc);
@@ -225,6 +243,141 @@ void MayAliasQueries::run(Function &F, AAResultsWrapperPass &AA,
   delete PDT;
 }
 
+// Whether some instance of St can precede an instance of Ld at the same
+// address, given the direction vector of the dependence from St to Ld. A
+// direction that is only '>' at the first level where the accesses are not
+// in the same iteration means the load always comes first.
+static bool mayFlow(Dependence &D, DominatorTree &DT, Instruction *St,
+                    Instruction *Ld) {
+  for (unsigned level = 1; level <= D.getLevels(); level++) {
+    unsigned dir = D.getDirection(level);
+    if (dir & Dependence::DVEntry::LT)
+      return true;
+    if (!(dir & Dependence::DVEntry::EQ))
+      return false;
+  }
+  // Possibly in the same iteration of every common loop.
+  return !DT.dominates(Ld, St);
+}
+
+// Whether every instance of Ld reads what an instance of St wrote earlier:
+// the dependence always holds, within one iteration, and St runs first.
+static bool mustFlow(Dependence &D, DominatorTree &DT, LoopInfo &LI,
+                     Instruction *St, Instruction *Ld) {
+  if (!D.isConsistent() || !DT.dominates(St, Ld)
+      || LI.getLoopFor(St->getParent()) != LI.getLoopFor(Ld->getParent()))
+    return false;
+  for (unsigned level = 1; level <= D.getLevels(); level++) {
+    const SCEV *dist = D.getDistance(level);
+    if (!dist || !dist->isZero())
+      return false;
+  }
+  return true;
+}
+
+///
+/// Basic AA leaves many pairs in loops as MayAlias that DependenceAnalysis
+/// can settle from their subscripts (A[2*i] and A[2*i+1], or a store to
+/// A[i+1] that the load of A[i] has already passed). A query whose store
+/// can never write what the load later reads is dropped; one whose load
+/// always reads what the store just wrote is kept as a static hit, which
+/// the instrumentation records without any set operations.
+///
+void Queries::pruneWithDependences(Function &F, AAResults &AA) {
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  TargetLibraryInfoImpl TLII(Triple(F.getParent()->getTargetTriple()));
+  TargetLibraryInfo TLI(TLII);
+  AssumptionCache AC(F);
+  ScalarEvolution SE(F, TLI, AC, DT, LI);
+  DependenceInfo DI(&F, &AA, &SE, &LI);
+
+  QueryVector kept;
+  for (query_iterator it = v.begin(); it != v.end(); it++) {
+    Query &Q = *it;
+    std::unique_ptr<Dependence> D = DI.depends(Q.rhs, Q.lhs, true);
+    if (!D || (!D->isConfused() && !mayFlow(*D, DT, Q.rhs, Q.lhs))) {
+      NoIndependentQueries++;
+      continue;
+    }
+    if (!D->isConfused() && mustFlow(*D, DT, LI, Q.rhs, Q.lhs)) {
+      Q.staticHit = true;
+      NoStaticHitQueries++;
+    }
+    kept.push_back(Q);
+  }
+  v.swap(kept);
+}
+
+// Whether the last write to Ld's address on every path to it is a store
+// other than St that overwrites all of it.
+static bool isKilledBefore(StoreInst *St, LoadInst *Ld, MemorySSA &MSSA,
+                           AAResults &AA, const DataLayout &DL) {
+  MemoryAccess *Clobber = MSSA.getWalker()->getClobberingMemoryAccess(Ld);
+  MemoryDef *Def = dyn_cast<MemoryDef>(Clobber);
+  if (!Def || MSSA.isLiveOnEntryDef(Def))
+    return false;
+  StoreInst *Kill = dyn_cast_or_null<StoreInst>(Def->getMemoryInst());
+  if (!Kill || Kill == St)
+    return false;
+  return AA.alias(MemoryLocation::get(Kill), MemoryLocation::get(Ld))
+           == AliasResultScope::MustAlias
+    && DL.getTypeStoreSize(Kill->getValueOperand()->getType())
+           >= DL.getTypeStoreSize(Ld->getType());
+}
+
+///
+/// A load reads the last store to its address. When MemorySSA finds a
+/// single must-alias store that is that last store on every path to the
+/// load, the load's other may-alias stores can never be its source, so
+/// their queries are dropped.
+///
+/// Inserts only happen at stores, i.e. at MemoryDefs, so two loads of the
+/// same pointer with the same defining access see the same set contents.
+/// The later of two such loads, dominated by the earlier, gets it as its
+/// sharedCheck and reuses its membership checks, for the sets the earlier
+/// load is itself checked against.
+///
+void Queries::pruneWithMemorySSA(Function &F, AAResults &AA) {
+  DominatorTree DT(F);
+  MemorySSA MSSA(F, &AA, &DT);
+  const DataLayout &DL = F.getParent()->getDataLayout();
+
+  QueryVector kept;
+  std::map<std::pair<Value*, MemoryAccess*>, std::vector<LoadInst*> > versions;
+  std::set<LoadInst*> seen;
+  for (query_iterator it = v.begin(); it != v.end(); it++) {
+    Query &Q = *it;
+    LoadInst *Ld = dyn_cast<LoadInst>(Q.lhs);
+    StoreInst *St = dyn_cast<StoreInst>(Q.rhs);
+    if (Ld && St && isKilledBefore(St, Ld, MSSA, AA, DL)) {
+      NoKilledQueries++;
+      continue;
+    }
+    if (Ld && !Ld->isVolatile() && seen.insert(Ld).second)
+      if (MemoryUseOrDef *MA = MSSA.getMemoryAccess(Ld))
+        versions[std::make_pair(Ld->getPointerOperand(),
+                                MA->getDefiningAccess())].push_back(Ld);
+    kept.push_back(Q);
+  }
+  v.swap(kept);
+
+  // The outermost load of a version that dominates Ld, if any.
+  std::map<Instruction*, Instruction*> shared;
+  for (auto &it : versions)
+    for (LoadInst *Ld : it.second)
+      for (LoadInst *Other : it.second)
+        if (Other != Ld && DT.dominates(Other, Ld)
+            && (!shared[Ld] || DT.dominates(Other, shared[Ld])))
+          shared[Ld] = Other;
+
+  for (query_iterator it = v.begin(); it != v.end(); it++)
+    if (Instruction *Leader = shared[(*it).lhs]) {
+      (*it).sharedCheck = Leader;
+      NoSharedChecks++;
+    }
+}
+
 GetElementPtrInst* MayAliasQueries::traceToStructGEP(Value *val) {
    Value *startVal = val;
    Instruction *inst;
@@ -417,8 +570,8 @@ void MayAliasQueries::insertQuery(Instruction *lhs, Instruction *rhs,
 //      }
 
       //Detect mismatching GEP ==> Compare base pointer type and constant offsets. Display if mismatching.
-      GetElementPtrInst *LoadGEP = traceToStructGEP(lhs->getOperand(0));
-      GetElementPtrInst *StoreGEP = traceToStructGEP(rhs->getOperand(1));
+      GetElementPtrInst *LoadGEP = traceToStructGEP(getReadPointer(lhs));
+      GetElementPtrInst *StoreGEP = traceToStructGEP(getWritePointer(rhs));
       if(LoadGEP != nullptr && StoreGEP != nullptr) {
          // This is the code to detect if structures are unions, guessing by the name. But somehow the getName function is not returning proper value.
          //StructType *loadStructType = cast<StructType>(LoadGEP->getOperand(0)->getType());
@@ -473,9 +626,9 @@ void MayAliasQueries::insertQuery(Instruction *lhs, Instruction *rhs,
       {
       //Check for constness of load address. Then it can never conflict with a store.
          std::set<PHINode*> seenPhi;
-         if( isConstAddr(lhs->getOperand(0),seenPhi) ) {
+         if( isConstAddr(getReadPointer(lhs),seenPhi) ) {
             errs() << "DDP WARN: Constant Load Address FileID="<< fileid
-            	   <<" ID=" << id << " LoadAddr=" << *lhs->getOperand(0) << "\n";
+            	   <<" ID=" << id << " LoadAddr=" << *getReadPointer(lhs) << "\n";
             return;
          }
       }
@@ -484,8 +637,8 @@ void MayAliasQueries::insertQuery(Instruction *lhs, Instruction *rhs,
        //Check if one of the address is coming from alloca, while other is
        // through a GEP. These can never clash as an explicit alloca won't be
        // inside anything.
-         Value *loadAddr = lhs->getOperand(0);
-         Value *storeAddr = rhs->getOperand(1);
+         Value *loadAddr = getReadPointer(lhs);
+         Value *storeAddr = getWritePointer(rhs);
          if(isa<BitCastInst>(loadAddr)) {
            loadAddr = cast<BitCastInst>(loadAddr)->getOperand(0);
          }
@@ -523,8 +676,8 @@ void MayAliasQueries::insertQuery(Instruction *lhs, Instruction *rhs,
       }
 
       {
-         Value *loadAddr = lhs->getOperand(0);
-         Value *storeAddr = rhs->getOperand(1);
+         Value *loadAddr = getReadPointer(lhs);
+         Value *storeAddr = getWritePointer(rhs);
          std::set<PHINode*> seenPhi;
          Value *loadAddrSource = traceToAddressSource(loadAddr,seenPhi);
          seenPhi.clear();
@@ -574,6 +727,94 @@ void MayAliasQueries::insertQuery(Instruction *lhs, Instruction *rhs,
    Queries::insertQuery(lhs,rhs,id,pset);
 }
 
+// The pointer of a masked vector load or store, or null.
+static Value* maskedPointer(Instruction *I) {
+  if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(I)) {
+    if (II->getIntrinsicID() == Intrinsic::masked_load)
+      return II->getArgOperand(0);
+    if (II->getIntrinsicID() == Intrinsic::masked_store)
+      return II->getArgOperand(1);
+  }
+  return nullptr;
+}
+
+bool ddp::isSingleAccess(Instruction *I) {
+  return isa<LoadInst>(I) || isa<StoreInst>(I) || isa<AtomicRMWInst>(I)
+    || isa<AtomicCmpXchgInst>(I);
+}
+
+bool ddp::isTrackedRead(Instruction *I) {
+  if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(I))
+    return isa<MemTransferInst>(II)
+      || II->getIntrinsicID() == Intrinsic::masked_load;
+  return isSingleAccess(I) && !isa<StoreInst>(I);
+}
+
+bool ddp::isTrackedWrite(Instruction *I) {
+  if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(I))
+    return isa<MemIntrinsic>(II)
+      || II->getIntrinsicID() == Intrinsic::masked_store;
+  return isSingleAccess(I) && !isa<LoadInst>(I);
+}
+
+// The address a load, store, atomic or masked access is made at.
+static Value* accessPointer(Instruction *I) {
+  if (LoadInst *LI = dyn_cast<LoadInst>(I))
+    return LI->getPointerOperand();
+  if (StoreInst *SI = dyn_cast<StoreInst>(I))
+    return SI->getPointerOperand();
+  if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(I))
+    return RMW->getPointerOperand();
+  if (AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(I))
+    return CX->getPointerOperand();
+  return maskedPointer(I);
+}
+
+Value* ddp::getReadPointer(Instruction *I) {
+  if (MemTransferInst *MT = dyn_cast<MemTransferInst>(I))
+    return MT->getRawSource();
+  return accessPointer(I);
+}
+
+Value* ddp::getWritePointer(Instruction *I) {
+  if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I))
+    return MI->getRawDest();
+  return accessPointer(I);
+}
+
+Value* ddp::getAccessLength(Instruction *I) {
+  if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I))
+    return MI->getLength();
+  IntrinsicInst *II = cast<IntrinsicInst>(I);
+  Type *Ty = II->getIntrinsicID() == Intrinsic::masked_load
+    ? II->getType() : II->getArgOperand(0)->getType();
+  const DataLayout &DL = I->getModule()->getDataLayout();
+  return ConstantInt::get(Type::getInt64Ty(I->getContext()),
+                          DL.getTypeStoreSize(Ty));
+}
+
+// The location of a masked access: all of its vector.
+static MemoryLocation maskedLocation(Value *Ptr, Instruction *I) {
+  return MemoryLocation(Ptr,
+                        cast<ConstantInt>(getAccessLength(I))->getZExtValue());
+}
+
+MemoryLocation ddp::getReadLocation(Instruction *I) {
+  if (MemTransferInst *MT = dyn_cast<MemTransferInst>(I))
+    return MemoryLocation::getForSource(MT);
+  if (isa<IntrinsicInst>(I))
+    return maskedLocation(getReadPointer(I), I);
+  return MemoryLocation::get(I);
+}
+
+MemoryLocation ddp::getWriteLocation(Instruction *I) {
+  if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I))
+    return MemoryLocation::getForDest(MI);
+  if (isa<IntrinsicInst>(I))
+    return maskedLocation(getWritePointer(I), I);
+  return MemoryLocation::get(I);
+}
+
 void ddp::printBacktrace(const std::string &filename, Value *val) {
    std::error_code EC;
 
@@ -26,11 +26,19 @@
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/TypeBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
@@ -44,6 +52,8 @@
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "Instrument.h"
 #include  "SetInstrumentFactory.h"
 #include <vector>
@@ -53,6 +63,18 @@ STATISTIC(NumRepeatQueries, "Number of repeated queries during instrumentataion"
 STATISTIC(NumQueryAllocas, "Number of query allocas added");
 STATISTIC(NumMembershipTests, "Number of membership tests added");
 STATISTIC(NumInsertions, "Number of insertions added");
+STATISTIC(NumPromotedAllocas, "Number of instrumentation allocas promoted");
+STATISTIC(NumLoopLocalCopies, "Number of loop-local set copies added");
+STATISTIC(NumRangeInserts, "Number of insertions summarized by a range");
+STATISTIC(NumRangeChecks, "Number of membership tests summarized by a range");
+STATISTIC(NumRangeAccesses, "Number of memory intrinsic and masked accesses");
+STATISTIC(NumStaticHits, "Number of queries resolved at compile time");
+STATISTIC(NumCoveredInserts, "Number of insertions elided by a dominating one");
+STATISTIC(NumKnownHits, "Number of membership tests elided as certain hits");
+STATISTIC(NumReusedChecks, "Number of membership tests reusing an earlier one");
+STATISTIC(NumSharedHashChecks, "Number of membership tests sharing a hash");
+STATISTIC(NumCoalescedGranules, "Number of inserts and checks of a granule "
+		"coalesced within a block");
 
 using namespace llvm;
 
@@ -83,6 +105,17 @@ cl::opt<bool> PerfInstr("perfinstr", cl::Hidden,
 cl::opt<bool> RangeInstr("rangeinstr", cl::Hidden,
 		cl::desc("RangeSet Instrumentation is enabled"), cl::init(false));
 
+cl::opt<bool> CuckooInstr("cuckooinstr", cl::Hidden,
+		cl::desc("Cuckoo filter sets, which forget freed memory, are enabled "
+				"(-signsize gives their size)"), cl::init(false));
+
+static cl::opt<bool> ShadowInstr("shadowinstr", cl::Hidden,
+		cl::desc("Exact sets kept as tags in shadow memory are enabled "
+				"(-shadow-granule gives their granule)"), cl::init(false));
+
+static cl::opt<unsigned int> ShadowGranule("shadow-granule", cl::Hidden,
+		cl::desc("Bytes of memory per shadow tag, 4 or 8"), cl::init(4));
+
 cl::opt<bool> HybridSign("hybrid", cl::Hidden,
 		cl::desc("Range Checking + Banked Signature"), cl::init(false));
 
@@ -95,10 +128,66 @@ static cl::opt<bool> SignInstr("signinstr", cl::Hidden,
 static cl::opt<bool> FastSign("fastsign", cl::Hidden,
 		cl::desc("Use faster signatures (less accurate)"), cl::init(false));
 
+static cl::opt<bool> DoubleHashSign("double-hash-sign", cl::Hidden,
+		cl::desc("Derive all bank indices of a signature from one hash "
+				"(double hashing)"), cl::init(false));
+
+static cl::opt<bool> BlockedSign("blocked-sign", cl::Hidden,
+		cl::desc("Use a blocked Bloom signature, which touches one cache line "
+				"per insert or check"), cl::init(false));
+
+static cl::opt<bool> PooledSignatures("pooled-signatures", cl::Hidden,
+		cl::desc("Take signatures from a per-thread pool instead of the stack "
+				"and clear only the parts that were written"), cl::init(false));
+
+static cl::opt<bool> LazySignatures("lazy-signatures", cl::Hidden,
+		cl::desc("Allocate each set where it is first needed rather than at "
+				"function entry"), cl::init(false));
+
+static cl::opt<bool> PromoteSignatures("promote-signatures", cl::Hidden,
+		cl::desc("Keep small signatures and query results in registers once "
+				"the function is instrumented"), cl::init(true));
+
+static cl::opt<bool> LoopLocalSignatures("loop-local-signatures", cl::Hidden,
+		cl::desc("Collect the inserts of countable innermost loops in a copy "
+				"of the set merged after the loop, so the loop can still be "
+				"vectorized"), cl::init(false));
+
+static cl::opt<bool> SummarizeRanges("summarize-ranges", cl::Hidden,
+		cl::desc("Insert or check the affine accesses of a countable loop as "
+				"one range, before the loop"), cl::init(false));
+
+static cl::opt<bool> NumberAddresses("number-addresses", cl::Hidden,
+		cl::desc("Elide inserts and checks of addresses a dominating insert "
+				"or check already covered"), cl::init(false));
+
+static cl::opt<bool> MultiChecks("multi-checks", cl::Hidden,
+		cl::desc("Hash a load's address once for all of its sets that hash "
+				"alike"), cl::init(false));
+
+static cl::opt<unsigned int> Granularity("granularity", cl::Hidden,
+		cl::desc("Bytes tracked as one location: 4, 8, 64 (a cache line) or "
+				"4096 (a page). By default sets track what their hash resolves, "
+				"or exact addresses"), cl::init(0));
+
+static cl::list<std::string> RefidGranularity("refid-granularity",
+		cl::Hidden, cl::CommaSeparated,
+		cl::desc("<refid>:<bytes> overrides -granularity for the set of the "
+				"named refid"));
+
 static cl::opt<bool> EarlyTermination("early-termination", cl::Hidden,
 		cl::desc("Stop checking for a dependence in a region once it's "
 				"confirmed"), cl::init(false));
 
+static cl::opt<bool> PredicatedChecks("predicated-checks", cl::Hidden,
+		cl::desc("Use select instead of branches to skip work in checks "
+				"(default: chosen per set kind, and branches for early "
+				"termination)"), cl::init(true));
+
+static cl::opt<bool> RecordTrace("record-trace", cl::Hidden,
+		cl::desc("Record every set insert and check into an address trace "
+				"(see DDP_TRACE_FILE)"), cl::init(false));
+
 static cl::opt<bool> PopulationCount("population-count", cl::Hidden,
 		cl::desc("Store the population counts for signatures in DB"),
 		cl::init(true));
@@ -138,14 +227,121 @@ Value* SetInstrument::getPointerOperand(Instruction* I) {
 		return LI->getPointerOperand();
 	} else if (StoreInst* SI = dyn_cast < StoreInst > (I)) {
 		return SI->getPointerOperand();
+	} else if (AtomicRMWInst* RMW = dyn_cast < AtomicRMWInst > (I)) {
+		return RMW->getPointerOperand();
+	} else if (AtomicCmpXchgInst* CX = dyn_cast < AtomicCmpXchgInst > (I)) {
+		return CX->getPointerOperand();
 	} else {
-		assert(0 && "getPointerOperand() on Inst that isn't load/store");
+		assert(0 && "getPointerOperand() on Inst that isn't load/store/atomic");
 		return NULL;
 	}
 }
 
 static const int minStructSize = 16;
 
+// Wrap a newly created set so its operations are also recorded in the
+// address trace, when -record-trace is given.
+static SImple *traceSet(SImple *Set, ddp::Query &Q) {
+	if (RecordTrace)
+		return new TraceSet(Set, Q.id);
+	return Set;
+}
+
+// A set is used by the inserts of its queries' RHS and the checks of
+// their LHS. Regions must be placed before any instrumentation changes the
+// CFG, so do it for all sets up front.
+void SetInstrument::createLazyRegions() {
+	std::map<unsigned int, std::vector<Instruction*> > uses;
+	ddp::Queries::query_iterator i, end = AQ.end();
+	for (i = AQ.begin(); i != end; i++) {
+		if ((*i).staticHit)
+			continue;
+		uses[(*i).pset].push_back((*i).rhs);
+		uses[(*i).pset].push_back((*i).lhs);
+	}
+
+	DominatorTree DT(F);
+	for (auto &it : uses)
+		LazyRegions[it.first].reset(new LazyFunctionRegion(F, DT, it.second));
+}
+
+template <typename AllocatePolicy>
+AbstractSetInstrumentHelper<SImple> *SetInstrument::createHelper(
+		unsigned int set, SImple *Set) {
+	bool predicated = Set->prefersPredicatedChecks();
+	if (PredicatedChecks.getNumOccurrences() > 0)
+		predicated = PredicatedChecks;
+	Set->setPredicatedChecks(predicated);
+	// Once a region's dependence is confirmed, the early termination branch
+	// skips every further check and is well predicted, so it is kept unless
+	// predication is asked for.
+	predicated = PredicatedChecks.getNumOccurrences() > 0 && PredicatedChecks;
+
+	// A set that tracks granules itself is given addresses, not granules.
+	int granuleShift = granuleShiftOf(set);
+	if (granuleShift >= 0 && Set->takeGranularity(granuleShift))
+		granuleShift = -1;
+	if (LazySignatures) {
+		if (AllocatePolicy::FreesSets)
+			LazyRegions[set]->placeFrees(SplitExits);
+		return new SetInstrumentHelper<SImple, AllocatePolicy,
+				LazyFunctionRegion>(*LazyRegions[set], Set, EarlyTermination,
+				predicated, granuleShift);
+	}
+	return new SetInstrumentHelper<SImple, AllocatePolicy>(Region, Set,
+			EarlyTermination, predicated, granuleShift);
+}
+
+// log2 of a granularity, or -1 if it is not a power of 2 of at least a word.
+static int granuleShift(unsigned int bytes) {
+	if (bytes < 4 || (bytes & (bytes - 1))) {
+		errs() << "DDP WARN: ignoring granularity " << bytes
+				<< ", which is not a power of 2 of at least 4 bytes\n";
+		return -1;
+	}
+	int shift = 0;
+	while ((1u << shift) < bytes)
+		shift++;
+	return shift;
+}
+
+int SetInstrument::granuleShiftOf(unsigned int set) {
+	std::map<unsigned int, int>::iterator s = GranuleShifts.find(set);
+	return s == GranuleShifts.end() ? -1 : s->second;
+}
+
+// A set takes the granularity of any of its refids named by
+// -refid-granularity, and -granularity otherwise.
+void SetInstrument::assignGranularities() {
+	std::map<unsigned long long, int> refids;
+	for (auto &Arg : RefidGranularity) {
+		size_t colon = Arg.find(':');
+		if (colon == std::string::npos) {
+			errs() << "DDP WARN: ignoring -refid-granularity=" << Arg
+					<< ", expected <refid>:<bytes>\n";
+			continue;
+		}
+		refids[strtoull(Arg.substr(0, colon).c_str(), NULL, 10)] = granuleShift(
+				strtoul(Arg.substr(colon + 1).c_str(), NULL, 10));
+	}
+
+	int shift = Granularity.getNumOccurrences() > 0 ?
+			granuleShift(Granularity) : -1;
+	ddp::Queries::query_iterator i, end = AQ.end();
+	for (i = AQ.begin(); i != end; i++)
+		if (shift >= 0)
+			GranuleShifts[(*i).pset] = shift;
+	for (i = AQ.begin(); i != end; i++) {
+		std::map<unsigned long long, int>::iterator r = refids.find((*i).id);
+		if (r == refids.end())
+			continue;
+		if (r->second >= 0)
+			GranuleShifts[(*i).pset] = r->second;
+		else
+			GranuleShifts.erase((*i).pset);
+	}
+}
+
 SetInstrument::SetInstrument(ddp::Queries &aAQ, Function &Fn,
 		ProfileDBHelper &dbHelper) :
 		AQ(aAQ), F(Fn), Region(Fn), Context(F.getContext()), M(*F.getParent()), pos(
@@ -156,28 +352,41 @@ SetInstrument::SetInstrument(ddp::Queries &aAQ, Function &Fn,
 	ProfileSets.clear();
 	StructPsetMap.clear();
 	clearChecked();
+	for (auto &I : F.getEntryBlock())
+		if (AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+			OrigAllocas.insert(AI);
+	if (LazySignatures)
+		createLazyRegions();
+	assignGranularities();
 
 	ddp::Queries::query_iterator i, end = AQ.end();
 	for (i = AQ.begin(); i != end; i++) {
 		unsigned int set = (*i).pset;
+		// Static hits never touch their set.
+		if ((*i).staticHit)
+			continue;
 		if (ProfileSets.find(set) == ProfileSets.end()) {
 			SImple *Set = NULL;
 			errs() << "SIMPLE SET\n";
 			// Haven't seen this set before. allocate it.
 			if (SignInstr) {
 				if (UseLibCalls)
-					Set = SImpleFactory::CreateLibCallSignature();
+					Set = SImpleFactory::CreateLibCallSignature(SignSize);
 				else {
 					if (FastSign) {
 						Set = SImpleFactory::CreateFastSignature(SignSize);
 					} else if (HybridSign) {
 						Set = SImpleFactory::CreateHybridSignature(SignSize);
+					} else if (DoubleHashSign) {
+						Set = SImpleFactory::CreateDoubleHashSignature(SignSize);
+					} else if (BlockedSign) {
+						Set = SImpleFactory::CreateBlockedSignature(SignSize);
 					} else {
 						//Detect if store comes from a struct and create struct style signature.
 						int structSize;
 						//if(StructSizeDynSign.getValue() && minStructSize <= ( structSize = traceStructSize(i->rhs->getOperand(1)) ) ) {
 						if (StructSizeDynSign && minStructSize <= (structSize =
-								traceStructSize(i->rhs->getOperand(1)))) {
+								traceStructSize(ddp::getWritePointer(i->rhs)))) {
 							errs() << "Creating struct based signature : ID="
 									<< (*i).id << " Size = " << structSize
 									<< "\n";
@@ -199,26 +408,31 @@ SetInstrument::SetInstrument(ddp::Queries &aAQ, Function &Fn,
 						Set = new DumpSet(Set, (*i).id);
 					}
 				}
+				Set = traceSet(Set, *i);
 
-				ProfileSets[set] = new SetInstrumentHelper<>(Region, Set,
-						EarlyTermination);
+				if (PooledSignatures)
+					ProfileSets[set] = createHelper<AllocatePooled<SImple> >(set, Set);
+				else
+					ProfileSets[set] = createHelper<AllocateLocal<SImple> >(set, Set);
 
 			} else if (PerfInstr) {
 				errs() << "PERFECT SET\n";
-				ProfileSets[set] = new SetInstrumentHelper<SImple,
-						AllocateHeap<SImple> >(Region,
-						SImpleFactory::CreatePerfectSet(), EarlyTermination);
+				ProfileSets[set] = createHelper<AllocateHeap<SImple> >(set,
+						traceSet(SImpleFactory::CreatePerfectSet(), *i));
 			} else if (RangeInstr) {
-				ProfileSets[set] = new SetInstrumentHelper<>(Region,
-						SImpleFactory::CreateRangeSet(), EarlyTermination);
+				ProfileSets[set] = createHelper<AllocateLocal<SImple> >(set,
+						traceSet(SImpleFactory::CreateRangeSet(), *i));
+			} else if (CuckooInstr) {
+				ProfileSets[set] = createHelper<AllocateHeap<SImple> >(set,
+						traceSet(SImpleFactory::CreateCuckooSet(SignSize), *i));
+			} else if (ShadowInstr) {
+				ProfileSets[set] = createHelper<AllocateLocal<SImple> >(set,
+						traceSet(SImpleFactory::CreateShadowSet(ShadowGranule), *i));
 			} else if (HTInstr) {
 				//typedef SetInstrumentHelper< HashTableSet, AllocateUniqueGlobal<HashTableSet> >
 				//        HashTableHelper;
-				typedef SetInstrumentHelper<> HashTableHelper;
-
-				ProfileSets[set] = new HashTableHelper(Region,
-						(HashTableSet*) SImpleFactory::CreateHashTableSet(),
-						EarlyTermination);
+				ProfileSets[set] = createHelper<AllocateLocal<SImple> >(set,
+						traceSet(SImpleFactory::CreateHashTableSet(), *i));
 
 			} else {
 				DEBUG_WITH_TYPE("ddp",
@@ -237,8 +451,8 @@ SetInstrument::SetInstrument(ddp::Queries &aAQ, Function &Fn,
 					SImple &Set = ProfileSets[set]->getSetImpl();
 					delete ProfileSets[set];
 					SImple *nSet = new DumpSet(&Set, (*i).id);
-					ProfileSets[set] = new SetInstrumentHelper<>(Region, nSet,
-							EarlyTermination);
+					ProfileSets[set] = createHelper<AllocateLocal<SImple> >(set,
+							nSet);
 				}
 			}
 		}
@@ -568,6 +782,10 @@ void SetInstrument::instrNoAliasQueries(std::vector<ReturnInst*> &Rets) {
 						ConstantInt::get(int32, 1)), fCount);
 	}
 
+	for (i = AQ.begin(); i != end; i++)
+		if (!(*i).staticHit)
+			LoadSets[(*i).lhs].insert((*i).pset);
+
 	for (i = AQ.begin(); i != end; i++) {
 		ddp::Query &Q = *i;
 
@@ -579,6 +797,14 @@ void SetInstrument::instrNoAliasQueries(std::vector<ReturnInst*> &Rets) {
 		// JMT Hack: please fix me. this only works if LHS & RHS have a single bit set
 		AllocaInst* QueryVar = allocateVariableForQuery(Q, Rets);
 
+		// The load is known to depend on the store every time it runs.
+		if (Q.staticHit) {
+			new StoreInst(ConstantInt::get(Type::getInt32Ty(Context), 1),
+					QueryVar, Q.lhs);
+			NumStaticHits++;
+			continue;
+		}
+
 		// Perform insertions for each of the RHS elements
 		// The actual number of insertions is based on 
 		// the underlying storage
@@ -689,6 +915,32 @@ bool SetInstrument::instrument(Pass* P, Function &F) {
 	// Subsequently, update the global
 	// counters array using the variable
 
+	createAccessRanges();
+	// Done before anything changes the CFG, since they need the loops.
+	if (SummarizeRanges || LoopLocalSignatures) {
+		DominatorTree DT(F);
+		LoopInfo LI(DT);
+		TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+		TargetLibraryInfo TLI(TLII);
+		AssumptionCache AC(F);
+		ScalarEvolution SE(F, TLI, AC, DT, LI);
+		if (SummarizeRanges)
+			createRangeSummaries(DT, LI, SE);
+		if (LoopLocalSignatures)
+			createLoopLocalCopies(LI, SE);
+	}
+	// Trace recording wants every insert and check, and a set that can lose
+	// members (ShadowSet) cannot elide any.
+	bool elide = !RecordTrace;
+	for (auto &it : ProfileSets)
+		elide = elide && it.second->getSetImpl().keepsMembers();
+	if (NumberAddresses && elide) {
+		DominatorTree DT(F);
+		createAddressNumbering(DT);
+	}
+	if (!GranuleShifts.empty() && elide)
+		coalesceGranules();
+
 	// instrument No Alias Queries
 	instrNoAliasQueries(Rets);
 	errs() << "INSTR NO ALIAS QUERIES\n";
@@ -710,9 +962,587 @@ bool SetInstrument::instrument(Pass* P, Function &F) {
 	this->finalize(Rets);
 	errs() << "--FINALIZE\n";
 
+	if (PromoteSignatures)
+		promoteInstrumentation();
+
+	return true;
+}
+
+// Arrays of at most this many words are split into one alloca per word.
+static const unsigned MaxScalarizedWords = 4;
+
+static bool isZeroFill(MemSetInst *MS, Value *Dest, uint64_t bytes) {
+	ConstantInt *Len = dyn_cast<ConstantInt>(MS->getLength());
+	ConstantInt *Val = dyn_cast<ConstantInt>(MS->getValue());
+	return MS->getRawDest() == Dest && Len && Len->getZExtValue() == bytes
+			&& Val && Val->isZero();
+}
+
+// True if AI is a small array of integer words that is only read and
+// written a word at a time (through a single index GEP, or directly for
+// word 0) and cleared by a memset of the whole array.
+static bool isScalarizable(AllocaInst *AI) {
+	ConstantInt *N = dyn_cast<ConstantInt>(AI->getArraySize());
+	Type *Ty = AI->getAllocatedType();
+	if (!N || N->getZExtValue() < 2 || N->getZExtValue() > MaxScalarizedWords
+			|| !Ty->isIntegerTy())
+		return false;
+	uint64_t bytes = N->getZExtValue() * Ty->getIntegerBitWidth() / 8;
+
+	for (User *U : AI->users()) {
+		if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(U)) {
+			if (GEP->getNumIndices() != 1)
+				return false;
+			for (User *GU : GEP->users()) {
+				StoreInst *SI = dyn_cast<StoreInst>(GU);
+				if (!isa<LoadInst>(GU) && (!SI || SI->getValueOperand() == GEP))
+					return false;
+			}
+		} else if (BitCastInst *BC = dyn_cast<BitCastInst>(U)) {
+			for (User *BU : BC->users()) {
+				MemSetInst *MS = dyn_cast<MemSetInst>(BU);
+				if (!MS || !isZeroFill(MS, BC, bytes))
+					return false;
+			}
+		} else if (MemSetInst *MS = dyn_cast<MemSetInst>(U)) {
+			if (!isZeroFill(MS, AI, bytes))
+				return false;
+		} else if (StoreInst *SI = dyn_cast<StoreInst>(U)) {
+			if (SI->getValueOperand() == AI)
+				return false;
+		} else if (!isa<LoadInst>(U)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void zeroWords(Instruction *pos, std::vector<AllocaInst*> &Words) {
+	IRBuilder<> B(pos);
+	for (auto *W : Words)
+		B.CreateStore(Constant::getNullValue(W->getAllocatedType()), W);
+}
+
+// Replace the array AI by one alloca per word. An access at a variable
+// index reads every word and selects, or rewrites every word with a select,
+// which become a few ALU ops once the words are promoted to registers.
+static void scalarize(AllocaInst *AI, std::vector<AllocaInst*> &Words) {
+	unsigned N = cast<ConstantInt>(AI->getArraySize())->getZExtValue();
+	Type *Ty = AI->getAllocatedType();
+	for (unsigned k = 0; k < N; k++)
+		Words.push_back(new AllocaInst(Ty, 0, AI->getName() + ".w" + Twine(k),
+				AI));
+
+	std::vector<User*> users(AI->user_begin(), AI->user_end());
+	for (User *U : users) {
+		if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(U)) {
+			Value *Idx = GEP->getOperand(1);
+			std::vector<User*> gusers(GEP->user_begin(), GEP->user_end());
+			for (User *GU : gusers) {
+				IRBuilder<> B(cast<Instruction>(GU));
+				if (LoadInst *LI = dyn_cast<LoadInst>(GU)) {
+					Value *V = B.CreateLoad(Words[0]);
+					for (unsigned k = 1; k < N; k++)
+						V = B.CreateSelect(
+								B.CreateICmpEQ(Idx, ConstantInt::get(Idx->getType(), k)),
+								B.CreateLoad(Words[k]), V);
+					LI->replaceAllUsesWith(V);
+				} else {
+					Value *V = cast<StoreInst>(GU)->getValueOperand();
+					for (unsigned k = 0; k < N; k++)
+						B.CreateStore(B.CreateSelect(
+								B.CreateICmpEQ(Idx, ConstantInt::get(Idx->getType(), k)),
+								V, B.CreateLoad(Words[k])), Words[k]);
+				}
+				cast<Instruction>(GU)->eraseFromParent();
+			}
+			GEP->eraseFromParent();
+		} else if (BitCastInst *BC = dyn_cast<BitCastInst>(U)) {
+			std::vector<User*> busers(BC->user_begin(), BC->user_end());
+			for (User *BU : busers) {
+				zeroWords(cast<Instruction>(BU), Words);
+				cast<Instruction>(BU)->eraseFromParent();
+			}
+			BC->eraseFromParent();
+		} else if (MemSetInst *MS = dyn_cast<MemSetInst>(U)) {
+			zeroWords(MS, Words);
+			MS->eraseFromParent();
+		} else if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
+			LI->replaceAllUsesWith(new LoadInst(Words[0], "", LI));
+			LI->eraseFromParent();
+		} else {
+			StoreInst *SI = cast<StoreInst>(U);
+			new StoreInst(SI->getValueOperand(), Words[0], SI);
+			SI->eraseFromParent();
+		}
+	}
+	AI->eraseFromParent();
+}
+
+///
+/// The instrumentation keeps signatures, early termination flags and query
+/// results in allocas, loading and storing them around every insert and
+/// check. Those that nothing else takes the address of (all but sets passed
+/// to the runtime) are promoted to SSA values here, after splitting small
+/// signature arrays into words, so instrumented loops carry them in
+/// registers.
+///
+void SetInstrument::promoteInstrumentation() {
+	std::vector<AllocaInst*> Candidates, Allocas;
+	for (auto &I : F.getEntryBlock())
+		if (AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+			if (!OrigAllocas.count(AI))
+				Candidates.push_back(AI);
+
+	for (auto *AI : Candidates) {
+		if (isScalarizable(AI))
+			scalarize(AI, Allocas);
+		else if (isAllocaPromotable(AI))
+			Allocas.push_back(AI);
+	}
+	if (Allocas.empty())
+		return;
+
+	DominatorTree DT(F);
+	PromoteMemToReg(Allocas, DT);
+	NumPromotedAllocas += Allocas.size();
+}
+
+// Once per kind of set.
+static void warnNotMergeable(SImple &S) {
+	static std::set<std::string> warned;
+	if (warned.insert(S.getName()).second)
+		errs() << "DDP WARN: -loop-local-signatures has no effect on "
+				<< S.getName() << " sets, which cannot be merged\n";
+}
+
+///
+/// A loop that inserts into a set on every iteration carries a load, OR and
+/// store of the set, which stops the loop vectorizer unless the set is
+/// promoted and nothing else in the loop touches it. So, when a countable
+/// innermost loop inserts into a mergeable set but never checks it, the
+/// loop's inserts go into a private copy instead: zeroed in the preheader
+/// and merged into the set on each exit. Once promoted, the copy is a plain
+/// OR reduction, which the vectorizer turns into one signature per lane
+/// that it ORs together after the loop. Signatures kept as word arrays are
+/// merged word by word, and leave the loop writing only a private array.
+///
+void SetInstrument::createLoopLocalCopies(LoopInfo &LI, ScalarEvolution &SE) {
+	// The sets each innermost loop inserts into, and those it checks. As in
+	// InsertValue, an instruction is inserted for its first query only.
+	// Inserts already summarized by a range leave the loop anyway.
+	std::map<Loop*, std::map<unsigned int, std::vector<Instruction*> > > inserts;
+	std::map<Loop*, IntSet> checks;
+	InstrSet seen;
+	struct Merge {
+		AbstractSetInstrumentHelper<SImple> *H;
+		Value *Copy;
+		Instruction *Pos;
+	};
+	std::vector<Merge> merges;
+	ddp::Queries::query_iterator i, end = AQ.end();
+	for (i = AQ.begin(); i != end; i++) {
+		if ((*i).staticHit)
+			continue;
+		if (seen.insert((*i).rhs).second && !RangeInserts.count((*i).rhs)) {
+			Loop *L = LI.getLoopFor((*i).rhs->getParent());
+			if (L && L->empty())
+				inserts[L][(*i).pset].push_back((*i).rhs);
+		}
+		if (Loop *L = LI.getLoopFor((*i).lhs->getParent()))
+			checks[L].insert((*i).pset);
+	}
+
+	for (auto &it : inserts) {
+		Loop *L = it.first;
+		BasicBlock *Preheader = L->getLoopPreheader();
+		SmallVector<BasicBlock*, 4> ExitBlocks;
+		L->getExitBlocks(ExitBlocks);
+		std::set<BasicBlock*> Exits(ExitBlocks.begin(), ExitBlocks.end());
+		if (!Preheader || !L->hasDedicatedExits() || Exits.empty()
+				|| !SE.hasLoopInvariantBackedgeTakenCount(L))
+			continue;
+		bool ehExit = false;
+		for (auto *Exit : Exits)
+			ehExit |= Exit->isEHPad();
+		if (ehExit)
+			continue;
+
+		for (auto &sets : it.second) {
+			AbstractSetInstrumentHelper<SImple> *H = ProfileSets[sets.first];
+			if (checks[L].count(sets.first))
+				continue;
+			if (!H->getSetImpl().isMergeable()) {
+				warnNotMergeable(H->getSetImpl());
+				continue;
+			}
+			Value *Copy = H->AllocateLocalCopy(Preheader->getTerminator());
+			for (auto *I : sets.second)
+				LocalCopies[I] = Copy;
+			for (auto *Exit : Exits)
+				merges.push_back({H, Copy, &*Exit->getFirstInsertionPt()});
+			NumLoopLocalCopies++;
+		}
+	}
+
+	// Merging a word array takes a loop of its own, so leave the CFG alone
+	// until LI is no longer needed.
+	for (auto &m : merges)
+		m.H->MergeLocalCopy(m.Copy, m.Pos);
+}
+
+// Note that set is used in L and each loop around it.
+static void addToLoops(std::map<Loop*, IntSet> &Sets, Loop *L,
+		unsigned int set) {
+	for (; L; L = L->getParentLoop())
+		Sets[L].insert(set);
+}
+
+// If I runs once per iteration of L and accesses Ptr = First, First +
+// Stride, ... (an affine recurrence with a constant step), fill in R with
+// those expanded in L's preheader.
+static bool summarizeAccess(Instruction *I, Value *Ptr, Loop *L,
+		DominatorTree &DT, ScalarEvolution &SE, SCEVExpander &Expander,
+		AccessRange &R, int granuleShift) {
+	BasicBlock *Preheader = L->getLoopPreheader();
+	BasicBlock *Latch = L->getLoopLatch();
+	if (!Preheader || !Latch || L->getExitingBlock() != Latch
+			|| !DT.dominates(I->getParent(), Latch))
+		return false;
+
+	const SCEV *BTC = SE.getBackedgeTakenCount(L);
+	const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Ptr));
+	if (isa<SCEVCouldNotCompute>(BTC) || !AR || AR->getLoop() != L
+			|| !AR->isAffine())
+		return false;
+	const SCEVConstant *Step = dyn_cast<SCEVConstant>(
+			AR->getStepRecurrence(SE));
+	if (!Step || Step->getValue()->isZero())
+		return false;
+
+	Type *Int64 = Type::getInt64Ty(I->getContext());
+	const SCEV *Count = SE.getAddExpr(SE.getTruncateOrZeroExtend(BTC, Int64),
+			SE.getOne(Int64));
+	const SCEV *First = AR->getStart();
+	int64_t stride = Step->getValue()->getSExtValue();
+	if (stride < 0) {
+		First = AR->evaluateAtIteration(BTC, SE);
+		stride = -stride;
+	}
+	// A stride between granule sizes visits granules irregularly, and a
+	// range of them would take in the ones it skips.
+	int64_t granule = granuleShift >= 0 ? (int64_t) 1 << granuleShift : 0;
+	if (granule && stride > granule && stride % granule)
+		return false;
+	if (!isSafeToExpand(First, SE) || !isSafeToExpand(Count, SE))
+		return false;
+
+	R.Pos = Preheader->getTerminator();
+	R.First = Expander.expandCodeFor(First, Ptr->getType(), R.Pos);
+	R.Count = Expander.expandCodeFor(Count, Int64, R.Pos);
+	R.Stride = ConstantInt::get(Int64, stride);
 	return true;
 }
 
+///
+/// An access made once per iteration of a countable loop at an affine
+/// address can be summarized by a single range insert or check in the
+/// loop's preheader: an insert, if the loop never checks the set, or a
+/// check, if the loop never inserts into it. Nothing in the loop can then
+/// tell the accesses apart from all of them at once, so the loop loses its
+/// per-iteration instrumentation and the instrumentation goes from O(n) to
+/// O(1) for the sets whose ranges cost that (see SImple::supportsRanges).
+///
+void SetInstrument::createRangeSummaries(DominatorTree &DT, LoopInfo &LI,
+		ScalarEvolution &SE) {
+	std::map<Loop*, IntSet> inserts, checks;
+	ddp::Queries::query_iterator i, end = AQ.end();
+	for (i = AQ.begin(); i != end; i++) {
+		if ((*i).staticHit)
+			continue;
+		addToLoops(inserts, LI.getLoopFor((*i).rhs->getParent()), (*i).pset);
+		addToLoops(checks, LI.getLoopFor((*i).lhs->getParent()), (*i).pset);
+	}
+
+	SCEVExpander Expander(SE, M.getDataLayout(), "ddp.range");
+	InstrSet seen;
+	for (i = AQ.begin(); i != end; i++) {
+		ddp::Query &Q = *i;
+		if (Q.staticHit)
+			continue;
+		// Summaries move inserts and checks ahead of the loop's inserts into
+		// other sets, which a set that can lose members would notice.
+		SImple &S = ProfileSets[Q.pset]->getSetImpl();
+		bool ranges = S.supportsRanges() && S.keepsMembers();
+		int shift = granuleShiftOf(Q.pset);
+		AccessRange R;
+
+		// As in InsertValue, an instruction is inserted for its first query.
+		if (seen.insert(Q.rhs).second && ranges && ddp::isSingleAccess(Q.rhs)) {
+			Loop *L = LI.getLoopFor(Q.rhs->getParent());
+			if (L && !checks[L].count(Q.pset) && summarizeAccess(Q.rhs,
+					getPointerOperand(Q.rhs), L, DT, SE, Expander, R, shift))
+				RangeInserts[Q.rhs] = R;
+		}
+
+		Loop *L = LI.getLoopFor(Q.lhs->getParent());
+		if (ranges && L && ddp::isSingleAccess(Q.lhs)
+				&& !inserts[L].count(Q.pset) && summarizeAccess(Q.lhs,
+				getPointerOperand(Q.lhs), L, DT, SE, Expander, R, shift))
+			RangeChecks[std::make_pair(Q.lhs, (unsigned long long) Q.pset)] = R;
+	}
+}
+
+// The 4 byte words that the Len bytes from Ptr on touch, computed before
+// Pos. Ranges are never empty, so a zero length counts as one word.
+static AccessRange wordRange(Value *Ptr, Value *Len, Instruction *Pos) {
+	IRBuilder<> B(Pos);
+	Value *A = B.CreatePtrToInt(Ptr, B.getInt64Ty());
+	Value *End = B.CreateAdd(A, B.CreateZExtOrTrunc(Len, B.getInt64Ty()));
+	Value *Count = B.CreateSub(B.CreateLShr(B.CreateAdd(End, B.getInt64(3)),
+			B.getInt64(2)), B.CreateLShr(A, B.getInt64(2)));
+	AccessRange R;
+	R.Pos = Pos;
+	R.First = B.CreateIntToPtr(B.CreateAnd(A, B.getInt64(~3ULL)),
+			Ptr->getType());
+	R.Count = B.CreateSelect(B.CreateICmpEQ(Count, B.getInt64(0)),
+			B.getInt64(1), Count);
+	R.Stride = B.getInt64(4);
+	return R;
+}
+
+///
+/// A memory intrinsic or masked vector access touches a run of bytes, not
+/// the one value at its pointer. It is inserted and checked as the range
+/// of words in that run, using the same range operations as a summarized
+/// loop. It may read what it writes, so its insert goes after it, where
+/// its own check cannot see it. Masks are not looked at: every lane of a
+/// masked access is taken as touched.
+///
+void SetInstrument::createAccessRanges() {
+	InstrSet seen;
+	std::map<Instruction*, AccessRange> reads;
+	ddp::Queries::query_iterator i, end = AQ.end();
+	for (i = AQ.begin(); i != end; i++) {
+		ddp::Query &Q = *i;
+		if (Q.staticHit)
+			continue;
+		// As in InsertValue, an instruction is inserted for its first query.
+		if (seen.insert(Q.rhs).second && !ddp::isSingleAccess(Q.rhs)) {
+			AccessRange R = wordRange(ddp::getWritePointer(Q.rhs),
+					ddp::getAccessLength(Q.rhs), Q.rhs);
+			R.Pos = Q.rhs->getNextNode();
+			RangeInserts[Q.rhs] = R;
+			NumRangeAccesses++;
+		}
+		if (!ddp::isSingleAccess(Q.lhs)) {
+			if (!reads.count(Q.lhs)) {
+				reads[Q.lhs] = wordRange(ddp::getReadPointer(Q.lhs),
+						ddp::getAccessLength(Q.lhs), Q.lhs);
+				NumRangeAccesses++;
+			}
+			RangeChecks[std::make_pair(Q.lhs, Q.pset)] = reads[Q.lhs];
+		}
+	}
+}
+
+// Loads and stores of one address are often spelled with separate but
+// identical GEPs, so number an address by its GEP structure.
+Value* SetInstrument::numberAddress(Value *Ptr) {
+	Ptr = Ptr->stripPointerCasts();
+	GEPOperator *GEP = dyn_cast<GEPOperator>(Ptr);
+	if (!GEP)
+		return Ptr;
+	std::vector<Value*> ops;
+	ops.push_back(numberAddress(GEP->getPointerOperand()));
+	ops.insert(ops.end(), GEP->idx_begin(), GEP->idx_end());
+	return AddressNumbers.insert(std::make_pair(std::make_pair(
+			GEP->getSourceElementType(), ops), Ptr)).first->second;
+}
+
+///
+/// Sets are only cleared on entry to their region, which is on no cycle,
+/// and inserting is idempotent. So an insert of an address that another
+/// insert into the same set dominates adds nothing, and a check of it is
+/// a certain hit. A check of an address an earlier load in the block
+/// already checked, with no insert into the set in between, has the same
+/// answer. The address is defined above the dominating access, so both
+/// see the same value of it.
+///
+void SetInstrument::createAddressNumbering(DominatorTree &DT) {
+	typedef std::pair<unsigned long long, Value*> Key;
+	std::map<Key, std::vector<Instruction*> > inserts, loads;
+	std::map<Instruction*, unsigned long long> insertSet;
+	std::set<RefPair, RefPairCompare> seenChecks;
+	ddp::Queries::query_iterator i, end = AQ.end();
+	for (i = AQ.begin(); i != end; i++) {
+		ddp::Query &Q = *i;
+		if (Q.staticHit)
+			continue;
+		// As in InsertValue, an instruction goes into its first query's set.
+		if (insertSet.insert(std::make_pair(Q.rhs, Q.pset)).second
+				&& !RangeInserts.count(Q.rhs) && !LocalCopies.count(Q.rhs))
+			inserts[Key(Q.pset, numberAddress(getPointerOperand(Q.rhs)))]
+					.push_back(Q.rhs);
+		RefPair p = std::make_pair(Q.lhs, Q.pset);
+		if (seenChecks.insert(p).second && !RangeChecks.count(p))
+			loads[Key(Q.pset, numberAddress(getPointerOperand(Q.lhs)))]
+					.push_back(Q.lhs);
+	}
+
+	for (auto &it : inserts)
+		for (auto *I : it.second)
+			for (auto *D : it.second)
+				if (D != I && DT.dominates(D, I)) {
+					CoveredInserts.insert(I);
+					break;
+				}
+
+	for (auto &it : loads) {
+		std::vector<Instruction*> &ins = inserts[it.first];
+		InstrSet group(it.second.begin(), it.second.end());
+		for (auto *I : it.second) {
+			RefPair p = std::make_pair(I, it.first.first);
+			bool hit = false;
+			for (auto *D : ins)
+				hit = hit || DT.dominates(D, I);
+			if (hit) {
+				KnownHits.insert(p);
+				continue;
+			}
+			for (BasicBlock::iterator J = I->getIterator();
+					J != I->getParent()->begin();) {
+				Instruction *D = &*--J;
+				std::map<Instruction*, unsigned long long>::iterator s =
+						insertSet.find(D);
+				if (s != insertSet.end() && s->second == it.first.first)
+					break;
+				if (group.count(D)) {
+					CheckSources[p] = D;
+					break;
+				}
+			}
+		}
+	}
+}
+
+///
+/// To a set with a granularity, different addresses in one granule are
+/// one location. Within a block, where nothing clears the set, an insert
+/// of a granule already inserted adds nothing, a check of it must hit,
+/// and a check of a granule already checked, with no insert into the set
+/// in between, has the same answer. Two addresses are only known to share
+/// a granule if they are constant offsets from one base whose alignment
+/// covers the granule.
+///
+void SetInstrument::coalesceGranules() {
+	const DataLayout &DL = M.getDataLayout();
+	std::map<Instruction*, unsigned long long> insertSet;
+	std::map<Instruction*, IntSet> checkSets;
+	ddp::Queries::query_iterator i, end = AQ.end();
+	for (i = AQ.begin(); i != end; i++) {
+		ddp::Query &Q = *i;
+		if (Q.staticHit)
+			continue;
+		// As in InsertValue, an instruction goes into its first query's set.
+		insertSet.insert(std::make_pair(Q.rhs, Q.pset));
+		if (!RangeChecks.count(std::make_pair(Q.lhs, Q.pset)))
+			checkSets[Q.lhs].insert(Q.pset);
+	}
+
+	typedef std::pair<unsigned long long, std::pair<Value*, int64_t> > Granule;
+	auto granuleOf = [&](Instruction *I, unsigned long long set,
+			Granule &G) -> bool {
+		int shift = granuleShiftOf(set);
+		if (shift < 0)
+			return false;
+		int64_t offset = 0;
+		Value *Base = GetPointerBaseWithConstantOffset(getPointerOperand(I),
+				offset, DL);
+		if (getKnownAlignment(Base, DL) < (1u << shift))
+			return false;
+		G = Granule(set, std::make_pair(Base, offset >> shift));
+		return true;
+	};
+
+	for (auto &BB : F) {
+		std::map<Granule, Instruction*> insertedAt, checkedAt;
+		for (auto &I : BB) {
+			Granule G;
+			// An atomic is checked before its own insert.
+			std::map<Instruction*, IntSet>::iterator c = checkSets.find(&I);
+			if (c != checkSets.end())
+				for (unsigned int set : c->second) {
+					if (!granuleOf(&I, set, G))
+						continue;
+					RefPair p = std::make_pair(&I, (unsigned long long) set);
+					if (insertedAt.count(G)) {
+						KnownHits.insert(p);
+						NumCoalescedGranules++;
+					} else if (checkedAt.count(G)) {
+						if (CheckSources.insert(std::make_pair(p, checkedAt[G])).second)
+							NumCoalescedGranules++;
+					} else
+						checkedAt[G] = &I;
+				}
+
+			std::map<Instruction*, unsigned long long>::iterator s =
+					insertSet.find(&I);
+			if (s == insertSet.end())
+				continue;
+			if (!RangeInserts.count(&I) && !LocalCopies.count(&I)
+					&& granuleOf(&I, s->second, G)) {
+				if (insertedAt.count(G)) {
+					CoveredInserts.insert(&I);
+					NumCoalescedGranules++;
+				} else
+					insertedAt[G] = &I;
+			}
+			// Later checks of the set may now see something new.
+			for (auto c = checkedAt.begin(); c != checkedAt.end();)
+				if (c->first.first == s->second)
+					c = checkedAt.erase(c);
+				else
+					c++;
+		}
+	}
+}
+
+///
+/// Check I against set, and at the same time against the other sets I is
+/// checked against that hash alike and would otherwise each be checked on
+/// their own at I. Their results go in checked for their own queries.
+///
+Instruction* SetInstrument::checkShared(Instruction *I, unsigned int set) {
+	std::vector<AbstractSetInstrumentHelper<SImple>*> Sets;
+	std::vector<unsigned int> ids;
+	Sets.push_back(ProfileSets[set]);
+	ids.push_back(set);
+	InstMap &IM = checked[I];
+	for (unsigned int other : LoadSets[I]) {
+		RefPair p = std::make_pair(I, (unsigned long long) other);
+		if (other == set || IM.count(other) || KnownHits.count(p)
+				|| RangeChecks.count(p) || CheckSources.count(p))
+			continue;
+		if (!ProfileSets[other]->getSetImpl().sharesHashesWith(
+				&ProfileSets[set]->getSetImpl())
+				|| granuleShiftOf(other) != granuleShiftOf(set))
+			continue;
+		Sets.push_back(ProfileSets[other]);
+		ids.push_back(other);
+	}
+	if (Sets.size() == 1)
+		return ProfileSets[set]->MembershipCheckWith(getPointerOperand(I), I);
+
+	std::vector<Instruction*> res = ProfileSets[set]->MembershipCheckMulti(Sets,
+			getPointerOperand(I), I);
+	for (unsigned k = 1; k < ids.size(); k++)
+		IM[ids[k]] = res[k];
+	NumMembershipTests += ids.size() - 1;
+	NumSharedHashChecks += ids.size();
+	return res[0];
+}
+
 // From SignatureInstrument
 
 void SetInstrument::instrExits(RetInstVecTy &Rets) {
@@ -730,12 +1560,28 @@ void SetInstrument::InsertValue(Instruction *I, ddp::Query &Q) {
 	// Haven't inserted this InstID yet
 
 	inserted.insert(I);
+	if (CoveredInserts.count(I)) {
+		NumCoveredInserts++;
+		return;
+	}
 
 	// Now, find the set that this belongs to.
 	//assert(SA.SetAssignments.find(InstID) != SA.SetAssignments.end());
 	unsigned int set = Q.pset;
-	// Now, insert the value into the set.
-	ProfileSets[set]->Insert_Value(getPointerOperand(I), I);
+	// An atomic reads its address too, and its check must not see it.
+	Instruction *at = isa<StoreInst>(I) ? I : I->getNextNode();
+	// Now, insert the value into the set, or the loop's copy of it.
+	std::map<Instruction*, Value*>::iterator copy = LocalCopies.find(I);
+	std::map<Instruction*, AccessRange>::iterator range = RangeInserts.find(I);
+	if (range != RangeInserts.end()) {
+		AccessRange &R = range->second;
+		ProfileSets[set]->Insert_Range(R.First, R.Count, R.Stride, R.Pos);
+		NumRangeInserts++;
+	} else if (copy != LocalCopies.end())
+		ProfileSets[set]->Insert_Value_Into(copy->second, getPointerOperand(I),
+				at);
+	else
+		ProfileSets[set]->Insert_Value(getPointerOperand(I), at);
 	NumInsertions++;
 	errs() << "VALUE INSERTED\n";
 }
@@ -744,46 +1590,88 @@ void SetInstrument::InsertValue(Instruction *I, ddp::Query &Q) {
 // OUTPUT OF THE CHECKINST
 Instruction* SetInstrument::MembershipCheck(Instruction *I, ddp::Query &Q,
 		AllocaInst* QueryVar) {
-	std::stringstream VarBuf;
-	VarBuf << "OldVal_" << Q.id;
-	Value *OldVal = new LoadInst(QueryVar, VarBuf.str(), I);
-	Value *NewVal = OldVal;
-
 	// Check InstID versus each of the sets assigned to BV
 
 	unsigned int set = Q.pset;
 
+	// A store of the same address was inserted on every path here.
+	if (KnownHits.count(std::make_pair(I, (unsigned long long) set))) {
+		new StoreInst(ConstantInt::get(Type::getInt32Ty(Context), 1), QueryVar,
+				I);
+		NumKnownHits++;
+		return NULL;
+	}
+
+	// A check summarized by a range is made, and recorded, before the loop.
+	std::map<RefPair, AccessRange, RefPairCompare>::iterator range =
+			RangeChecks.find(std::make_pair(I, (unsigned long long) set));
+	bool summarized = range != RangeChecks.end();
+	Instruction *at = summarized ? range->second.Pos : I;
+	// A load reading the same memory version as an earlier one reuses its
+	// check, made at the earlier load, unless either is summarized. The
+	// earlier load must be checked against this set itself: only then is
+	// it one of the set's uses, which its (lazy) region and allocation
+	// cover.
+	Instruction *leader = Q.sharedCheck;
+	if (leader && (summarized || !LoadSets[leader].count(set)
+			|| RangeChecks.count(std::make_pair(leader, (unsigned long long) set))))
+		leader = NULL;
+	Instruction *src = I;
+	if (leader)
+		src = leader;
+	else {
+		std::map<RefPair, Instruction*, RefPairCompare>::iterator it;
+		while ((it = CheckSources.find(std::make_pair(src,
+				(unsigned long long) set))) != CheckSources.end())
+			src = it->second;
+	}
+	if (src != I)
+		NumReusedChecks++;
+	auto check = [&]() -> Instruction* {
+		NumMembershipTests++;
+		if (!summarized && MultiChecks && src == I && !leader)
+			return checkShared(I, set);
+		if (!summarized)
+			return ProfileSets[set]->MembershipCheckWith(getPointerOperand(src),
+					src);
+		AccessRange &R = range->second;
+		NumRangeChecks++;
+		return ProfileSets[set]->MembershipCheckRange(R.First, R.Count, R.Stride,
+				R.Pos);
+	};
+
+	std::stringstream VarBuf;
+	VarBuf << "OldVal_" << Q.id;
+	Value *OldVal = new LoadInst(QueryVar, VarBuf.str(), at);
+	Value *NewVal = OldVal;
+
 	Instruction* CheckInst;
 
 	// Now, check if this membership check has already been scheduled.
-	if (checked.find(I) == checked.end()) {
+	if (checked.find(src) == checked.end()) {
 		// No entry for this InstID, so perform the check.
-		CheckInst = ProfileSets[set]->MembershipCheckWith(getPointerOperand(I),
-				I);
-		NumMembershipTests++;
+		CheckInst = check();
 		// add this to the checked structure
-		checked[I][set] = CheckInst;
+		checked[src][set] = CheckInst;
 	} else {
 		// entry for InstID exists, check if InstID has a check with set already scheduled
-		InstMap& IM = checked[I];
+		InstMap& IM = checked[src];
 		if (IM.find(set) == IM.end()) {
 			// Haven't checked this set yet.
-			CheckInst = ProfileSets[set]->MembershipCheckWith(
-					getPointerOperand(I), I);
-			NumMembershipTests++;
-			checked[I][set] = CheckInst;
+			CheckInst = check();
+			checked[src][set] = CheckInst;
 		} else {
 			// This check has already been scheduled. Get the CheckInst and return it.
-			CheckInst = checked[I][set];
+			CheckInst = checked[src][set];
 		}
 	}
 
 	std::stringstream OrBuf;
 	OrBuf << "Or_" << Q.id;
 	NewVal = BinaryOperator::Create(Instruction::Or, NewVal, CheckInst,
-			OrBuf.str(), I);
+			OrBuf.str(), at);
 
-	new StoreInst(NewVal, QueryVar, I);
+	new StoreInst(NewVal, QueryVar, at);
 
 	//I->getParent()->dump();
 
@@ -61,17 +61,16 @@ ProfilerDatabase* ProfilerDatabase::CreateOrFind(std::string profname) {
 
   constraint.add(TableColumn(Manager.getOrigin().c_str(),"name"));
 
-  std::vector<TableRow> result = SQLite3Select(fileDB,files,select,constraint);
-
-  UniqueRefID * refID;
-  if (result.size()>0) {
+  bool found = false;
+  int64_t id = 0;
+  SQLite3Cursor cursor = SQLite3Query(fileDB,files,select,constraint);
+  while (cursor.next()) {
     // Pick the last one
-    TableRow &row = result[ result.size() - 1 ];
-    // Get refID out of it
-    TableColumn &c = row.get(0);
-    //assert(row.size()==3);
-    //assert(c.getKind()==SQL_INT64);
-    int64_t id = c.getInt64();
+    found = true;
+    id = cursor.getInt64(0);
+  }
+
+  if (found) {
     return new ProfilerDatabase(profname,fullname,fileDB,id,0);
   } else {
      // First check if the app exists - If yes, get the max fileid for the app,
@@ -85,7 +84,6 @@ ProfilerDatabase* ProfilerDatabase::CreateOrFind(std::string profname) {
      resultRows.add(TableColumn("max(fileid)",SQL_INT64));
      TableRow appSelector;
      appSelector.add(TableColumn(Manager.AppName.c_str(),"app"));
-     int64_t id;
      if(!SQLite3BeginImmediate(fileDB)) {
        std::cerr<<"Unable to make new entry in files table - BEGIN IMMEDIATE\n";
        exit(-1);
@@ -149,23 +147,13 @@ unsigned long long ProfilerDatabase::feedbackValue(std::string profname,
   TableRow constraint;
   constraint.add(TableColumn((int64_t)(getFileID()),"fileid"));
   constraint.add(TableColumn(DBFileManager::getSingleton().getOrigin().c_str(),"filename"));
-  std::vector<TableRow> result = SQLite3Select(db,fb,select,constraint);
-  sqlite3_close(db);
-
-  for(size_t r=0; r < result.size(); r++) {
-      // Pick the last one
-      TableRow &row = result[ r ];
-      // Get refID out of it
-      TableColumn &rid = row.get(0);
-      TableColumn &count = row.get(1);
-      //assert(row.size()==3);
-      //assert(c.getKind()==SQL_INT64);
-
-      int64_t refidval = rid.getInt64();
-      int64_t countval = count.getInt64();
-      feedbackMap[refidval] = countval;
-      //return (unsigned long long)countval;
+  {
+    SQLite3Cursor cursor = SQLite3Query(db,fb,select,constraint);
+    while (cursor.next())
+      feedbackMap[cursor.getInt64(0)] = cursor.getInt64(1);
   }
+  SQLite3Close(db);
+
   if (feedbackMap.find(refID)!=feedbackMap.end())
     return feedbackMap[refID];
 
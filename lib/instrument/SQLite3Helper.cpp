@@ -3,6 +3,7 @@
 #include <string>
 #include <iostream>
 #include <string.h>
+#include <map>
 
 using namespace llvm;
 
@@ -27,6 +28,169 @@ bool llvm::SQLite3Open(sqlite3 **db, std::string filename, bool create) {
   return true;
 }
 
+/// Statement cache ==========================================================
+///
+/// Prepared statements are kept per connection, keyed by a string that names
+/// the table and the set of columns involved. Values are always bound, never
+/// spliced into the SQL text, so one compiled statement serves every call.
+
+typedef std::pair<sqlite3*, std::string> StatementKey;
+typedef std::map<StatementKey, SQLite3Statement*> StatementCache;
+
+static StatementCache &getStatementCache() {
+  static StatementCache cache;
+  return cache;
+}
+
+static sqlite3_stmt *prepareStatement(sqlite3 *db, const std::string &command) {
+  sqlite3_stmt *stmt = NULL;
+  int result;
+  do {
+     result = sqlite3_prepare_v2(db, command.c_str(), command.size()+1,
+                                 &stmt, NULL);
+  } while ( SQLITE_LOCKED == result || SQLITE_BUSY == result);
+
+  if (result) {
+    std::cerr << "sqlite3_prepare_v2 - Can't prepare \"" << command << "\": "
+              << sqlite3_errmsg(db) << "\n";
+    return NULL;
+  }
+  return stmt;
+}
+
+SQLite3Statement *llvm::SQLite3Prepare(sqlite3 *db, const std::string &key,
+                                       const std::string &command) {
+  StatementCache &cache = getStatementCache();
+  StatementKey k(db, key);
+  StatementCache::iterator it = cache.find(k);
+  if (it != cache.end() && !it->second->isBusy()) {
+    it->second->setBusy(true);
+    return it->second;
+  }
+
+  sqlite3_stmt *stmt = prepareStatement(db, command);
+  if (stmt == NULL)
+    return NULL;
+
+  // The cached copy is still in use (e.g. a cursor is open on it), so hand
+  // out a private statement that is finalized on release.
+  bool cached = (it == cache.end());
+  SQLite3Statement *S = new SQLite3Statement(db, stmt, cached);
+  S->setBusy(true);
+  if (cached)
+    cache[k] = S;
+  return S;
+}
+
+void llvm::SQLite3FinalizeStatements(sqlite3 *db) {
+  StatementCache &cache = getStatementCache();
+  StatementCache::iterator it = cache.begin();
+  while (it != cache.end()) {
+    if (it->first.first == db) {
+      sqlite3_finalize(it->second->get());
+      delete it->second;
+      cache.erase(it++);
+    } else
+      ++it;
+  }
+}
+
+bool llvm::SQLite3Close(sqlite3 *db) {
+  if (db == NULL)
+    return true;
+  SQLite3FinalizeStatements(db);
+  if (sqlite3_close(db) != SQLITE_OK) {
+    std::cerr << "Can't close database: " << sqlite3_errmsg(db) << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool SQLite3Statement::bind(int idx, TableColumn &c) {
+  switch (c.getKind()) {
+    case SQL_INT: return bindInt(idx, c.getInt());
+    case SQL_INT64: return bindInt64(idx, c.getInt64());
+    case SQL_DOUBLE: return bindDouble(idx, c.getDouble());
+    case SQL_TEXT: return bindText(idx, c.getText());
+  }
+  return false;
+}
+
+bool SQLite3Statement::bind(TableRow &values, int first) {
+  TableRow::iterator it;
+  int i = first;
+  for(it=values.begin(); it!=values.end(); it++, i++) {
+    if (!bind(i, *it)) {
+      std::cerr << "Can't bind " << (*it).getName() << ": "
+                << sqlite3_errmsg(db) << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+int SQLite3Statement::step() {
+  int result;
+  do {
+     result = sqlite3_step(stmt);
+  } while ( SQLITE_LOCKED == result || SQLITE_BUSY == result);
+  return result;
+}
+
+void SQLite3Statement::release() {
+  if (!cached) {
+    sqlite3_finalize(stmt);
+    delete this;
+    return;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  busy = false;
+}
+
+bool SQLite3Cursor::next() {
+  if (done)
+    return false;
+
+  int s = stmt->step();
+  if (s != SQLITE_ROW) {
+    if (s != SQLITE_DONE)
+      std::cerr << "Can't perform selection: "
+                << sqlite3_errmsg(stmt->getDB()) << "\n";
+    close();
+    return false;
+  }
+
+  TableRow row;
+  TableRow::iterator it;
+  int i=0;
+  for(it=layout.begin(); it!=layout.end(); it++, i++) {
+    switch ( (*it).getKind() ) {
+    case SQL_INT:
+      row.add(TableColumn(getInt(i)));
+      break;
+    case SQL_INT64:
+      row.add(TableColumn(getInt64(i)));
+      break;
+    case SQL_DOUBLE:
+      row.add(TableColumn(getDouble(i)));
+      break;
+    case SQL_TEXT:
+      row.add(TableColumn(getText(i)));
+      break;
+    }
+  }
+  current = row;
+  return true;
+}
+
+void SQLite3Cursor::close() {
+  if (stmt)
+    stmt->release();
+  stmt = NULL;
+  done = true;
+}
+
 bool llvm::SQLite3EndTransaction(sqlite3 *db) {
   std::string command;
   command =  "END TRANSACTION";
@@ -114,83 +278,49 @@ bool llvm::SQLite3Insert(sqlite3 *db, ProfilerTable &table, TableRow &values) {
   command =  "insert or replace into  " + table.getName() + " ";
   command += table.getInsertCommand();
   command += " values " + table.getBindList();
-  sqlite3_stmt * stmt;
-  int result = sqlite3_prepare_v2(db, command.c_str(), command.size()+1, &stmt, NULL);
-  if (result) {
-    std::cerr << "Can't insert into table: " << sqlite3_errmsg(db);
+
+  SQLite3Statement *stmt = SQLite3Prepare(db, "insert:" + table.getName() +
+                                          table.getInsertCommand(), command);
+  if (stmt == NULL) {
+    std::cerr << "Can't insert into table: " << sqlite3_errmsg(db) << "\n";
     return false;
   }
 
-  TableRow::iterator it;
-  int i = 1;
-  for(it=values.begin(); it!=values.end(); it++) {
-    switch ( (*it).getKind() ) {
-      case SQL_INT: sqlite3_bind_int(stmt, i, (*it).getInt());
-                    break;
-      case SQL_INT64: sqlite3_bind_int64(stmt, i, (sqlite3_int64)(*it).getInt64());
-                      break;
-      case SQL_DOUBLE: sqlite3_bind_double(stmt, i, (*it).getDouble());
-                        break;
-      case SQL_TEXT: sqlite3_bind_text(stmt, i, (*it).getText(), -1,
-                                     SQLITE_TRANSIENT); break;
-    }
-    i++;
+  bool ok = stmt->bind(values);
+  if (ok && stmt->step() != SQLITE_DONE) {
+    std::cerr << "Can't insert into table: " << sqlite3_errmsg(db) << "\n";
+    ok = false;
   }
-
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  return true;
+  stmt->release();
+  return ok;
 }
 
-std::vector<TableRow> llvm::SQLite3Select(sqlite3 *db, ProfilerTable &table,
-                                          TableRow &select, TableRow &constraints) {
-  std::vector<TableRow> v;
+SQLite3Cursor llvm::SQLite3Query(sqlite3 *db, ProfilerTable &table,
+                                 TableRow &select, TableRow &constraints) {
   std::string command;
   command =  "select " + select.toString(false) + " from ";
   command += table.getName();
-  std::string constraint = constraints.toConstraint();
   if (constraints.size()>0)
-    command += " where " + constraints.toConstraint();
+    command += " where " + constraints.toBindConstraint();
 
-  //std::cerr << "Command: " << command;
-
-  sqlite3_stmt * stmt;
-  int result = sqlite3_prepare_v2(db, command.c_str(), command.size()+1, &stmt, NULL);
-  if (result) {
-    std::cerr << "Can't perform selection: " << sqlite3_errmsg(db);
-    return v;
+  SQLite3Statement *stmt = SQLite3Prepare(db, "select:" + command, command);
+  if (stmt == NULL) {
+    std::cerr << "Can't perform selection: " << sqlite3_errmsg(db) << "\n";
+    return SQLite3Cursor(NULL, select);
   }
 
-  int s;
-  do {
-    s = sqlite3_step(stmt);
-    TableRow row;
-    TableRow &trow = select;
-    if (SQLITE_ROW == s) {
-      TableRow::iterator it;
-      int i=0;
-      for(it=trow.begin(); it!=trow.end(); it++) {
-        switch ( (*it).getKind() ) {
-        case SQL_INT:
-          row.add(TableColumn(sqlite3_column_int(stmt, i)));
-          break;
-        case SQL_INT64:
-          row.add(TableColumn((int64_t)sqlite3_column_int64(stmt, i)));
-          break;
-        case SQL_DOUBLE:
-          row.add(TableColumn((double)sqlite3_column_double(stmt, i)));
-          break;
-        case SQL_TEXT:
-          row.add(TableColumn((const char*)strdup(
-                          (const char*)sqlite3_column_text(stmt, i))));
-          break;
-        }
-        i++;
-      }
-      v.push_back(row);
-    }
-  } while (s == SQLITE_ROW) ;
+  if (!stmt->bind(constraints)) {
+    stmt->release();
+    return SQLite3Cursor(NULL, select);
+  }
+  return SQLite3Cursor(stmt, select);
+}
 
-  sqlite3_finalize(stmt);
+std::vector<TableRow> llvm::SQLite3Select(sqlite3 *db, ProfilerTable &table,
+                                          TableRow &select, TableRow &constraints) {
+  std::vector<TableRow> v;
+  SQLite3Cursor cursor = SQLite3Query(db, table, select, constraints);
+  while (cursor.next())
+    v.push_back(cursor.row());
   return v;
 }
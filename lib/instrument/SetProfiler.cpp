@@ -25,6 +25,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/TypeBuilder.h"
@@ -59,6 +60,7 @@ using namespace std;
 using namespace llvm;
 
 extern cl::opt<bool> PerfInstr;
+extern cl::opt<bool> CuckooInstr;
 
 char SetProfiler::ID = 0;
 static RegisterPass<SetProfiler> SP("SetProfiler",
@@ -85,6 +87,18 @@ OnlyProfHotFns("only-prof-hot-fns", cl::Hidden,
 			 				 cl::desc("Only profile the hot functions - those that get \
 							 executed"), cl::init(false));
 
+static cl::opt<bool>
+PruneQueries("prune-queries", cl::Hidden,
+						 cl::desc("Use DependenceAnalysis to drop independent queries and \
+						 resolve proven dependences without instrumentation"),
+						 cl::init(false));
+
+static cl::opt<bool>
+PruneKilled("prune-killed-queries", cl::Hidden,
+						 cl::desc("Use MemorySSA to drop queries whose store is always \
+						 overwritten before the load, and share checks between loads"),
+						 cl::init(false));
+
 static cl::opt<int>
 SampleRate("sample", cl::Hidden,
 			 		 cl::desc("Perform Sample-based profiling for function every N times \
@@ -276,6 +290,12 @@ bool SetProfiler::runOnFunction(Function *F) {
   //errs() << "ALIAS ANALYSIS COMPLETE: " << aliasAnalysis << "\n";
   AliasQueries.run(*F, getAnalysis<AAResultsWrapperPass>(*F),*dbHelper);
   errs() << "ALIAS QUERIES\n";
+  if (PruneQueries)
+    AliasQueries.pruneWithDependences(*F,
+                        getAnalysis<AAResultsWrapperPass>(*F).getAAResults());
+  if (PruneKilled)
+    AliasQueries.pruneWithMemorySSA(*F,
+                        getAnalysis<AAResultsWrapperPass>(*F).getAAResults());
   /*
   ddp::Queries::query_iterator qi,qend=AliasQueries.end();
   for(qi=AliasQueries.begin(); qi!=qend; qi++)
@@ -366,6 +386,38 @@ bool SetProfiler::doFinalization(Module &M) {
 }
 
 
+// Cuckoo sets can forget memory once it is freed. Call the runtime's
+// CuckooSet_Free_Hook ahead of every call or invoke of free and delete in
+// the module. realloc is left alone: the block may stay where it is.
+static bool InsertFreeHooks(Module &M) {
+  static const char *FreeFns[] = { "free", "_ZdlPv", "_ZdaPv", "_ZdlPvm",
+                                   "_ZdaPvm" };
+  LLVMContext &Context = M.getContext();
+  Type *PtrTy = Type::getInt8PtrTy(Context);
+  Constant *HookFn = M.getOrInsertFunction("CuckooSet_Free_Hook",
+                                           Type::getVoidTy(Context), PtrTy,
+                                           (Type*)0);
+  bool changed = false;
+  for (const char *Name : FreeFns) {
+    Function *FreeFn = M.getFunction(Name);
+    if (!FreeFn)
+      continue;
+    for (Use &U : FreeFn->uses()) {
+      CallSite CS(U.getUser());
+      if (!CS || !CS.isCallee(&U) || CS.arg_size() < 1)
+        continue;
+      Instruction *I = CS.getInstruction();
+      if (I->getFunction()->hasFnAttribute(DDPRuntimeFnAttr))
+        continue;
+      IRBuilder<> Builder(I);
+      Builder.CreateCall(HookFn,
+                         Builder.CreatePointerCast(CS.getArgument(0), PtrTy));
+      changed = true;
+    }
+  }
+  return changed;
+}
+
 bool SetProfiler::runOnModule(Module &M)
 {
   bool ret = false;
@@ -394,6 +446,9 @@ bool SetProfiler::runOnModule(Module &M)
   for(Module::iterator it=M.begin(); it!=M.end(); it++)
       list.push_back(&*it);
 
+  if (CuckooInstr)
+    ret = InsertFreeHooks(M);
+
   for(size_t i=0,size=list.size(); i<size; i++) {
       Function *F = list[i];
 
@@ -403,6 +458,10 @@ bool SetProfiler::runOnModule(Module &M)
       if (SampleRate > 1 && fList.find(F)!=fList.end())
       	continue;
 
+      // Runtime code linked in by -ddp-runtime-bc
+      if (F->hasFnAttribute(DDPRuntimeFnAttr))
+      	continue;
+
       if (F->begin()!=F->end()) {
     	  AliasAnalysis *aliasAnalysis =
 											&(getAnalysis<AAResultsWrapperPass>(*F).getAAResults());
@@ -0,0 +1,299 @@
+//===- CuckooSet.cpp - Cuckoo filter sets with delete-on-free -------------===//
+//
+// Approximate address sets used by CuckooSet instrumentation (-cuckooinstr).
+//
+// Each set is a cuckoo filter of 4-slot buckets holding 16-bit fingerprints
+// of the address' granule: 4 bytes, or as -granularity gives, which the
+// filter keeps so that deletes find the keys inserts used. Unlike the Bloom style signatures, an
+// entry can be removed again: CuckooSet_Free_Hook, which the instrumentation
+// calls ahead of every free/delete, drops the freed block from every live
+// set of the calling thread, so reused heap memory no longer reports
+// conflicts with accesses to its previous occupant.
+//
+// A filter never loses an address it holds, except that deleting a freed
+// granule also removes a different live address with the same fingerprint
+// and buckets (about as likely as a false positive). A filter that fills up
+// answers every check with 1.
+//
+//===----------------------------------------------------------------------===//
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+const unsigned SlotsPerBucket = 4;
+const unsigned MaxKicks = 500;
+
+// Frees larger than this are not deleted from the sets; their entries stay,
+// as they would in a signature.
+const uint64_t MaxDeleteBytes = 1 << 20;
+
+struct CuckooFilter {
+  CuckooFilter *prev, *next;  // live filters of this thread
+  uint32_t bucketMask;
+  uint32_t count;
+  uint16_t victim;            // fingerprint that did not fit, or 0
+  uint32_t victimBucket;
+  bool full;
+  uint32_t shift;             // log2 of the granule size
+  uint16_t slots[1];          // (bucketMask + 1) * SlotsPerBucket
+};
+
+thread_local CuckooFilter *LiveFilters = NULL;
+
+inline uint64_t mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+inline void hashGranule(const CuckooFilter *F, uint64_t granule,
+                        uint16_t &fp, uint32_t &bucket) {
+  uint64_t h = mix(granule);
+  fp = (uint16_t)(h >> 48);
+  if (fp == 0)
+    fp = 1;  // 0 marks an empty slot
+  bucket = (uint32_t)h & F->bucketMask;
+}
+
+// The other bucket of a fingerprint; applying it twice gives the first.
+inline uint32_t altBucket(const CuckooFilter *F, uint32_t bucket,
+                          uint16_t fp) {
+  return (bucket ^ (uint32_t)(fp * 0x5BD1E995u)) & F->bucketMask;
+}
+
+inline uint16_t *bucketSlots(CuckooFilter *F, uint32_t bucket) {
+  return &F->slots[bucket * SlotsPerBucket];
+}
+
+bool bucketHas(CuckooFilter *F, uint32_t bucket, uint16_t fp) {
+  uint16_t *s = bucketSlots(F, bucket);
+  for (unsigned i = 0; i < SlotsPerBucket; i++)
+    if (s[i] == fp)
+      return true;
+  return false;
+}
+
+bool bucketAdd(CuckooFilter *F, uint32_t bucket, uint16_t fp) {
+  uint16_t *s = bucketSlots(F, bucket);
+  for (unsigned i = 0; i < SlotsPerBucket; i++)
+    if (s[i] == 0) {
+      s[i] = fp;
+      return true;
+    }
+  return false;
+}
+
+bool bucketRemove(CuckooFilter *F, uint32_t bucket, uint16_t fp) {
+  uint16_t *s = bucketSlots(F, bucket);
+  for (unsigned i = 0; i < SlotsPerBucket; i++)
+    if (s[i] == fp) {
+      s[i] = 0;
+      return true;
+    }
+  return false;
+}
+
+bool contains(CuckooFilter *F, uint16_t fp, uint32_t b1) {
+  uint32_t b2 = altBucket(F, b1, fp);
+  if (bucketHas(F, b1, fp) || bucketHas(F, b2, fp))
+    return true;
+  return F->victim == fp && (F->victimBucket == b1 || F->victimBucket == b2);
+}
+
+void insert(CuckooFilter *F, uint64_t granule) {
+  if (F->full)
+    return;
+  uint16_t fp;
+  uint32_t b1;
+  hashGranule(F, granule, fp, b1);
+  // Sets hold each address once; a duplicate fingerprint would only make a
+  // later delete leave a copy behind.
+  if (contains(F, fp, b1))
+    return;
+
+  F->count++;
+  uint32_t b2 = altBucket(F, b1, fp);
+  if (bucketAdd(F, b1, fp) || bucketAdd(F, b2, fp))
+    return;
+
+  // Evict a resident fingerprint to its other bucket, and so on.
+  uint32_t b = (granule & 1) ? b1 : b2;
+  for (unsigned kick = 0; kick < MaxKicks; kick++) {
+    uint16_t *s = bucketSlots(F, b);
+    unsigned i = (kick + fp) % SlotsPerBucket;
+    uint16_t evicted = s[i];
+    s[i] = fp;
+    fp = evicted;
+    b = altBucket(F, b, fp);
+    if (bucketAdd(F, b, fp))
+      return;
+  }
+
+  if (F->victim == 0) {
+    F->victim = fp;
+    F->victimBucket = b;
+  } else {
+    F->full = true;
+  }
+}
+
+void remove(CuckooFilter *F, uint64_t granule) {
+  uint16_t fp;
+  uint32_t b1;
+  hashGranule(F, granule, fp, b1);
+  uint32_t b2 = altBucket(F, b1, fp);
+  if (bucketRemove(F, b1, fp) || bucketRemove(F, b2, fp)) {
+    F->count--;
+    // Give the evicted fingerprint its slot back.
+    if (F->victim &&
+        (bucketAdd(F, F->victimBucket, F->victim) ||
+         bucketAdd(F, altBucket(F, F->victimBucket, F->victim), F->victim)))
+      F->victim = 0;
+  } else if (F->victim == fp &&
+             (F->victimBucket == b1 || F->victimBucket == b2)) {
+    F->victim = 0;
+    F->count--;
+  }
+}
+
+void deleteRange(CuckooFilter *F, uint64_t addr, uint64_t size) {
+  if (F->full || size == 0 || size > MaxDeleteBytes)
+    return;
+  uint64_t last = (addr + size - 1) >> F->shift;
+  for (uint64_t g = addr >> F->shift; g <= last && F->count; g++) {
+    uint16_t fp;
+    uint32_t b1;
+    hashGranule(F, g, fp, b1);
+    if (contains(F, fp, b1))
+      remove(F, g);
+  }
+}
+
+// The 1 << shift byte granules of the count addresses first, first +
+// stride, ... in order. Strides up to a granule touch every granule of the
+// span.
+template <typename Fn>
+bool forRangeGranules(uint32_t shift, uint64_t first, uint64_t count,
+                      uint64_t stride, uint64_t limit, Fn fn) {
+  uint64_t last = first + (count - 1) * stride;
+  bool dense = stride <= ((uint64_t)1 << shift);
+  uint64_t n = dense ? (last >> shift) - (first >> shift) + 1 : count;
+  if (n > limit)
+    return false;
+  for (uint64_t i = 0; i < n; i++)
+    if (fn(dense ? (first >> shift) + i : (first + i * stride) >> shift))
+      break;
+  return true;
+}
+
+inline uint64_t capacity(const CuckooFilter *F) {
+  return ((uint64_t)F->bucketMask + 1) * SlotsPerBucket;
+}
+
+} // end anonymous namespace
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// A new, empty filter of 1 << log2Buckets buckets, of addresses in
+/// 1 << shift byte granules.
+void *CuckooSet_New(unsigned int log2Buckets, unsigned int shift) {
+  size_t numSlots = ((size_t)1 << log2Buckets) * SlotsPerBucket;
+  CuckooFilter *F = (CuckooFilter *)calloc(1, sizeof(CuckooFilter) +
+                                           (numSlots - 1) * sizeof(uint16_t));
+  if (!F)
+    abort();
+  F->bucketMask = (1u << log2Buckets) - 1;
+  F->shift = shift;
+
+  F->next = LiveFilters;
+  if (LiveFilters)
+    LiveFilters->prev = F;
+  LiveFilters = F;
+  return F;
+}
+
+void CuckooSet_Insert_Value(void *Set, void *addr) {
+  CuckooFilter *F = (CuckooFilter *)Set;
+  insert(F, (uint64_t)addr >> F->shift);
+}
+
+unsigned int CuckooSet_MembershipCheck(void *addr, void *Set) {
+  CuckooFilter *F = (CuckooFilter *)Set;
+  if (F->full)
+    return 1;
+  uint16_t fp;
+  uint32_t b1;
+  hashGranule(F, (uint64_t)addr >> F->shift, fp, b1);
+  return contains(F, fp, b1);
+}
+
+/// A range summarized by the instrumentation: the count addresses first,
+/// first + stride, ... A range of more granules than the filter has slots
+/// would overflow it anyway, so it marks the filter full at once; either
+/// way it takes at most one step per slot.
+void CuckooSet_Insert_Range(void *Set, void *first, uint64_t count,
+                            uint64_t stride) {
+  CuckooFilter *F = (CuckooFilter *)Set;
+  if (F->full)
+    return;
+  if (!forRangeGranules(F->shift, (uint64_t)first, count, stride,
+                        capacity(F),
+                        [F](uint64_t g) { insert(F, g); return F->full; }))
+    F->full = true;
+}
+
+/// As above: a range with more granules than slots only misses an empty
+/// filter.
+unsigned int CuckooSet_Check_Range(void *first, uint64_t count,
+                                   uint64_t stride, void *Set) {
+  CuckooFilter *F = (CuckooFilter *)Set;
+  if (F->full)
+    return 1;
+  if (F->count == 0)
+    return 0;
+  bool hit = false;
+  if (!forRangeGranules(F->shift, (uint64_t)first, count, stride,
+                        capacity(F), [F, &hit](uint64_t g) {
+                          uint16_t fp;
+                          uint32_t b1;
+                          hashGranule(F, g, fp, b1);
+                          return hit = contains(F, fp, b1);
+                        }))
+    return 1;
+  return hit;
+}
+
+unsigned int CuckooSet_Population(void *Set) {
+  return ((CuckooFilter *)Set)->count;
+}
+
+void CuckooSet_Free(void *Set) {
+  CuckooFilter *F = (CuckooFilter *)Set;
+  if (F->prev)
+    F->prev->next = F->next;
+  else
+    LiveFilters = F->next;
+  if (F->next)
+    F->next->prev = F->prev;
+  free(F);
+}
+
+/// Called by instrumented code just before ptr is freed or deleted.
+void CuckooSet_Free_Hook(void *ptr) {
+  if (!ptr || !LiveFilters)
+    return;
+  uint64_t size = malloc_usable_size(ptr);
+  for (CuckooFilter *F = LiveFilters; F; F = F->next)
+    deleteRange(F, (uint64_t)ptr, size);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -30,7 +30,6 @@ extern "C" {
   uint64_t KnuthHash(void *addr) {
     // For 8 byte aligned boundaries, this right shift should be 3
     // Here, we are assuming a 4 byte alignment.
-	  printf("hashing\n");
     return ((uint64_t)addr >> 2) * 2654435761u;
   }
 
@@ -60,6 +59,41 @@ extern "C" {
     return bit_set;
   }
 
+  // The words of a table that hash indices below tableSize fall in.
+  static uint64_t tableWords(uint64_t tableSize) {
+    return (tableSize + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+  }
+
+  // A range summarized by the instrumentation: the count addresses first,
+  // first + stride, ... More addresses than the table has bits would set
+  // most of them anyway, so they set all of them instead; either way it is
+  // at most tableSize steps.
+  void HT_Insert_Range(void *first, uint64_t count, uint64_t stride,
+                       uint64_t *table, uint64_t tableSize) {
+    if (count > tableSize) {
+      memset(table, 0xff, tableWords(tableSize) * sizeof(uint64_t));
+      return;
+    }
+    for (uint64_t i = 0; i < count; i++)
+      HT_Insert_Value((char*)first + i * stride, table, tableSize);
+  }
+
+  // As above: a range too large to check address by address only misses an
+  // empty table.
+  uint64_t HT_Check_Range(void *first, uint64_t count, uint64_t stride,
+                          uint64_t *table, uint64_t tableSize) {
+    if (count > tableSize) {
+      for (uint64_t w = 0; w < tableWords(tableSize); w++)
+        if (table[w])
+          return 1;
+      return 0;
+    }
+    for (uint64_t i = 0; i < count; i++)
+      if (HT_Membership_Check((char*)first + i * stride, table, tableSize))
+        return 1;
+    return 0;
+  }
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,6 +4,9 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <algorithm>
+#include <iterator>
+#include <map>
 #include <set>
 #include <iostream>
 #include <fstream>
@@ -25,33 +28,129 @@ extern "C" {
 // inline functions.
 	
 typedef std::set<uint64_t> UIntSet;
+typedef std::map<uint64_t, uint64_t> RunMap;
+
+// Addresses inserted one at a time, and word ranges (stride 4, as the
+// instrumentation makes for memory intrinsics and int arrays) kept as runs:
+// runs[r] maps the first of each run of addresses that are r mod 4 to its
+// last, with no two runs overlapping or adjacent. An address is in values or
+// in a run, not both, so the population is the sum of the two.
+struct PerfectSetData {
+	UIntSet values;
+	RunMap runs[4];
+	uint64_t runAddrs;
+	PerfectSetData() : runAddrs(0) {}
+};
+
+static bool inRun(PerfectSetData *S, uint64_t a) {
+	RunMap &m = S->runs[a & 3];
+	RunMap::iterator it = m.upper_bound(a);
+	if (it == m.begin())
+		return false;
+	--it;
+	return a <= it->second;
+}
+
+// Add the run lo, lo + 4, ..., hi, merging it with the runs it touches.
+static void addRun(PerfectSetData *S, uint64_t lo, uint64_t hi) {
+	RunMap &m = S->runs[lo & 3];
+	RunMap::iterator it = m.upper_bound(lo);
+	if (it != m.begin()) {
+		RunMap::iterator prev = std::prev(it);
+		if (prev->second + 4 >= lo) {
+			lo = prev->first;
+			hi = std::max(hi, prev->second);
+			S->runAddrs -= (prev->second - prev->first) / 4 + 1;
+			it = m.erase(prev);
+		}
+	}
+	while (it != m.end() && it->first <= hi + 4) {
+		hi = std::max(hi, it->second);
+		S->runAddrs -= (it->second - it->first) / 4 + 1;
+		it = m.erase(it);
+	}
+	m[lo] = hi;
+	S->runAddrs += (hi - lo) / 4 + 1;
+
+	for (UIntSet::iterator v = S->values.lower_bound(lo);
+	     v != S->values.end() && *v <= hi;)
+		if ((*v - lo) % 4 == 0)
+			v = S->values.erase(v);
+		else
+			++v;
+}
 
 int* Get_New_Set() {
-	UIntSet* NewSet = new UIntSet;
+	PerfectSetData* NewSet = new PerfectSetData;
 //	printf("Get_New_Set: %p\n", NewSet);
 	return (int*)NewSet;
 }
 
 void PerfectSet_Insert_Value(void *Set, void *addr) {
-	UIntSet* local = (UIntSet*)Set;
+	PerfectSetData* local = (PerfectSetData*)Set;
 //	printf("Perfect_Insert_Value: %p, %p\n", local, Set);
-	local->insert((uint64_t)addr);
+	if (!inRun(local, (uint64_t)addr))
+		local->values.insert((uint64_t)addr);
 }
 
 unsigned int PerfectSet_MembershipCheck(void *addr, void *Set) {
-	UIntSet* local = (UIntSet*)Set;
+	PerfectSetData* local = (PerfectSetData*)Set;
 //	printf("Perfect_MembershipCheck: %p, %p\n", local, Set);
-	return (local->find((uint64_t)addr) != local->end());
+	return local->values.count((uint64_t)addr) || inRun(local, (uint64_t)addr);
+}
+
+// A range summarized by the instrumentation: the count addresses first,
+// first + stride, ... Word ranges take O(log n) as a run; any other stride
+// is inserted an address at a time, in O(count log n).
+void PerfectSet_Insert_Range(void *Set, void *first, uint64_t count,
+                             uint64_t stride) {
+	PerfectSetData* local = (PerfectSetData*)Set;
+	if (stride == 4) {
+		addRun(local, (uint64_t)first, (uint64_t)first + (count - 1) * 4);
+		return;
+	}
+	for (uint64_t i = 0; i < count; i++)
+		PerfectSet_Insert_Value(Set, (char*)first + i * stride);
+}
+
+unsigned int PerfectSet_Check_Range(void *first, uint64_t count,
+                                    uint64_t stride, void *Set) {
+	PerfectSetData* local = (PerfectSetData*)Set;
+	uint64_t lo = (uint64_t)first;
+	uint64_t hi = lo + (count - 1) * stride;
+	for (UIntSet::iterator it = local->values.lower_bound(lo);
+	     it != local->values.end() && *it <= hi; ++it)
+		if ((*it - lo) % stride == 0)
+			return 1;
+
+	// In each run that overlaps [lo, hi], the range's addresses cycle through
+	// the residues mod 4 within 4 steps, so 4 of them decide the run.
+	for (unsigned r = 0; r < 4; r++) {
+		RunMap &m = local->runs[r];
+		RunMap::iterator it = m.upper_bound(lo);
+		if (it != m.begin())
+			--it;
+		for (; it != m.end() && it->first <= hi; ++it) {
+			uint64_t from = std::max(lo, it->first);
+			uint64_t to = std::min(hi, it->second);
+			if (from > to)
+				continue;
+			uint64_t a = lo + (from - lo + stride - 1) / stride * stride;
+			for (unsigned j = 0; j < 4 && a <= to; j++, a += stride)
+				if ((a & 3) == r)
+					return 1;
+		}
+	}
+	return 0;
 }
 
 unsigned int PerfectSet_Population(void * Set) {
-	UIntSet* local = (UIntSet*)Set;
-	return (local->size());
+	PerfectSetData* local = (PerfectSetData*)Set;
+	return local->values.size() + local->runAddrs;
 }
 
 void Free_Set(void *Set) {
-	UIntSet* local = (UIntSet*)Set;
-	local->clear();
+	PerfectSetData* local = (PerfectSetData*)Set;
 //	printf("FreeSet: %p, %p\n", local, Set);
 	delete local;
 }
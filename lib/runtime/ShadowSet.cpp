@@ -0,0 +1,156 @@
+//===- ShadowSet.cpp - Exact sets as tags in shadow memory ----------------===//
+//
+// Backs ShadowSet instrumentation (-shadowinstr). Every granule of the
+// address space (4 or 8 bytes, or as -granularity gives) has a 64-bit tag: the epoch of the set instance that
+// last inserted it, or 0. The instrumentation inserts and checks inline,
+// storing its set's epoch into the granule's tag or comparing against it;
+// it only calls in here to take a new epoch, which is how a set is made or
+// cleared, to map a chunk of tags on the first insert into it, and to
+// insert or check a range (a memset, memcpy or summarized loop) at once.
+//
+// The tags sit in a two-level table per granule size: a flat table of
+// chunk pointers covering the 48-bit address space, and chunks of
+// 1 << ChunkBits tags mapped on demand. Both are mapped MAP_NORESERVE, so
+// only the pages actually touched take memory. Epochs are never reused,
+// so a tag left over from an earlier set instance never matches.
+//
+//===----------------------------------------------------------------------===//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+namespace {
+
+// Must match ShadowSet::AddressBits and ShadowSet::ChunkBits in the
+// instrumentation.
+const unsigned AddressBits = 48;
+const unsigned ChunkBits = 22;
+
+uint64_t LastEpoch = 0;
+
+void *mapShadow(size_t bytes) {
+  void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "DDP WARN: cannot map %zu bytes of shadow memory\n", bytes);
+    abort();
+  }
+  return p;
+}
+
+inline size_t tableBytes(uint32_t shift) {
+  return ((size_t)1 << (AddressBits - shift - ChunkBits)) * sizeof(uint64_t *);
+}
+
+// Call fn(chunk, from, to) for the runs of granules, within one chunk each,
+// holding the count addresses first, first + stride, ... of 1 << shift
+// byte granules; from and to are offsets in the chunk, to inclusive. A
+// stride within a granule covers every granule in between, so the runs
+// are as long as the chunks allow. Stops early when fn returns true, and
+// returns whether it did. As in the instrumentation, only the low
+// AddressBits of an address count, so chunk numbers stay in the table.
+template <typename Fn>
+bool forGranuleRuns(uint32_t shift, void *first, uint64_t count,
+                    uint64_t stride, Fn fn) {
+  const uint64_t mask = ((uint64_t)1 << ChunkBits) - 1;
+  const uint64_t chunks =
+      ((uint64_t)1 << (AddressBits - shift - ChunkBits)) - 1;
+  uint64_t lo = (uint64_t)first >> shift;
+  if (stride > ((uint64_t)1 << shift)) {
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t g = ((uint64_t)first + i * stride) >> shift;
+      if (fn((g >> ChunkBits) & chunks, g & mask, g & mask))
+        return true;
+    }
+    return false;
+  }
+  uint64_t hi = ((uint64_t)first + (count - 1) * stride) >> shift;
+  for (uint64_t g = lo; g <= hi; g = (g | mask) + 1) {
+    uint64_t end = (g | mask) < hi ? (g | mask) : hi;
+    if (fn((g >> ChunkBits) & chunks, g & mask, end & mask))
+      return true;
+  }
+  return false;
+}
+
+} // end anonymous namespace
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// The chunk tables, indexed by log2 of the granule size.
+uint64_t **ShadowSet_Tables[AddressBits - ChunkBits + 1];
+
+/// Checks of granules in unmapped chunks load this instead.
+extern const uint64_t ShadowSet_No_Tag = 0;
+
+/// A new, empty set: an epoch that no tag holds yet. Maps the chunk table
+/// for granules of 1 << shift bytes on first use.
+uint64_t ShadowSet_New(uint32_t shift) {
+  uint64_t **table = __atomic_load_n(&ShadowSet_Tables[shift],
+                                     __ATOMIC_ACQUIRE);
+  if (!table) {
+    uint64_t **fresh = (uint64_t **)mapShadow(tableBytes(shift));
+    if (__atomic_compare_exchange_n(&ShadowSet_Tables[shift], &table, fresh,
+                                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      table = fresh;
+    else
+      munmap(fresh, tableBytes(shift));
+  }
+  return __atomic_add_fetch(&LastEpoch, 1, __ATOMIC_RELAXED);
+}
+
+/// Map chunk number chunk of the table for 1 << shift byte granules, if
+/// no other thread has, and return it.
+uint64_t *ShadowSet_Map_Chunk(uint32_t shift, uint64_t chunk) {
+  const size_t bytes = ((size_t)1 << ChunkBits) * sizeof(uint64_t);
+  uint64_t **slot = &ShadowSet_Tables[shift][chunk];
+  uint64_t *tags = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (tags)
+    return tags;
+  uint64_t *fresh = (uint64_t *)mapShadow(bytes);
+  if (__atomic_compare_exchange_n(slot, &tags, fresh, false, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE))
+    return fresh;
+  munmap(fresh, bytes);
+  return tags;
+}
+
+/// Insert the count addresses first, first + stride, ... into the set
+/// whose epoch is tag: one store per granule they touch, in chunk-sized
+/// runs, rather than a separate insert per address.
+void ShadowSet_Insert_Range(uint64_t tag, uint32_t shift, void *first,
+                            uint64_t count, uint64_t stride) {
+  forGranuleRuns(shift, first, count, stride,
+                 [=](uint64_t chunk, uint64_t from, uint64_t to) {
+    uint64_t *tags = ShadowSet_Map_Chunk(shift, chunk);
+    for (uint64_t g = from; g <= to; g++)
+      tags[g] = tag;
+    return false;
+  });
+}
+
+/// Whether any of those addresses is in the set whose epoch is tag. Runs
+/// in chunks never mapped hold no tags, so they are skipped whole.
+unsigned int ShadowSet_Check_Range(void *first, uint64_t count,
+                                   uint64_t stride, uint64_t tag,
+                                   uint32_t shift) {
+  uint64_t **table = ShadowSet_Tables[shift];
+  return forGranuleRuns(shift, first, count, stride,
+                        [=](uint64_t chunk, uint64_t from, uint64_t to) {
+    uint64_t *tags = __atomic_load_n(&table[chunk], __ATOMIC_ACQUIRE);
+    if (!tags)
+      return false;
+    for (uint64_t g = from; g <= to; g++)
+      if (tags[g] == tag)
+        return true;
+    return false;
+  });
+}
+
+#ifdef __cplusplus
+}
+#endif
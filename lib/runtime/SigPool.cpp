@@ -0,0 +1,137 @@
+//===- SigPool.cpp - Per-thread pool of signature buffers -----------------===//
+//
+// Backs the AllocatePooled policy (-pooled-signatures). Instead of an
+// alloca that is zeroed on every call, a function takes a zeroed buffer
+// from a per-thread free list on entry and hands it back on return, so
+// deep recursion no longer grows the stack by a signature per frame.
+//
+// Buffers come in power of 2 size classes. The 64 bytes in front of each
+// buffer hold its header; the last 8 of them (ptr-8) are a dirty mask in
+// which instrumented inserts set bit (offset >> chunkShift). On release
+// only the dirty chunks are cleared, so a call that inserts a handful of
+// addresses into a large signature clears a handful of cache lines. A
+// buffer acquired with chunkShift < 0 is cleared in full.
+//
+//===----------------------------------------------------------------------===//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+const unsigned MinClassLog2 = 6;    // 64 bytes
+const unsigned NumClasses = 15;     // up to 1 MiB
+const unsigned MaxCachedPerClass = 64;
+
+struct PoolHeader {
+  PoolHeader *next;       // free list link
+  uint32_t classIndex;    // NumClasses for unpooled (oversized) buffers
+  uint32_t bytes;         // bytes requested
+  int32_t chunkShift;     // < 0 if inserts do not track dirty chunks
+  uint8_t pad[36];
+  uint64_t dirty;         // at ptr-8, updated by instrumented code
+};
+
+static_assert(sizeof(PoolHeader) == 64, "header must keep buffers aligned");
+
+inline PoolHeader *headerOf(void *ptr) {
+  return (PoolHeader *)ptr - 1;
+}
+
+struct ThreadPool {
+  PoolHeader *freeList[NumClasses];
+  unsigned cached[NumClasses];
+
+  ThreadPool() {
+    memset(freeList, 0, sizeof(freeList));
+    memset(cached, 0, sizeof(cached));
+  }
+
+  ~ThreadPool() {
+    for (unsigned c = 0; c < NumClasses; c++)
+      while (PoolHeader *H = freeList[c]) {
+        freeList[c] = H->next;
+        free(H);
+      }
+  }
+};
+
+thread_local ThreadPool Pool;
+
+unsigned classFor(uint32_t bytes) {
+  unsigned c = 0;
+  while (c < NumClasses && (1u << (MinClassLog2 + c)) < bytes)
+    c++;
+  return c;
+}
+
+PoolHeader *newBuffer(unsigned c, uint32_t bytes) {
+  size_t size = c < NumClasses ? (size_t)1 << (MinClassLog2 + c) : bytes;
+  size = (size + 63) & ~(size_t)63;
+  PoolHeader *H = (PoolHeader *)aligned_alloc(64, sizeof(PoolHeader) + size);
+  if (!H)
+    abort();
+  memset(H, 0, sizeof(PoolHeader) + size);
+  H->classIndex = c;
+  return H;
+}
+
+void clearDirty(PoolHeader *H) {
+  char *buf = (char *)(H + 1);
+  if (H->chunkShift < 0 || H->dirty == ~0ULL) {
+    if (H->dirty)
+      memset(buf, 0, H->bytes);
+  } else {
+    uint64_t chunk = (uint64_t)1 << H->chunkShift;
+    for (uint64_t d = H->dirty; d; d &= d - 1) {
+      uint64_t off = (uint64_t)__builtin_ctzll(d) << H->chunkShift;
+      if (off < H->bytes)
+        memset(buf + off, 0, off + chunk <= H->bytes ? chunk : H->bytes - off);
+    }
+  }
+  H->dirty = 0;
+}
+
+} // end anonymous namespace
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Returns a zeroed, 64 byte aligned buffer of at least bytes bytes.
+/// chunkShift is the log2 of the chunk size used by the instrumentation to
+/// mark writes in the dirty mask, or -1 if it does not mark them.
+void *SigPool_Acquire(uint32_t bytes, int32_t chunkShift) {
+  unsigned c = classFor(bytes);
+  PoolHeader *H = NULL;
+  if (c < NumClasses && (H = Pool.freeList[c])) {
+    Pool.freeList[c] = H->next;
+    Pool.cached[c]--;
+  } else {
+    H = newBuffer(c, bytes);
+  }
+  H->next = NULL;
+  H->bytes = bytes;
+  H->chunkShift = chunkShift;
+  // Without tracking any insert may have written anywhere.
+  H->dirty = chunkShift < 0 ? ~0ULL : 0;
+  return H + 1;
+}
+
+void SigPool_Release(void *ptr) {
+  PoolHeader *H = headerOf(ptr);
+  unsigned c = H->classIndex;
+  if (c >= NumClasses || Pool.cached[c] >= MaxCachedPerClass) {
+    free(H);
+    return;
+  }
+  clearDirty(H);
+  H->next = Pool.freeList[c];
+  Pool.freeList[c] = H;
+  Pool.cached[c]++;
+}
+
+#ifdef __cplusplus
+}
+#endif
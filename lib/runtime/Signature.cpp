@@ -0,0 +1,239 @@
+//===- Signature.cpp - Banked signatures for library call mode ------------===//
+//
+// Backs LibCallSignature (-ddp-use-runtime-lib-calls). A signature is an
+// array of 32-bit words, a power of 2 of them and at least NumBanks,
+// split into NumBanks equal banks. An address sets one bit in each bank,
+// picked by a multiply-shift hash with the bank's own seed, and is a
+// member if all of its bits are set. The _2K entry points are for the
+// default 64 word (2K bit) signature; the _Sig ones take the size.
+//
+// All the banks' hashes are one vector multiply of the address by the
+// seeds, so the implementation is chosen once for the CPU, on the first
+// call: with AVX2 a check also fetches its words with one gather and
+// tests them with one compare; with SSE4.2 only the hashing is vectorized;
+// anything else runs the scalar code. Built as bitcode (-DDDP_RUNTIME_BC) to be
+// linked into the program for LTO, the entry points are scalar and always
+// inlined instead, since a call through the dispatch could not be.
+//
+//===----------------------------------------------------------------------===//
+
+#include <stdint.h>
+
+#if !defined(DDP_RUNTIME_BC) && (defined(__x86_64__) || defined(__i386__))
+#define DDP_SIG_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+#ifdef DDP_RUNTIME_BC
+#define DDP_SIG_ENTRY __attribute__((always_inline))
+#else
+#define DDP_SIG_ENTRY
+#endif
+
+namespace {
+
+const unsigned NumBanks = 4;
+const uint32_t Words2K = 64;
+
+// Odd multipliers, one per bank.
+const uint32_t Seeds[NumBanks] = {
+  0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu
+};
+
+// log2 of the bits in each bank of a signature of words words.
+inline unsigned bankLog2(uint32_t words) {
+  return __builtin_ctz(words) + 5 - 2;
+}
+
+// The address folded to 32 bits, without the low bits that most accesses
+// share.
+inline uint32_t fold(const void *addr) {
+  uint64_t a = (uint64_t)(uintptr_t)addr >> 2;
+  return (uint32_t)a ^ (uint32_t)(a >> 32);
+}
+
+// The bit, counted over the whole signature, that x sets in bank b.
+inline uint32_t bitIndex(uint32_t x, unsigned b, unsigned log2) {
+  return (b << log2) + ((x * Seeds[b]) >> (32 - log2));
+}
+
+void insertScalar(uint32_t *sign, uint32_t words, const void *addr) {
+  uint32_t x = fold(addr);
+  unsigned log2 = bankLog2(words);
+  for (unsigned b = 0; b < NumBanks; b++) {
+    uint32_t i = bitIndex(x, b, log2);
+    sign[i >> 5] |= 1u << (i & 31);
+  }
+}
+
+unsigned checkScalar(const void *addr, const uint32_t *sign, uint32_t words) {
+  uint32_t x = fold(addr);
+  unsigned log2 = bankLog2(words);
+  uint32_t hit = 1;
+  for (unsigned b = 0; b < NumBanks; b++) {
+    uint32_t i = bitIndex(x, b, log2);
+    hit &= sign[i >> 5] >> (i & 31);
+  }
+  return hit & 1;
+}
+
+#ifdef DDP_SIG_DISPATCH
+
+// bitIndex for every bank at once.
+__attribute__((target("sse4.2")))
+inline __m128i bitIndices(const void *addr, uint32_t words) {
+  __m128i shift = _mm_cvtsi32_si128(32 - bankLog2(words));
+  __m128i h = _mm_mullo_epi32(_mm_set1_epi32(fold(addr)),
+                              _mm_loadu_si128((const __m128i *)Seeds));
+  __m128i base = _mm_sll_epi32(_mm_setr_epi32(0, 1, 2, 3),
+                               _mm_cvtsi32_si128(bankLog2(words)));
+  return _mm_add_epi32(base, _mm_srl_epi32(h, shift));
+}
+
+// There is no scatter, so the bits are set one at a time.
+__attribute__((target("sse4.2")))
+void insertSSE(uint32_t *sign, uint32_t words, const void *addr) {
+  uint32_t idx[NumBanks];
+  _mm_storeu_si128((__m128i *)idx, bitIndices(addr, words));
+  for (unsigned b = 0; b < NumBanks; b++)
+    sign[idx[b] >> 5] |= 1u << (idx[b] & 31);
+}
+
+__attribute__((target("sse4.2")))
+unsigned checkSSE(const void *addr, const uint32_t *sign, uint32_t words) {
+  uint32_t idx[NumBanks];
+  _mm_storeu_si128((__m128i *)idx, bitIndices(addr, words));
+  uint32_t hit = 1;
+  for (unsigned b = 0; b < NumBanks; b++)
+    hit &= sign[idx[b] >> 5] >> (idx[b] & 31);
+  return hit & 1;
+}
+
+__attribute__((target("avx2")))
+unsigned checkAVX2(const void *addr, const uint32_t *sign, uint32_t words) {
+  __m128i idx = bitIndices(addr, words);
+  __m128i w = _mm_i32gather_epi32((const int *)sign, _mm_srli_epi32(idx, 5),
+                                  4);
+  __m128i bits = _mm_sllv_epi32(_mm_set1_epi32(1),
+                                _mm_and_si128(idx, _mm_set1_epi32(31)));
+  // 1 if every bit in bits is also in w.
+  return _mm_testc_si128(w, bits);
+}
+
+#endif
+
+typedef void (*InsertFn)(uint32_t *, uint32_t, const void *);
+typedef unsigned (*CheckFn)(const void *, const uint32_t *, uint32_t);
+
+#ifdef DDP_SIG_DISPATCH
+void insertResolve(uint32_t *sign, uint32_t words, const void *addr);
+unsigned checkResolve(const void *addr, const uint32_t *sign, uint32_t words);
+
+// The implementations for this CPU. They start out as stubs that pick them
+// on the first call, rather than being set by a dynamic initializer, since
+// instrumented global constructors in other translation units may insert
+// and check before this one's initializers run.
+InsertFn InsertImpl = insertResolve;
+CheckFn CheckImpl = checkResolve;
+
+void resolveOps() {
+  __builtin_cpu_init();
+  InsertFn insert = insertScalar;
+  CheckFn check = checkScalar;
+  if (__builtin_cpu_supports("avx2")) {
+    insert = insertSSE;
+    check = checkAVX2;
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    insert = insertSSE;
+    check = checkSSE;
+  }
+  // Racing threads all store the same choice.
+  __atomic_store_n(&InsertImpl, insert, __ATOMIC_RELAXED);
+  __atomic_store_n(&CheckImpl, check, __ATOMIC_RELAXED);
+}
+
+void insertResolve(uint32_t *sign, uint32_t words, const void *addr) {
+  resolveOps();
+  __atomic_load_n(&InsertImpl, __ATOMIC_RELAXED)(sign, words, addr);
+}
+
+unsigned checkResolve(const void *addr, const uint32_t *sign, uint32_t words) {
+  resolveOps();
+  return __atomic_load_n(&CheckImpl, __ATOMIC_RELAXED)(addr, sign, words);
+}
+
+inline void insert(uint32_t *sign, uint32_t words, const void *addr) {
+  __atomic_load_n(&InsertImpl, __ATOMIC_RELAXED)(sign, words, addr);
+}
+
+inline unsigned check(const void *addr, const uint32_t *sign, uint32_t words) {
+  return __atomic_load_n(&CheckImpl, __ATOMIC_RELAXED)(addr, sign, words);
+}
+#else
+inline void insert(uint32_t *sign, uint32_t words, const void *addr) {
+  insertScalar(sign, words, addr);
+}
+
+inline unsigned check(const void *addr, const uint32_t *sign, uint32_t words) {
+  return checkScalar(addr, sign, words);
+}
+#endif
+
+} // end anonymous namespace
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+DDP_SIG_ENTRY void Insert_Value_2K(uint32_t *Sign, void *addr) {
+  insert(Sign, Words2K, addr);
+}
+
+DDP_SIG_ENTRY unsigned int MembershipCheck_2K(void *addr, uint32_t *Sign) {
+  return check(addr, Sign, Words2K);
+}
+
+/// As above, for a signature of words words: a power of 2, at least 4.
+DDP_SIG_ENTRY void Insert_Value_Sig(uint32_t *Sign, void *addr,
+                                    uint32_t words) {
+  insert(Sign, words, addr);
+}
+
+DDP_SIG_ENTRY unsigned int MembershipCheck_Sig(void *addr, uint32_t *Sign,
+                                               uint32_t words) {
+  return check(addr, Sign, words);
+}
+
+/// The count addresses first, first + stride, ..., for either size. More
+/// addresses than a bank has bits would set most of it anyway, so they set
+/// every bit instead, and a check of them only misses an empty signature.
+DDP_SIG_ENTRY void Insert_Range_Sig(uint32_t *Sign, void *first,
+                                    uint64_t count, uint64_t stride,
+                                    uint32_t words) {
+  if (count > ((uint64_t)1 << bankLog2(words))) {
+    for (uint32_t w = 0; w < words; w++)
+      Sign[w] = ~0u;
+    return;
+  }
+  for (uint64_t i = 0; i < count; i++)
+    insert(Sign, words, (char *)first + i * stride);
+}
+
+DDP_SIG_ENTRY unsigned int Check_Range_Sig(void *first, uint64_t count,
+                                           uint64_t stride, uint32_t *Sign,
+                                           uint32_t words) {
+  if (count > ((uint64_t)1 << bankLog2(words))) {
+    for (uint32_t w = 0; w < words; w++)
+      if (Sign[w])
+        return 1;
+    return 0;
+  }
+  for (uint64_t i = 0; i < count; i++)
+    if (check((char *)first + i * stride, Sign, words))
+      return 1;
+  return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
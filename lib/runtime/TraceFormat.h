@@ -0,0 +1,205 @@
+//===- TraceFormat.h - Encoding of DDP address traces -----------*- C++ -*-===//
+//
+// Address traces are written by the TraceSet runtime and read back by
+// offline tools such as ddp-sigsim. This header is shared by both, so it must
+// stay free of LLVM and runtime dependencies.
+//
+// A trace file is a header followed by independent blocks:
+//
+//   header: "DDPTRACE" u32 version u32 dropped
+//   block:  u32 payloadBytes u32 numRecords u32 thread u32 reserved
+//           u64 epoch                     -- thread's region epoch at start
+//           payload[payloadBytes]
+//
+// Each record in a payload is
+//
+//   varint( zigzag(refid - lastRefid) << 2 | kind )
+//   varint( zigzag(addr - lastAddr) )     -- loads and stores only
+//
+// where kind is TRACE_LOAD, TRACE_STORE or TRACE_REGION. lastRefid and
+// lastAddr start at zero in every block, so blocks can be decoded on their
+// own. A TRACE_REGION record marks the (re)allocation of a set, which starts
+// a new region epoch for its thread; records carry the epoch implicitly.
+//
+// dropped counts the events the recorder lost at exit, from threads that
+// were still recording when the trace was closed (saturating).
+//
+// All multi-byte header fields are little endian.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DDP_TRACE_FORMAT_H
+#define DDP_TRACE_FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace ddptrace {
+
+enum RecordKind {
+  TRACE_LOAD = 0,
+  TRACE_STORE = 1,
+  TRACE_REGION = 2
+};
+
+static const char Magic[8] = { 'D', 'D', 'P', 'T', 'R', 'A', 'C', 'E' };
+static const uint32_t Version = 1;
+
+// Worst case size of one encoded record.
+static const unsigned MaxRecordBytes = 20;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dropped;
+};
+
+struct BlockHeader {
+  uint32_t payloadBytes;
+  uint32_t numRecords;
+  uint32_t thread;
+  uint32_t reserved;
+  uint64_t epoch;
+};
+
+inline uint64_t zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+inline uint8_t *putVarint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+inline const uint8_t *getVarint(const uint8_t *p, const uint8_t *end,
+                                uint64_t &v) {
+  v = 0;
+  for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      return p;
+  }
+  return NULL;
+}
+
+/// One decoded trace event.
+struct Record {
+  uint32_t thread;
+  int32_t refid;
+  uint64_t addr;   // 0 for TRACE_REGION
+  uint64_t epoch;  // region epoch of the issuing thread
+  RecordKind kind;
+};
+
+/// TraceReader - Sequentially decodes a trace file, one record at a time.
+class TraceReader {
+  FILE *f;
+  std::vector<uint8_t> payload;
+  const uint8_t *cur, *end;
+  BlockHeader block;
+  int64_t lastRefid;
+  uint64_t lastAddr;
+  uint64_t epoch;
+  uint32_t dropped;
+  bool bad;
+
+  bool nextBlock() {
+    if (fread(&block, sizeof(block), 1, f) != 1)
+      return false;
+    payload.resize(block.payloadBytes);
+    if (block.payloadBytes &&
+        fread(&payload[0], block.payloadBytes, 1, f) != 1) {
+      bad = true;
+      return false;
+    }
+    cur = payload.empty() ? NULL : &payload[0];
+    end = cur + payload.size();
+    lastRefid = 0;
+    lastAddr = 0;
+    epoch = block.epoch;
+    return true;
+  }
+
+ public:
+  TraceReader() : f(NULL), cur(NULL), end(NULL), lastRefid(0), lastAddr(0),
+                  epoch(0), dropped(0), bad(false) {}
+  ~TraceReader() { close(); }
+
+  bool open(const char *file) {
+    close();
+    f = fopen(file, "rb");
+    if (!f)
+      return false;
+    FileHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, Magic, 8) ||
+        h.version != Version) {
+      close();
+      return false;
+    }
+    bad = false;
+    dropped = h.dropped;
+    cur = end = NULL;
+    return true;
+  }
+
+  void close() {
+    if (f)
+      fclose(f);
+    f = NULL;
+  }
+
+  /// True if decoding stopped because the file is truncated or corrupt.
+  bool isCorrupt() { return bad; }
+
+  /// Events the recorder lost at exit, which the trace does not contain.
+  uint32_t droppedEvents() { return dropped; }
+
+  bool next(Record &R) {
+    while (cur == end)
+      if (!f || !nextBlock())
+        return false;
+
+    uint64_t head;
+    if (!(cur = getVarint(cur, end, head))) {
+      bad = true;
+      cur = end;
+      return false;
+    }
+    R.kind = (RecordKind)(head & 3);
+    lastRefid += unzigzag(head >> 2);
+    R.refid = (int32_t)lastRefid;
+    R.thread = block.thread;
+    R.addr = 0;
+
+    if (R.kind == TRACE_REGION) {
+      R.epoch = ++epoch;
+      return true;
+    }
+
+    uint64_t delta;
+    if (!(cur = getVarint(cur, end, delta))) {
+      bad = true;
+      cur = end;
+      return false;
+    }
+    lastAddr += (uint64_t)unzigzag(delta);
+    R.addr = lastAddr;
+    R.epoch = epoch;
+    return true;
+  }
+};
+
+} // end namespace ddptrace
+
+#endif // DDP_TRACE_FORMAT_H
@@ -0,0 +1,359 @@
+//===- TraceSet.cpp - Address trace recorder runtime ----------------------===//
+//
+// Records every insert and membership check issued by TraceSet
+// instrumentation, so signatures can be tuned offline against real address
+// streams (see ddp-sigsim).
+//
+// Events are appended to a per-thread buffer using the delta+varint encoding
+// described in TraceFormat.h. Full buffers are handed to a background writer
+// thread, so the instrumented thread never waits on the disk unless the
+// writer falls more than MaxQueuedBlocks behind.
+//
+// Each thread encodes into its own block without locking. Between records
+// the block is parked in the thread's slot, and at exit the writer takes
+// parked blocks over by swapping them out of their slots; a thread in the
+// middle of a record hands its block in itself when it finishes. Only the
+// events of threads that are still recording StopGraceMs after exit began
+// are lost, and their count is stored in the trace's header.
+//
+// The output file is taken from DDP_TRACE_FILE (default "ddp.trace").
+//
+//===----------------------------------------------------------------------===//
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "TraceFormat.h"
+
+using namespace ddptrace;
+
+namespace {
+
+const size_t BlockPayloadBytes = 64 * 1024;
+const size_t MaxQueuedBlocks = 256;
+const unsigned StopGraceMs = 100;
+
+struct Block {
+  BlockHeader header;
+  uint8_t payload[BlockPayloadBytes];
+};
+
+/// Where a thread's block is parked between records. Slots are never freed,
+/// so stop() can look at the slots of threads that have exited.
+struct Slot {
+  std::atomic<Block*> block;
+  Slot() : block(NULL) {}
+};
+
+// Slot states besides a parked block: NULL while the owner is recording,
+// Stopping once stop() has asked a recording owner for its block, and
+// Stopped once the block is gone and the thread traces no more.
+Block *const Stopping = (Block*)1;
+Block *const Stopped = (Block*)2;
+
+/// The writer owns the output file and the queue of full blocks.
+class TraceWriter {
+  std::mutex lock;
+  std::condition_variable wake;     // writer: there is work to do
+  std::condition_variable drained;  // producers: queue has room
+  std::deque<Block*> full;
+  std::vector<Block*> spare;
+  std::vector<Slot*> slots;
+  std::thread worker;
+  std::atomic<uint64_t> dropped;
+  FILE *out;
+  bool started;
+  bool stopping;
+  uint32_t nextThread;
+
+  void run();
+
+ public:
+  TraceWriter() : dropped(0), out(NULL), started(false), stopping(false),
+                  nextThread(0) {}
+
+  bool start();
+  void stop();
+
+  Block *getBlock();
+  void release(Block *B);
+  void submit(Block *B);
+  void finish(Block *B);
+  void drop(uint64_t events) {
+    dropped.fetch_add(events, std::memory_order_relaxed);
+  }
+
+  Slot *registerThread(uint32_t &thread);
+};
+
+TraceWriter &getWriter() {
+  static TraceWriter *W = new TraceWriter();
+  return *W;
+}
+
+/// Per-thread encoder state.
+struct ThreadBuffer {
+  Slot *slot;  // NULL if this thread is not traced
+  uint8_t *cur;
+  uint8_t *end;
+  int64_t lastRefid;
+  uint64_t lastAddr;
+  uint64_t epoch;
+  uint32_t thread;
+
+  ThreadBuffer() : slot(NULL), cur(NULL), end(NULL), lastRefid(0),
+                   lastAddr(0), epoch(0), thread(0) {
+    if (getWriter().start()) {
+      slot = getWriter().registerThread(thread);
+      slot->block.store(open(), std::memory_order_release);
+    }
+  }
+
+  // Hand the last block to the writer; stop() may have taken it already.
+  ~ThreadBuffer() {
+    if (!slot)
+      return;
+    Block *B = slot->block.exchange(NULL, std::memory_order_acquire);
+    if (B != Stopped)
+      getWriter().finish(B);
+    slot->block.store(Stopped, std::memory_order_release);
+  }
+
+  Block *open() {
+    Block *B = getWriter().getBlock();
+    cur = B->payload;
+    end = B->payload + BlockPayloadBytes - MaxRecordBytes;
+    B->header.payloadBytes = 0;
+    B->header.numRecords = 0;
+    B->header.thread = thread;
+    B->header.reserved = 0;
+    B->header.epoch = epoch;
+    lastRefid = 0;
+    lastAddr = 0;
+    return B;
+  }
+
+  // Park B again, unless stop() asked for it meanwhile: then hand it in.
+  void park(Block *B) {
+    Block *expected = NULL;
+    if (slot->block.compare_exchange_strong(expected, B,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed))
+      return;
+    getWriter().finish(B);
+    slot->block.store(Stopped, std::memory_order_release);
+  }
+
+  void record(int refid, uint64_t addr, RecordKind kind) {
+    if (!slot)
+      return;
+    Block *B = slot->block.exchange(NULL, std::memory_order_acquire);
+    if (B == Stopped) {
+      slot->block.store(Stopped, std::memory_order_release);
+      getWriter().drop(1);
+      return;
+    }
+    if (cur >= end) {
+      getWriter().finish(B);
+      B = open();
+    }
+    cur = putVarint(cur, (zigzag((int64_t)refid - lastRefid) << 2) | kind);
+    lastRefid = refid;
+    if (kind == TRACE_REGION)
+      epoch++;
+    else {
+      cur = putVarint(cur, zigzag((int64_t)(addr - lastAddr)));
+      lastAddr = addr;
+    }
+    B->header.numRecords++;
+    B->header.payloadBytes = (uint32_t)(cur - B->payload);
+    park(B);
+  }
+};
+
+bool TraceWriter::start() {
+  std::lock_guard<std::mutex> guard(lock);
+  if (started)
+    return out != NULL;
+  started = true;
+
+  const char *file = getenv("DDP_TRACE_FILE");
+  if (!file || !*file)
+    file = "ddp.trace";
+  out = fopen(file, "wb");
+  if (!out) {
+    fprintf(stderr, "DDP: cannot open trace file %s, tracing disabled\n", file);
+    return false;
+  }
+  FileHeader h;
+  memcpy(h.magic, Magic, sizeof(h.magic));
+  h.version = Version;
+  h.dropped = 0;
+  fwrite(&h, sizeof(h), 1, out);
+
+  worker = std::thread(&TraceWriter::run, this);
+  atexit([] { getWriter().stop(); });
+  return true;
+}
+
+void TraceWriter::run() {
+  std::unique_lock<std::mutex> guard(lock);
+  for (;;) {
+    wake.wait(guard, [this] { return !full.empty() || stopping; });
+    if (full.empty() && stopping)
+      break;
+    Block *B = full.front();
+    full.pop_front();
+    drained.notify_all();
+
+    // Write without holding the lock so producers can keep queueing.
+    guard.unlock();
+    fwrite(&B->header, sizeof(B->header), 1, out);
+    fwrite(B->payload, B->header.payloadBytes, 1, out);
+    guard.lock();
+    spare.push_back(B);
+  }
+  fflush(out);
+}
+
+void TraceWriter::stop() {
+  std::vector<Slot*> live;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!out || stopping)
+      return;
+    live = slots;
+  }
+
+  // Take the parked blocks, and ask the threads recording right now for
+  // theirs.
+  std::vector<Slot*> busy;
+  for (Slot *S : live) {
+    Block *B = S->block.load(std::memory_order_acquire);
+    for (;;) {
+      if (B == Stopped)
+        break;
+      if (!B) {
+        if (S->block.compare_exchange_weak(B, Stopping,
+                                           std::memory_order_acq_rel)) {
+          busy.push_back(S);
+          break;
+        }
+      } else if (S->block.compare_exchange_weak(B, Stopped,
+                                                std::memory_order_acq_rel)) {
+        finish(B);
+        break;
+      }
+    }
+  }
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(StopGraceMs);
+  for (Slot *S : busy)
+    while (S->block.load(std::memory_order_acquire) != Stopped
+           && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::yield();
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  drained.notify_all();
+  worker.join();
+
+  uint64_t lost = dropped.load(std::memory_order_relaxed);
+  if (lost) {
+    uint32_t count = lost > UINT32_MAX ? UINT32_MAX : (uint32_t)lost;
+    fseek(out, offsetof(FileHeader, dropped), SEEK_SET);
+    fwrite(&count, sizeof(count), 1, out);
+    fprintf(stderr, "DDP WARN: %llu trace events lost at exit\n",
+            (unsigned long long)lost);
+  }
+  fclose(out);
+  out = NULL;
+}
+
+Block *TraceWriter::getBlock() {
+  std::lock_guard<std::mutex> guard(lock);
+  if (!spare.empty()) {
+    Block *B = spare.back();
+    spare.pop_back();
+    return B;
+  }
+  return new Block();
+}
+
+void TraceWriter::release(Block *B) {
+  std::lock_guard<std::mutex> guard(lock);
+  spare.push_back(B);
+}
+
+// Queue a full block. Blocks that come in once the writer has stopped are
+// counted as dropped.
+void TraceWriter::submit(Block *B) {
+  std::unique_lock<std::mutex> guard(lock);
+  drained.wait(guard, [this] {
+    return full.size() < MaxQueuedBlocks || stopping;
+  });
+  if (stopping) {
+    drop(B->header.numRecords);
+    spare.push_back(B);
+    return;
+  }
+  full.push_back(B);
+  wake.notify_one();
+}
+
+// A thread is done with B: queue it if it holds anything.
+void TraceWriter::finish(Block *B) {
+  if (B->header.numRecords)
+    submit(B);
+  else
+    release(B);
+}
+
+Slot *TraceWriter::registerThread(uint32_t &thread) {
+  std::lock_guard<std::mutex> guard(lock);
+  slots.push_back(new Slot());
+  thread = nextThread++;
+  return slots.back();
+}
+
+ThreadBuffer &getBuffer() {
+  static thread_local ThreadBuffer TB;
+  return TB;
+}
+
+} // end anonymous namespace
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A set was (re)allocated: everything recorded for refid after this belongs
+// to a new region.
+void TraceSet_Region(int refid) {
+  getBuffer().record(refid, 0, TRACE_REGION);
+}
+
+void TraceSet_Store(int refid, void *addr) {
+  getBuffer().record(refid, (uint64_t)addr, TRACE_STORE);
+}
+
+void TraceSet_Load(int refid, void *addr) {
+  getBuffer().record(refid, (uint64_t)addr, TRACE_LOAD);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -33,6 +33,7 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
 
 #if (LLVM_VERSION_MAJOR==3) && (LLVM_VERSION_MINOR>4)
 #define LLVM_AFTER_34
@@ -78,6 +79,7 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include <algorithm>
 #include <memory>
+#include <set>
 using namespace llvm;
 
 //#include "DDPInfoInAA.h"
@@ -230,6 +232,12 @@ ApplicationName("appname",cl::desc("The name of the application this is a part o
 static cl::opt<std::string>
 ProfileDBPrefix("profile-db-prefix",cl::desc("The location of the profiling database"),cl::init(""));
 
+static cl::opt<std::string>
+RuntimeBC("ddp-runtime-bc",
+          cl::desc("Link the runtime bitcode (ddprt.bc) in before any pass "
+                   "runs, so calls into it can be inlined"),
+          cl::value_desc("filename"), cl::init(""));
+
 // ---------- Define Printers for module and function passes ------------
 namespace {
 
@@ -596,6 +604,91 @@ void ProfilerSupport(Module &M)
   DBFileManager::Initialize(ProfileDBPrefix,original,ApplicationName);
 }
 
+// Add the functions that use V, through constants, to Fns.
+static void addUsingFunctions(Value *V, std::set<Function*> &Fns) {
+  for (User *U : V->users()) {
+    if (Instruction *I = dyn_cast<Instruction>(U))
+      Fns.insert(I->getParent()->getParent());
+    else if (isa<Constant>(U) && !isa<GlobalValue>(U))
+      addUsingFunctions(U, Fns);
+  }
+}
+
+///
+/// Link the runtime bitcode into M before instrumenting it. Its functions
+/// become available_externally: the optimizer may inline the calls the
+/// instrumentation makes to them, and libddprt still provides the symbols.
+///
+/// The runtime's mutable state (the profile database, trace buffers,
+/// signature pools, CPU dispatch) must stay the library's. A copy in M would
+/// be a second instance of it. So every function that reaches a writable
+/// global becomes a declaration, and the runtime's static constructors are
+/// dropped. The bodies that remain are tagged DDPRuntimeFnAttr, so the
+/// profiler leaves them alone.
+///
+static bool linkRuntimeBitcode(Module &M, LLVMContext &Context) {
+  SMDiagnostic Err;
+#if defined(DDP_LLVM_VERSION_3_6) || defined(DDP_LLVM_VERSION_3_7)
+  std::unique_ptr<Module> RT = parseIRFile(RuntimeBC, Err, Context);
+#else
+  std::unique_ptr<Module> RT(ParseIRFile(RuntimeBC, Err, Context));
+#endif
+  if (!RT) {
+    Err.print("ddp", errs());
+    return false;
+  }
+
+  const char *Structors[] = { "llvm.global_ctors", "llvm.global_dtors" };
+  for (const char *Name : Structors)
+    if (GlobalVariable *GV = RT->getNamedGlobal(Name))
+      GV->eraseFromParent();
+
+  std::set<Function*> Stateful;
+  for (GlobalVariable &GV : RT->globals())
+    if (!GV.isDeclaration() && !GV.isConstant())
+      addUsingFunctions(&GV, Stateful);
+  std::vector<Function*> Work(Stateful.begin(), Stateful.end());
+  while (!Work.empty()) {
+    Function *F = Work.back();
+    Work.pop_back();
+    std::set<Function*> Callers;
+    addUsingFunctions(F, Callers);
+    for (Function *C : Callers)
+      if (Stateful.insert(C).second)
+        Work.push_back(C);
+  }
+
+  std::vector<Function*> Dropped;
+  for (Function &F : *RT) {
+    if (F.isDeclaration())
+      continue;
+    if (Stateful.count(&F)) {
+      if (F.hasLocalLinkage())
+        Dropped.push_back(&F);
+      F.deleteBody();
+    } else {
+      F.addFnAttr(DDPRuntimeFnAttr);
+      if (F.hasExternalLinkage())
+        F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    }
+  }
+  // Only the bodies just deleted called these.
+  for (Function *F : Dropped)
+    if (F->use_empty())
+      F->eraseFromParent();
+
+#if defined(DDP_LLVM_VERSION_3_6) || defined(DDP_LLVM_VERSION_3_7)
+  bool Failed = Linker::LinkModules(&M, RT.get());
+#else
+  bool Failed = Linker::linkModules(M, std::move(RT));
+#endif
+  if (Failed) {
+    errs() << "ddp: could not link " << RuntimeBC << "\n";
+    return false;
+  }
+  return true;
+}
+
 //===----------------------------------------------------------------------===//
 // main for opt
 //
@@ -678,6 +771,9 @@ int main(int argc, char **argv) {
 
   ProfilerSupport(*M.get());
 
+  if (!RuntimeBC.empty() && !linkRuntimeBitcode(*M.get(), Context))
+    return 1;
+
   // If we are supposed to override the target triple, do so now.
   if (!TargetTriple.empty())
     M->setTargetTriple(Triple::normalize(TargetTriple));
@@ -0,0 +1,104 @@
+//===- SignatureJIT.cpp - JIT-compiled signature APIs ---------------------===//
+//
+// The sets create their types in SImpleFactory::getContext(), so each API is
+// generated into a module of that context and added to one MCJIT engine,
+// which compiles it on the first lookup. Calls out of the generated code are
+// resolved by SectionMemoryManager against the symbols of the process.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "SetInstrumentFactory.h"
+#include "SignatureJIT.h"
+
+using namespace llvm;
+
+Expected<std::unique_ptr<SignatureJIT> > SignatureJIT::Create() {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  // Make the symbols of the process itself visible to
+  // RTDyldMemoryManager::getSymbolAddressInProcess.
+  std::string Err;
+  if (sys::DynamicLibrary::LoadLibraryPermanently(nullptr, &Err))
+    return make_error<StringError>(Err, inconvertibleErrorCode());
+
+  std::unique_ptr<Module> M(new Module("signature-jit",
+                                       SImpleFactory::getContext()));
+  ExecutionEngine *EE = EngineBuilder(std::move(M))
+      .setEngineKind(EngineKind::JIT)
+      .setErrorStr(&Err)
+      .setMCJITMemoryManager(std::unique_ptr<RTDyldMemoryManager>(
+                                 new SectionMemoryManager()))
+      .create();
+  if (!EE)
+    return make_error<StringError>("cannot create MCJIT: " + Err,
+                                   inconvertibleErrorCode());
+
+  return std::unique_ptr<SignatureJIT>(new SignatureJIT(EE));
+}
+
+template <typename FnTy>
+Error SignatureJIT::lookup(const std::string &Name, FnTy &Fn) {
+  uint64_t Addr = EE->getFunctionAddress(Name);
+  if (EE->hasError()) {
+    std::string Msg = EE->getErrorMessage();
+    EE->clearErrorMessage();
+    return make_error<StringError>(Msg, inconvertibleErrorCode());
+  }
+  if (!Addr)
+    return make_error<StringError>("symbol not found: " + Name,
+                                   inconvertibleErrorCode());
+  Fn = (FnTy)(intptr_t)Addr;
+  return Error::success();
+}
+
+Expected<SignatureFns> SignatureJIT::compile(SImple &S, std::string Name) {
+  if (Name.empty())
+    Name = S.getName();
+  std::string Prefix = "JIT" + std::to_string(NextId++) + "_" + Name;
+
+  std::unique_ptr<Module> M(new Module(Prefix, SImpleFactory::getContext()));
+  M->setDataLayout(EE->getDataLayout());
+  M->setTargetTriple(EE->getTargetMachine()->getTargetTriple().str());
+
+  BuildSignatureAPI B(S, Prefix);
+  B.CreateAPI(M.get());
+
+  // Sets allocate anonymous globals, which would clash with those of the
+  // previously compiled modules in the same engine.
+  for (GlobalVariable &GV : M->globals())
+    if (!GV.hasName()) {
+      GV.setName(Prefix + ".sig");
+      GV.setLinkage(GlobalValue::InternalLinkage);
+    }
+
+  std::string VerifyMsg;
+  raw_string_ostream VerifyOS(VerifyMsg);
+  if (verifyModule(*M, &VerifyOS))
+    return make_error<StringError>("invalid signature API for " + Name +
+                                   ": " + VerifyOS.str(),
+                                   inconvertibleErrorCode());
+
+  EE->addModule(std::move(M));
+
+  SignatureFns Fns;
+  Fns.name = Name;
+  if (Error E = lookup(Prefix + "AllocateFn", Fns.allocate))
+    return std::move(E);
+  if (Error E = lookup(Prefix + "InsertFn", Fns.insert))
+    return std::move(E);
+  if (Error E = lookup(Prefix + "MembershipFn", Fns.check))
+    return std::move(E);
+  if (Error E = lookup(Prefix + "FreeFn", Fns.free))
+    return std::move(E);
+  if (Error E = lookup(Prefix + "SizeFn", Fns.size))
+    return std::move(E);
+  return Fns;
+}
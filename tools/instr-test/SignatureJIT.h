@@ -0,0 +1,51 @@
+//===- SignatureJIT.h - JIT-compiled signature APIs -------------*- C++ -*-===//
+//
+// Builds the BuildSignatureAPI functions of any SImple and compiles them
+// in-process with MCJIT, returning native function pointers. This lets
+// tests, benchmarks and tuning sweeps exercise many IR-level configurations
+// without writing out bitcode and linking it against a driver for each one.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef SIGNATUREJIT_H
+#define SIGNATUREJIT_H
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/Support/Error.h"
+#include "BuildSignature.h"
+#include <memory>
+#include <string>
+
+/// Native entry points of one JIT-compiled signature API. The handle is the
+/// i32* that BuildSignatureAPI passes around.
+struct SignatureFns {
+  typedef int *Handle;
+
+  std::string name;
+  Handle (*allocate)();
+  void (*insert)(Handle, int8_t*);
+  int (*check)(Handle, int8_t*);
+  void (*free)(Handle);
+  int64_t (*size)();
+};
+
+class SignatureJIT {
+  std::unique_ptr<llvm::ExecutionEngine> EE;
+  unsigned NextId;
+
+  SignatureJIT(llvm::ExecutionEngine *aEE) : EE(aEE), NextId(0) {}
+
+  template <typename FnTy>
+  llvm::Error lookup(const std::string &Name, FnTy &Fn);
+
+ public:
+  /// Create a JIT for the host. Symbols the generated code calls, such as
+  /// the set runtime, are resolved in the current process.
+  static llvm::Expected<std::unique_ptr<SignatureJIT> > Create();
+
+  /// Generate and compile the API of S. Every call produces a fresh,
+  /// independently named copy, so the same SImple may be compiled again.
+  llvm::Expected<SignatureFns> compile(SImple &S, std::string Name = "");
+};
+
+#endif // SIGNATUREJIT_H
@@ -68,7 +68,10 @@
 #include <memory>
 
 #include "BuildSignature.h"
+#include "SetInstrumentFactory.h"
 #include "db/ProfilerDatabase.h"
+#include "llvm/Support/Format.h"
+#include "SignatureJIT.h"
 
 using namespace llvm;
 
@@ -78,6 +81,81 @@ OutputFilename("o", cl::desc("Output filename"), cl::value_desc("filename"));
 static cl::opt<bool>
 OutputAssembly("S", cl::desc("Write output as LLVM assembly"));
 
+static cl::opt<bool>
+SigBench("sigbench", cl::desc("Only emit the SigBench_ API of the signatures "
+                              "listed in SignatureBench.def (for ddp-sigbench)"));
+
+/// Emit SigBench_<Name>{Allocate,Insert,Membership,Free,Size}Fn for every
+/// set in SignatureBench.def.
+static void CreateSigBenchAPI(Module *M)
+{
+#define SIGBENCH(Name, Kind, Bits, Factory)       \
+  {                                               \
+    SImple *S = Factory;                          \
+    BuildSignatureAPI B(*S, "SigBench_" #Name);   \
+    B.CreateAPI(M);                               \
+    delete S;                                     \
+  }
+#include "SignatureBench.def"
+}
+
+static cl::opt<bool>
+JITSelfTest("jit-selftest", cl::desc("JIT-compile every set in "
+                                     "SignatureBench.def and check it in-process"));
+
+/// Insert a strided stream into a fresh set and probe it with addresses that
+/// were never inserted. Returns the number of false negatives.
+static unsigned SelfTestSignature(SignatureFns &Fns) {
+  const unsigned Population = 256, Probes = 4096;
+  static char Arena[(Population + Probes) * 8];
+
+  SignatureFns::Handle S = Fns.allocate();
+  for (unsigned i = 0; i < Population; i++)
+    Fns.insert(S, (int8_t*)&Arena[i * 8]);
+
+  unsigned FalseNegatives = 0, FalsePositives = 0;
+  for (unsigned i = 0; i < Population; i++)
+    if (!Fns.check(S, (int8_t*)&Arena[i * 8]))
+      FalseNegatives++;
+  for (unsigned i = Population; i < Population + Probes; i++)
+    if (Fns.check(S, (int8_t*)&Arena[i * 8]))
+      FalsePositives++;
+  Fns.free(S);
+
+  outs() << format("%-20s %8lld bytes  fpr %.4f  false negatives %u\n",
+                   Fns.name.c_str(), (long long)Fns.size(),
+                   (double)FalsePositives / Probes, FalseNegatives);
+  return FalseNegatives;
+}
+
+/// JIT every SignatureBench.def set. Sets that call into the runtime need it
+/// loaded into the process (e.g. with LD_PRELOAD=libddprt.so); they are
+/// reported and skipped otherwise.
+static int RunJITSelfTest()
+{
+  Expected<std::unique_ptr<SignatureJIT> > JIT = SignatureJIT::Create();
+  if (!JIT) {
+    logAllUnhandledErrors(JIT.takeError(), errs(), "instr-test: ");
+    return 1;
+  }
+
+  unsigned Failures = 0;
+#define SIGBENCH(Name, Kind, Bits, Factory)                             \
+  {                                                                     \
+    SImple *S = Factory;                                                \
+    Expected<SignatureFns> Fns = (*JIT)->compile(*S, #Name);            \
+    if (Fns)                                                            \
+      Failures += SelfTestSignature(*Fns) != 0;                         \
+    else                                                                \
+      logAllUnhandledErrors(Fns.takeError(), errs(),                    \
+                            "instr-test: skipping " #Name ": ");        \
+    delete S;                                                           \
+  }
+#include "SignatureBench.def"
+
+  return Failures ? 1 : 0;
+}
+
 #if 0
 void GenSignatureCode(Module *M)
 {
@@ -114,6 +192,9 @@ main (int argc, char ** argv)
   LLVMContext &Context = getGlobalContext();
   cl::ParseCommandLineOptions(argc, argv, "llvm system compiler\n");
 
+  if (JITSelfTest)
+    return RunJITSelfTest();
+
 #ifdef LLVM_AFTER_34
   std::unique_ptr<tool_output_file> Out;
 #else
@@ -162,6 +243,13 @@ main (int argc, char ** argv)
   M->setTargetTriple(sys::getDefaultTargetTriple());
 #endif
 
+  if (SigBench) {
+    CreateSigBenchAPI(M);
+    WriteBitcodeToFile(M,Out->os());
+    Out->keep();
+    return 0;
+  }
+
 #define DeclareSimple(Size,Mask)  	   \
   {                                        \
     SimpleSignature SS(Size,HashBuilderFactory::CreateShiftMaskIndex(Size,Mask));         \
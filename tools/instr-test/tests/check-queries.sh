@@ -0,0 +1,90 @@
+#!/bin/bash
+#
+# Regression tests for the queries ddp instruments and how.
+#
+# usage: check-queries.sh <ddp> <case.c>...
+#
+# Each case is compiled to bitcode (clang -O0, then mem2reg), and for each
+# "// RUN: <flags>" line in it, instrumented with
+#
+#   ddp -SetProfiler -promote-signatures=false <flags>
+#
+# which also verifies the result. The "// EXPECT: <n> <regex>" lines after
+# a RUN give how many lines of the instrumented IR must match the regex;
+# "// EXPECT-AFTER: <regex>" counts the EXPECTs that follow it only from
+# the first line matching the regex. Query results are left in memory
+# (-promote-signatures=false), so a query answered at compile time is a
+# "store i32 1" to its PerQuery variable.
+#
+
+DDP=$1
+shift
+CLANG=${CLANG:-clang}
+OPT=${OPT:-opt}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+failures=0
+
+fail() {
+  echo "FAIL: $1"
+  failures=$((failures + 1))
+}
+
+for src in "$@"; do
+  name=$(basename "$src" .c)
+  bc="$WORK/$name.bc"
+  if ! $CLANG -O0 -Xclang -disable-O0-optnone -emit-llvm -c -o "$bc.O0" "$src" \
+      || ! $OPT -mem2reg -o "$bc" "$bc.O0"; then
+    fail "$name: does not compile"
+    continue
+  fi
+
+  run=0
+  flags=
+  out=
+  from=1
+  while IFS= read -r line; do
+    case "$line" in
+      "// RUN:"*)
+        run=$((run + 1))
+        flags=${line#// RUN:}
+        out="$WORK/$name.$run.ll"
+        from=1
+        if ! (cd "$WORK" && "$DDP" -SetProfiler -promote-signatures=false \
+              $flags -S -o "$out" "$bc" > "$out.log" 2>&1); then
+          fail "$name:$flags: ddp failed (see below)"
+          tail -n 20 "$out.log"
+          out=
+        fi
+        ;;
+      "// EXPECT-AFTER:"*)
+        [ -n "$out" ] || continue
+        anchor=${line#// EXPECT-AFTER: }
+        from=$(grep -n -m1 -E -- "$anchor" "$out" | cut -d: -f1)
+        if [ -z "$from" ]; then
+          fail "$name:$flags: nothing matches '$anchor'"
+          out=
+        fi
+        ;;
+      "// EXPECT:"*)
+        [ -n "$out" ] || continue
+        spec=${line#// EXPECT: }
+        want=${spec%% *}
+        regex=${spec#* }
+        got=$(tail -n +"$from" "$out" | grep -c -E -- "$regex")
+        if [ "$got" != "$want" ]; then
+          fail "$name:$flags: $got lines match '$regex', expected $want"
+        fi
+        ;;
+    esac
+  done < "$src"
+  [ $run -gt 0 ] || fail "$name: no RUN lines"
+done
+
+if [ $failures -ne 0 ]; then
+  echo "$failures failures"
+  exit 1
+fi
+echo "all query tests passed"
@@ -0,0 +1,23 @@
+/* -number-addresses: a[0] = 5 dominates a[0] = 6, so the second insert
+   adds nothing. A ShadowSet forgets a granule once another set writes
+   it, so there both inserts stay (each maps its chunk on first use).
+   Every chunk index comes from the low 48 bits of the address. */
+
+// RUN: -htinstr
+// EXPECT: 2 call .*@HT_Insert_Value\(
+// EXPECT: 1 call .*@HT_Membership_Check\(
+
+// RUN: -htinstr -number-addresses
+// EXPECT: 1 call .*@HT_Insert_Value\(
+// EXPECT: 1 call .*@HT_Membership_Check\(
+
+// RUN: -shadowinstr -number-addresses
+// EXPECT: 2 call .*@ShadowSet_Map_Chunk\(
+// EXPECT: 3 and i64 .*, 281474976710655$
+
+int covered(int *a, int *b, int c) {
+  a[0] = 5;
+  if (c)
+    a[0] = 6;
+  return b[0];
+}
@@ -0,0 +1,37 @@
+/* -granularity=64: p and q are 64 byte aligned, so p[0] and p[1] are one
+   location, as are q[0] and q[1]. Within a block, the second insert of
+   a granule is elided, and so is the second check. */
+
+// RUN: -htinstr
+// EXPECT: 2 call .*@HT_Insert_Value\(
+// EXPECT: 2 call .*@HT_Membership_Check\(
+
+// RUN: -htinstr -granularity=64
+// EXPECT: 1 call .*@HT_Insert_Value\(
+// EXPECT: 1 call .*@HT_Membership_Check\(
+
+// RUN: -htinstr -granularity=64 -lazy-signatures
+// EXPECT: 1 call .*@HT_Insert_Value\(
+// EXPECT: 1 call .*@HT_Membership_Check\(
+
+// Cuckoo filters and shadow tags key on the granule themselves, so the
+// free hook and the tag table see the same granules as the inserts.
+// RUN: -cuckooinstr -granularity=64
+// EXPECT: 1 call .*@CuckooSet_New\(i32 [0-9]+, i32 6\)
+// EXPECT: 0 shl i64 .*, 2$
+// EXPECT: 1 call .*@CuckooSet_Insert_Value\(
+// EXPECT: 1 call .*@CuckooSet_MembershipCheck\(
+
+// RUN: -shadowinstr -shadow-granule=8 -granularity=64
+// EXPECT: 1 call .*@ShadowSet_New\(i32 6\)
+// EXPECT: 0 shl i64 .*, 2$
+
+typedef int *__attribute__((align_value(64))) line_ptr;
+
+int granules(line_ptr p, line_ptr q, int c) {
+  p[0] = 5;
+  p[1] = 6;
+  if (c)
+    return q[0] + q[1];
+  return 0;
+}
@@ -0,0 +1,18 @@
+/* -prune-queries: the store of a[i] always comes after the load of
+   a[j] == a[i + 1] reading that element, so it can never flow into the
+   load. Basic AA cannot relate i and j and leaves the pair MayAlias;
+   dependence analysis drops the query. */
+
+// RUN: -perfinstr
+// EXPECT: 1 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 1 call .*@PerfectSet_MembershipCheck\(
+
+// RUN: -perfinstr -prune-queries
+// EXPECT: 0 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 0 call .*@PerfectSet_MembershipCheck\(
+
+void shift_left(long *a, long n) {
+  long i, j;
+  for (i = 0, j = 1; i < n; i++, j++)
+    a[i] = a[j];
+}
@@ -0,0 +1,20 @@
+/* -prune-killed-queries: *p = 6 overwrites whatever *q = 5 may have
+   written there before the load, so the load's query against *q = 5 is
+   dropped. */
+
+// RUN: -perfinstr
+// EXPECT: 1 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 1 call .*@PerfectSet_MembershipCheck\(
+
+// RUN: -perfinstr -prune-killed-queries
+// EXPECT: 0 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 0 call .*@PerfectSet_MembershipCheck\(
+
+int killed(int *p, int *q, int c) {
+  *q = 5;
+  if (c) {
+    *p = 6;
+    return *p;
+  }
+  return 0;
+}
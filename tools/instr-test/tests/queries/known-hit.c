@@ -0,0 +1,30 @@
+/* -number-addresses: a[1] = 5 is inserted on every path to the load of
+   a[1], into the one set -htinstr uses, so that load's check is a known
+   hit. The load of b[0] is still checked. */
+
+// RUN: -htinstr
+// EXPECT: 2 call .*@HT_Insert_Value\(
+// EXPECT: 2 call .*@HT_Membership_Check\(
+// EXPECT: 0 store i32 1, i32\* %PerQuery
+
+// RUN: -htinstr -number-addresses
+// EXPECT: 2 call .*@HT_Insert_Value\(
+// EXPECT: 1 call .*@HT_Membership_Check\(
+// EXPECT: 1 store i32 1, i32\* %PerQuery
+
+// RUN: -htinstr -number-addresses -lazy-signatures
+// EXPECT: 2 call .*@HT_Insert_Value\(
+// EXPECT: 1 call .*@HT_Membership_Check\(
+// EXPECT: 1 store i32 1, i32\* %PerQuery
+
+int known_hit(int *a, int *b, int c) {
+  int x = 0;
+  a[1] = 5;
+  if (c) {
+    x = b[0];
+    b[0] = 6;
+    if (c > 1)
+      x += a[1];
+  }
+  return x;
+}
@@ -0,0 +1,35 @@
+/* -lazy-signatures: the loop is the only user of the set, so the set is
+   allocated in if.then, ahead of it, rather than at entry. The return is
+   also reached by skipping the loop, so a set that must be freed (here
+   PerfectSet's heap set) is freed on the edge out of the loop instead; a
+   set on the stack just needs no freeing there. */
+
+// RUN: -perfinstr
+// EXPECT: 1 call .*@Get_New_Set\(
+// EXPECT: 1 call .*@Free_Set\(
+// EXPECT-AFTER: ^if\.then:
+// EXPECT: 0 call .*@Get_New_Set\(
+
+// RUN: -perfinstr -lazy-signatures
+// EXPECT: 1 call .*@Get_New_Set\(
+// EXPECT: 1 call .*@Free_Set\(
+// EXPECT-AFTER: ^if\.then:
+// EXPECT: 1 call .*@Get_New_Set\(
+// EXPECT-AFTER: ^for\.end\.region\.exit:
+// EXPECT: 1 call .*@Free_Set\(
+
+// RUN: -signinstr -lazy-signatures
+// EXPECT: 0 region\.exit
+// EXPECT-AFTER: ^if\.then:
+// EXPECT: 1 call void @llvm\.memset
+
+long cold_sum(long *a, long *b, long n) {
+  long i, s = 0;
+  if (n > 100) {
+    for (i = 0; i < n; i++) {
+      a[i] = n;
+      s += b[i];
+    }
+  }
+  return s;
+}
@@ -0,0 +1,34 @@
+/* -loop-local-signatures: the loop only inserts into the set, which the
+   load after it checks. Its inserts go into a private copy, allocated next
+   to the set, that is ORed into the set when the loop exits: as one i64
+   for a 64-bit signature, and word by word (merge.loop) for the word
+   arrays of wider, banked and blocked signatures. */
+
+// RUN: -signinstr -signsize=64
+// EXPECT: 1 = alloca i64
+// EXPECT: 0 ^merge\.loop:
+
+// RUN: -signinstr -signsize=64 -loop-local-signatures
+// EXPECT: 2 = alloca i64
+// EXPECT-AFTER: ^for\.end:
+// EXPECT: 3 load i64, i64\* %SimpleSignature
+// EXPECT: 0 ^merge\.loop:
+
+// RUN: -signinstr -loop-local-signatures
+// EXPECT: 2 %BankedSignature[0-9]* = alloca i32, i32 32
+// EXPECT: 1 ^merge\.loop:
+
+// RUN: -signinstr -signsize=256 -loop-local-signatures
+// EXPECT: 2 %ArraySignature[0-9]* = alloca i64, i32 4
+// EXPECT: 1 ^merge\.loop:
+
+// RUN: -signinstr -blocked-sign -loop-local-signatures
+// EXPECT: 2 %BlockedSignature[0-9]* = alloca <16 x i32>
+// EXPECT: 1 ^merge\.loop:
+
+long fill(long *a, long *b, long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    a[i] = i;
+  return b[0];
+}
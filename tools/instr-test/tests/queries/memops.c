@@ -0,0 +1,33 @@
+/* Memory intrinsics touch a run of bytes, so each one is inserted or
+   checked as a single range of the words in it, never word by word.
+   An atomic is a single access like a load or store.
+
+   copy_then_read: the memcpy is one range insert; the load and the
+   atomicrmw after it are plain checks.
+   fill_then_copy: the memset is one range insert, and what the memcpy
+   reads one range check. */
+
+// RUN: -perfinstr
+// EXPECT: 2 call .*@PerfectSet_Insert_Range\(
+// EXPECT: 1 call .*@PerfectSet_Check_Range\(
+// EXPECT: 0 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 2 call .*@PerfectSet_MembershipCheck\(
+
+// RUN: -htinstr
+// EXPECT: 2 call .*@HT_Insert_Range\(
+// EXPECT: 1 call .*@HT_Check_Range\(
+// EXPECT: 0 call .*@HT_Insert_Value\(
+// EXPECT: 2 call .*@HT_Membership_Check\(
+
+int copy_then_read(int *d, int *s, long n, int *q, int c) {
+  __builtin_memcpy(d, s, n);
+  if (c)
+    return d[1] + __atomic_fetch_add(q, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void fill_then_copy(int *p, int *d, int *s, long n, int c) {
+  __builtin_memset(p, 0, n);
+  if (c)
+    __builtin_memcpy(d, s, n);
+}
@@ -0,0 +1,27 @@
+/* -pooled-signatures: the set comes from SigPool_Acquire instead of the
+   stack and goes back at the return. A 1024-bit signature is cleared in
+   full on release; from 512 bytes on, each bank insert also marks the
+   64-byte chunk it wrote in the mask in front of the buffer. */
+
+// RUN: -signinstr
+// EXPECT: 0 call .*@SigPool_Acquire\(
+// EXPECT: 0 call .*@SigPool_Release\(
+
+// RUN: -signinstr -pooled-signatures
+// EXPECT: 1 call .*@SigPool_Acquire\(i32 128, i32 -1\)
+// EXPECT: 1 call .*@SigPool_Release\(
+// EXPECT: 0 getelementptr i64, i64\* .*, i32 -1$
+
+// RUN: -signinstr -pooled-signatures -signsize=4096
+// EXPECT: 1 call .*@SigPool_Acquire\(i32 512, i32 6\)
+// EXPECT: 1 call .*@SigPool_Release\(
+// EXPECT: 2 getelementptr i64, i64\* .*, i32 -1$
+
+long copy_and_sum(long *a, long *b, long n) {
+  long i, s = 0;
+  for (i = 0; i < n; i++) {
+    a[i] = n;
+    s += b[i];
+  }
+  return s;
+}
@@ -0,0 +1,29 @@
+/* -summarize-ranges: a[i] is stored and b[j] loaded at affine addresses
+   once per iteration of countable loops. The first loop never checks the
+   set and the second never inserts into it, so each access becomes one
+   range insert or check, in the preheader of its loop. */
+
+// RUN: -perfinstr
+// EXPECT: 1 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 1 call .*@PerfectSet_MembershipCheck\(
+// EXPECT: 0 call .*@PerfectSet_Insert_Range\(
+// EXPECT: 0 call .*@PerfectSet_Check_Range\(
+
+// RUN: -perfinstr -summarize-ranges
+// EXPECT: 0 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 0 call .*@PerfectSet_MembershipCheck\(
+// EXPECT: 1 call .*@PerfectSet_Insert_Range\(
+// EXPECT: 1 call .*@PerfectSet_Check_Range\(
+// EXPECT-AFTER: ^for\.cond:
+// EXPECT: 0 call .*@PerfectSet_Insert_Range\(
+// EXPECT-AFTER: ^for\.cond[0-9]+:
+// EXPECT: 0 call .*@PerfectSet_Check_Range\(
+
+long fill_then_sum(long *a, long *b, long n) {
+  long i, j, s = 0;
+  for (i = 0; i < n; i++)
+    a[i] = i;
+  for (j = 0; j < n; j++)
+    s += b[j];
+  return s;
+}
@@ -0,0 +1,24 @@
+/* -number-addresses: the second load of b[0] follows the first in the
+   same block with no insert in between, so it reuses the first check. */
+
+// RUN: -htinstr
+// EXPECT: 1 call .*@HT_Insert_Value\(
+// EXPECT: 2 call .*@HT_Membership_Check\(
+
+// RUN: -htinstr -number-addresses
+// EXPECT: 1 call .*@HT_Insert_Value\(
+// EXPECT: 1 call .*@HT_Membership_Check\(
+
+// RUN: -htinstr -number-addresses -lazy-signatures
+// EXPECT: 1 call .*@HT_Insert_Value\(
+// EXPECT: 1 call .*@HT_Membership_Check\(
+
+int reused(int *a, int *b, int c) {
+  a[0] = 5;
+  if (c) {
+    int x = b[0];
+    int y = b[0];
+    return x + y;
+  }
+  return 0;
+}
@@ -0,0 +1,32 @@
+/* -prune-killed-queries: both loads of *p read the memory left by
+   *r = 6, so the second shares the first one's checks. -perfinstr gives
+   each store its own set. The first load is only checked against the set
+   of *q = 5 (*r = 6 is in its own block), so only that check is shared;
+   the second load checks the set of *r = 6 itself, after the branch on
+   c > 1. The same holds with lazily allocated sets, whose regions only
+   cover their own queries. */
+
+// RUN: -perfinstr
+// EXPECT: 3 call .*@PerfectSet_MembershipCheck\(
+
+// RUN: -perfinstr -prune-killed-queries
+// EXPECT: 2 call .*@PerfectSet_MembershipCheck\(
+// EXPECT-AFTER: icmp sgt i32 %c, 1
+// EXPECT: 1 call .*@PerfectSet_MembershipCheck\(
+
+// RUN: -perfinstr -prune-killed-queries -lazy-signatures
+// EXPECT: 2 call .*@PerfectSet_MembershipCheck\(
+// EXPECT-AFTER: icmp sgt i32 %c, 1
+// EXPECT: 1 call .*@PerfectSet_MembershipCheck\(
+
+int shared_leader(int *p, int *q, int *r, int c) {
+  int a = 0, b = 0;
+  *q = 5;
+  if (c) {
+    *r = 6;
+    a = *p;
+    if (c > 1)
+      b = *p;
+  }
+  return a + b;
+}
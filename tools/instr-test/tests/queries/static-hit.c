@@ -0,0 +1,22 @@
+/* -prune-queries: the load of a[j] always reads the a[i] stored just
+   before it in the same iteration. The query is kept as a static hit,
+   answered without inserting or checking. */
+
+// RUN: -perfinstr
+// EXPECT: 1 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 1 call .*@PerfectSet_MembershipCheck\(
+// EXPECT: 0 store i32 1, i32\* %PerQuery
+
+// RUN: -perfinstr -prune-queries
+// EXPECT: 0 call .*@PerfectSet_Insert_Value\(
+// EXPECT: 0 call .*@PerfectSet_MembershipCheck\(
+// EXPECT: 1 store i32 1, i32\* %PerQuery
+
+long store_and_sum(long *a, long n) {
+  long i, j, s = 0;
+  for (i = 0, j = 0; i < n; i++, j++) {
+    a[i] = n;
+    s += a[j];
+  }
+  return s;
+}
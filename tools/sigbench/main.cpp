@@ -0,0 +1,418 @@
+//===- main.cpp - ddp-sigbench: signature throughput and accuracy ---------===//
+//
+// Measures every set implementation listed in SignatureBench.def over a
+// collection of address streams and reports, as JSON:
+//
+//   ns/insert, ns/check  - average cost of the generated Insert/Membership
+//                          functions (including the call)
+//   false_positive_rate  - fraction of probe addresses that were never
+//                          inserted but were reported as members
+//   false_negatives      - inserted addresses reported as absent (must be 0
+//                          for every signature)
+//   memory_bytes         - static footprint of the set (null for sets that
+//                          live on the heap)
+//
+// The set implementations are compiled ahead of time from the bitcode that
+// "instr-test -sigbench" generates, so what is measured is exactly the IR the
+// instrumenter emits.
+//
+//===----------------------------------------------------------------------===//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "TraceFormat.h"
+
+typedef int *Signature;
+
+extern "C" {
+#define SIGBENCH(Name, Kind, Bits, Factory)                    \
+  Signature SigBench_##Name##AllocateFn();                     \
+  void SigBench_##Name##InsertFn(Signature, int8_t*);          \
+  int SigBench_##Name##MembershipFn(Signature, int8_t*);       \
+  void SigBench_##Name##FreeFn(Signature);                     \
+  int64_t SigBench_##Name##SizeFn();
+#include "SignatureBench.def"
+}
+
+namespace {
+
+struct BenchSignature {
+  const char *name;
+  const char *kind;
+  unsigned bits;
+  Signature (*allocate)();
+  void (*insert)(Signature, int8_t*);
+  int (*check)(Signature, int8_t*);
+  void (*free)(Signature);
+  int64_t (*size)();
+};
+
+BenchSignature Signatures[] = {
+#define SIGBENCH(Name, Kind, Bits, Factory)                    \
+  { #Name, Kind, Bits,                                         \
+    SigBench_##Name##AllocateFn, SigBench_##Name##InsertFn,    \
+    SigBench_##Name##MembershipFn, SigBench_##Name##FreeFn,    \
+    SigBench_##Name##SizeFn },
+#include "SignatureBench.def"
+};
+
+const size_t NumSignatures = sizeof(Signatures) / sizeof(Signatures[0]);
+
+struct Stream {
+  std::string name;
+  std::vector<uintptr_t> addrs;
+};
+
+struct Options {
+  std::vector<size_t> populations;
+  size_t probes;
+  double minTimeMs;
+  std::string filter;
+  std::string output;
+  std::vector<std::string> traces;
+  bool list;
+
+  Options() : probes(8192), minTimeMs(10.0), list(false) {
+    size_t p[] = { 16, 64, 256, 1024, 4096 };
+    populations.assign(p, p + sizeof(p) / sizeof(p[0]));
+  }
+};
+
+/// Synthetic streams ========================================================
+///
+/// Each stream only produces addresses; nothing is ever dereferenced. The
+/// backing allocations are real so the addresses carry realistic high bits.
+
+std::vector<void*> Allocations;
+
+uintptr_t reserve(size_t bytes) {
+  void *p = malloc(bytes);
+  if (!p) {
+    fprintf(stderr, "ddp-sigbench: out of memory\n");
+    exit(1);
+  }
+  Allocations.push_back(p);
+  return (uintptr_t)p;
+}
+
+Stream makeStrided(size_t n, size_t stride) {
+  Stream S;
+  S.name = "strided_" + std::to_string(stride);
+  uintptr_t base = reserve(n * stride);
+  for (size_t i = 0; i < n; i++)
+    S.addrs.push_back(base + i * stride);
+  return S;
+}
+
+Stream makeRandom(size_t n, std::mt19937_64 &rng) {
+  Stream S;
+  S.name = "random";
+  const size_t arena = 64 << 20;
+  uintptr_t base = reserve(arena);
+  std::uniform_int_distribution<size_t> dist(0, arena / 4 - 1);
+  for (size_t i = 0; i < n; i++)
+    S.addrs.push_back(base + dist(rng) * 4);
+  return S;
+}
+
+// Nodes of a linked list built in random order, visited in list order. The
+// address recorded is that of the next field, as a list traversal would.
+Stream makePointerChase(size_t n, std::mt19937_64 &rng) {
+  Stream S;
+  S.name = "pointer_chase";
+  std::vector<uintptr_t> nodes;
+  for (size_t i = 0; i < n; i++)
+    nodes.push_back(reserve(48));
+  std::shuffle(nodes.begin(), nodes.end(), rng);
+  for (size_t i = 0; i < n; i++)
+    S.addrs.push_back(nodes[i] + 8);
+  return S;
+}
+
+// One field of an array of 24 byte structs.
+Stream makeStructField(size_t n) {
+  Stream S;
+  S.name = "struct_field";
+  uintptr_t base = reserve(n * 24);
+  for (size_t i = 0; i < n; i++)
+    S.addrs.push_back(base + i * 24 + 8);
+  return S;
+}
+
+// A recorded trace: either a binary trace written by the TraceSet runtime
+// (-record-trace), of which the load and store addresses are used in order,
+// or, failing that, one hexadecimal address per line, as written by the
+// DumpSet runtime and consumed by tests/trace.cpp.
+bool readTrace(const std::string &file, Stream &S) {
+  size_t slash = file.find_last_of('/');
+  S.name = slash == std::string::npos ? file : file.substr(slash + 1);
+
+  ddptrace::TraceReader R;
+  if (R.open(file.c_str())) {
+    ddptrace::Record Rec;
+    while (R.next(Rec))
+      if (Rec.kind != ddptrace::TRACE_REGION)
+        S.addrs.push_back((uintptr_t)Rec.addr);
+    if (R.isCorrupt())
+      fprintf(stderr, "ddp-sigbench: trace %s is truncated or corrupt, "
+              "using the %zu addresses before that\n", file.c_str(),
+              S.addrs.size());
+    if (R.droppedEvents())
+      fprintf(stderr, "ddp-sigbench: trace %s lost %u events at exit\n",
+              file.c_str(), R.droppedEvents());
+    return true;
+  }
+
+  FILE *f = fopen(file.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "ddp-sigbench: cannot open trace %s\n", file.c_str());
+    return false;
+  }
+  char line[128];
+  while (fgets(line, sizeof(line), f)) {
+    char *end;
+    unsigned long long a = strtoull(line, &end, 16);
+    if (end != line)
+      S.addrs.push_back((uintptr_t)a);
+  }
+  fclose(f);
+  return true;
+}
+
+/// Measurement ==============================================================
+
+struct Point {
+  size_t population;
+  double nsInsert;
+  double nsCheck;
+  double fpr;
+  size_t falseNegatives;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsedNs(Clock::time_point a, Clock::time_point b) {
+  return std::chrono::duration<double, std::nano>(b - a).count();
+}
+
+volatile int Sink;
+
+Point measure(BenchSignature &B, const Stream &S, size_t population,
+              size_t probes, double minTimeMs) {
+  const uintptr_t *ins = &S.addrs[0];
+  const uintptr_t *prb = &S.addrs[S.addrs.size() - probes];
+
+  Point P;
+  P.population = population;
+
+  // Accuracy, against the exact set of inserted addresses.
+  std::unordered_set<uintptr_t> exact(ins, ins + population);
+  Signature sig = B.allocate();
+  for (size_t i = 0; i < population; i++)
+    B.insert(sig, (int8_t*)ins[i]);
+
+  P.falseNegatives = 0;
+  for (size_t i = 0; i < population; i++)
+    if (!B.check(sig, (int8_t*)ins[i]))
+      P.falseNegatives++;
+
+  size_t negatives = 0, falsePositives = 0;
+  for (size_t i = 0; i < probes; i++) {
+    if (exact.count(prb[i]))
+      continue;
+    negatives++;
+    if (B.check(sig, (int8_t*)prb[i]))
+      falsePositives++;
+  }
+  B.free(sig);
+  P.fpr = negatives ? (double)falsePositives / negatives : 0.0;
+
+  // Throughput. Repeat whole allocate/insert/check rounds until enough time
+  // has been spent to get a stable average.
+  double insertNs = 0, checkNs = 0;
+  size_t rounds = 0;
+  int hits = 0;
+  do {
+    sig = B.allocate();
+    Clock::time_point t0 = Clock::now();
+    for (size_t i = 0; i < population; i++)
+      B.insert(sig, (int8_t*)ins[i]);
+    Clock::time_point t1 = Clock::now();
+    for (size_t i = 0; i < probes; i++)
+      hits += B.check(sig, (int8_t*)prb[i]);
+    Clock::time_point t2 = Clock::now();
+    B.free(sig);
+
+    insertNs += elapsedNs(t0, t1);
+    checkNs += elapsedNs(t1, t2);
+    rounds++;
+  } while ((insertNs + checkNs) < minTimeMs * 1e6 && rounds < 1000);
+  Sink = hits;
+
+  P.nsInsert = population ? insertNs / (rounds * population) : 0.0;
+  P.nsCheck = probes ? checkNs / (rounds * probes) : 0.0;
+  return P;
+}
+
+/// Output ===================================================================
+
+std::string jsonString(const std::string &s) {
+  std::string r = "\"";
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '"' || s[i] == '\\')
+      r += '\\';
+    r += s[i];
+  }
+  return r + "\"";
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --filter=<substr>   only run signatures whose name contains substr\n"
+          "  --trace=<file>      add a recorded trace (-record-trace output, or\n"
+          "                      one hex address per line)\n"
+          "  --populations=a,b   population sizes to measure\n"
+          "  --probes=<n>        probe addresses per measurement (default 8192)\n"
+          "  --min-time-ms=<t>   minimum timing per point (default 10)\n"
+          "  --list              list the signatures and exit\n"
+          "  -o <file>           write the JSON report to file (default stdout)\n",
+          argv0);
+}
+
+bool parseOptions(int argc, char **argv, Options &O) {
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a.compare(0, 9, "--filter=") == 0)
+      O.filter = a.substr(9);
+    else if (a.compare(0, 8, "--trace=") == 0)
+      O.traces.push_back(a.substr(8));
+    else if (a.compare(0, 14, "--populations=") == 0) {
+      O.populations.clear();
+      std::string l = a.substr(14);
+      size_t pos = 0;
+      while (pos < l.size()) {
+        size_t comma = l.find(',', pos);
+        if (comma == std::string::npos)
+          comma = l.size();
+        O.populations.push_back(strtoul(l.substr(pos, comma - pos).c_str(),
+                                        NULL, 10));
+        pos = comma + 1;
+      }
+    } else if (a.compare(0, 9, "--probes=") == 0)
+      O.probes = strtoul(a.c_str() + 9, NULL, 10);
+    else if (a.compare(0, 14, "--min-time-ms=") == 0)
+      O.minTimeMs = strtod(a.c_str() + 14, NULL);
+    else if (a == "--list")
+      O.list = true;
+    else if (a == "-o" && i + 1 < argc)
+      O.output = argv[++i];
+    else {
+      usage(argv[0]);
+      return false;
+    }
+  }
+  std::sort(O.populations.begin(), O.populations.end());
+  return !O.populations.empty();
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+  Options O;
+  if (!parseOptions(argc, argv, O))
+    return 1;
+
+  if (O.list) {
+    for (size_t i = 0; i < NumSignatures; i++)
+      printf("%s\t%s\t%u\n", Signatures[i].name, Signatures[i].kind,
+             Signatures[i].bits);
+    return 0;
+  }
+
+  size_t maxPop = O.populations.back();
+  size_t n = maxPop + O.probes;
+  std::mt19937_64 rng(42);
+
+  std::vector<Stream> streams;
+  streams.push_back(makeStrided(n, 4));
+  streams.push_back(makeStrided(n, 8));
+  streams.push_back(makeStrided(n, 64));
+  streams.push_back(makeRandom(n, rng));
+  streams.push_back(makePointerChase(n, rng));
+  streams.push_back(makeStructField(n));
+  for (size_t i = 0; i < O.traces.size(); i++) {
+    Stream S;
+    if (!readTrace(O.traces[i], S))
+      return 1;
+    streams.push_back(S);
+  }
+
+  FILE *out = stdout;
+  if (!O.output.empty() && !(out = fopen(O.output.c_str(), "w"))) {
+    fprintf(stderr, "ddp-sigbench: cannot write %s\n", O.output.c_str());
+    return 1;
+  }
+
+  fprintf(out, "{\n  \"benchmark\": \"ddp-sigbench\",\n");
+  fprintf(out, "  \"probes\": %zu,\n  \"results\": [", O.probes);
+  bool firstSig = true;
+  for (size_t s = 0; s < NumSignatures; s++) {
+    BenchSignature &B = Signatures[s];
+    if (!O.filter.empty() && std::string(B.name).find(O.filter) ==
+        std::string::npos)
+      continue;
+
+    int64_t bytes = B.size();
+    fprintf(out, "%s\n    {\n      \"signature\": %s,\n      \"kind\": %s,\n"
+            "      \"bits\": %u,\n", firstSig ? "" : ",",
+            jsonString(B.name).c_str(), jsonString(B.kind).c_str(), B.bits);
+    if (bytes > 0)
+      fprintf(out, "      \"memory_bytes\": %lld,\n", (long long)bytes);
+    else
+      fprintf(out, "      \"memory_bytes\": null,\n");
+    fprintf(out, "      \"streams\": [");
+    firstSig = false;
+
+    for (size_t t = 0; t < streams.size(); t++) {
+      Stream &S = streams[t];
+      // Recorded traces may be short: keep half of the trace for probes.
+      size_t probes = std::min(O.probes, S.addrs.size() / 2);
+      fprintf(out, "%s\n        { \"stream\": %s, \"points\": [",
+              t ? "," : "", jsonString(S.name).c_str());
+      bool firstPoint = true;
+      for (size_t p = 0; p < O.populations.size(); p++) {
+        size_t pop = O.populations[p];
+        if (pop + probes > S.addrs.size())
+          break;
+        Point P = measure(B, S, pop, probes, O.minTimeMs);
+        fprintf(out, "%s\n          { \"population\": %zu, "
+                "\"ns_per_insert\": %.3f, \"ns_per_check\": %.3f, "
+                "\"false_positive_rate\": %.6f, \"false_negatives\": %zu }",
+                firstPoint ? "" : ",", P.population, P.nsInsert, P.nsCheck,
+                P.fpr, P.falseNegatives);
+        firstPoint = false;
+      }
+      fprintf(out, "\n        ] }");
+    }
+    fprintf(out, "\n      ]\n    }");
+    fflush(out);
+  }
+  fprintf(out, "\n  ]\n}\n");
+
+  if (out != stdout)
+    fclose(out);
+  for (size_t i = 0; i < Allocations.size(); i++)
+    free(Allocations[i]);
+  return 0;
+}
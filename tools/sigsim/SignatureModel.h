@@ -0,0 +1,564 @@
+//===- SignatureModel.h - C++ mirrors of the generated signatures -*- C++ -*-===//
+//
+// Plain C++ models of the signatures that BuildSignature.cpp emits as IR.
+// They are used by ddp-sigsim to replay address traces against many
+// configurations without rebuilding the instrumented program.
+//
+// Every model must set and test exactly the same bits as the IR for the same
+// address, so any change to HashBuilderFactory, SImpleFactory or the
+// Simple/Array/Banked/RangeAndBanked signatures must be mirrored here.
+//
+// All signatures reduce to one or more banks of bits, each indexed by its own
+// hash of the address. The original hashes see the address truncated to 32
+// bits (the IR does a ptrtoint to i32); the *64 hashes see all of it:
+//
+//   SimpleSignature(N, h)         one bank of N bits
+//   ArraySignature(32, L, h)      one bank of 32*L bits
+//   BankedSignature(n, 32, L)     n banks of 32*L bits; bank i uses
+//                                 CreateXorIndex(2 + i*log2(32*L), 32*L-1),
+//                                 a shifted fold or a per-bank seed
+//   RangeAndBankedSignature       BankedSignature plus a [min,max] range
+//   BlockedSignature(B, k)        k "banks" sharing one array of B 512-bit
+//                                 blocks; all k bits land in one block
+//
+// An address is a member if its bit is set in every bank (and, for hybrid
+// signatures, it lies within the range).
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DDP_SIGNATURE_MODEL_H
+#define DDP_SIGNATURE_MODEL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "HashConstants.h"
+
+namespace sigsim {
+
+/// HashModel - mirrors one HashBuilderFactory hash.
+struct HashModel {
+  enum Kind {
+    ShiftMask,    // CreateShiftMaskIndex(shift, mask)
+    Knuth,        // CreateKnuthIndex(shift, mask)
+    Xor,          // CreateXorIndex(shift, mask)
+    XorUDiv,      // CreateXorIndex(shift, mask, UDiv, arg)
+    StructField,  // the extra bank hash of CreateDynStructSignature(arg)
+    MultiplyShift64, // CreateMultiplyShiftIndex64(shift, mask, seed)
+    Tabulation64, // CreateTabulationIndex64(shift, mask, seed)
+    Fold64,       // CreateFoldIndex64(shift, mask)
+    DoubleHash64, // bank arg of DoubleHashSignature(seed): h1 + arg*h2
+    Blocked64     // bit arg of BlockedSignature(seed); mask+1 total bits
+  };
+
+  Kind kind;
+  unsigned shift;
+  uint32_t mask;
+  uint32_t arg;
+  uint64_t seed;
+  std::shared_ptr<std::vector<uint32_t> > tables;  // Tabulation64 only
+
+  HashModel(Kind k, unsigned s, uint32_t m, uint32_t a = 0, uint64_t sd = 0)
+      : kind(k), shift(s), mask(m), arg(a), seed(sd) {
+    if (kind == Tabulation64) {
+      tables.reset(new std::vector<uint32_t>(ddphash::TabulationBytes * 256));
+      for (unsigned b = 0; b < ddphash::TabulationBytes; b++)
+        for (unsigned i = 0; i < 256; i++)
+          (*tables)[b * 256 + i] = ddphash::tabulationEntry(seed, b, i);
+    }
+  }
+
+  uint32_t operator()(uint64_t addr) const {
+    uint32_t v = (uint32_t)addr;
+    switch (kind) {
+    case ShiftMask:
+      return (v >> shift) & mask;
+    case Knuth:
+      return ((v >> shift) * 2654435761u) & mask;
+    case XorUDiv:
+      v /= arg;
+      // fall through
+    case Xor:
+      v = v ^ ((v & 0xFF000000u) >> 24) ^ ((v & 0xFFu) << 24);
+      return (v >> shift) & mask;
+    case StructField:
+      v %= arg;
+      if (arg > 256) {
+        if (arg > 256 * 4)
+          v ^= (v & 0x3FC00u) >> 8;
+        v >>= 2;
+        // The extra bank has 256 bits once the struct is over 1K.
+        if (arg > 256 * 4)
+          v &= 0xFF;
+      }
+      return v;
+    case MultiplyShift64: {
+      unsigned bits = maskBits();
+      if (!bits)
+        return 0;
+      return (uint32_t)(((addr >> shift) * seed) >> (64 - bits));
+    }
+    case Tabulation64: {
+      uint64_t x = addr >> shift;
+      unsigned nBytes = (64 - shift + 7) / 8;
+      uint32_t h = 0;
+      for (unsigned i = 0; i < nBytes; i++)
+        h ^= (*tables)[i * 256 + ((x >> (8 * i)) & 0xFF)];
+      return h & mask;
+    }
+    case Fold64: {
+      uint64_t x = addr >> shift;
+      x ^= x >> 32;
+      x ^= x >> 16;
+      return (uint32_t)x & mask;
+    }
+    case DoubleHash64: {
+      unsigned bits = maskBits();
+      uint64_t x = (addr >> shift) * seed;
+      uint32_t h1 = (uint32_t)(x >> (64 - bits));
+      uint32_t h2 = (uint32_t)(x >> (64 - 2 * bits)) | 1;
+      return (h1 + arg * h2) & mask;
+    }
+    case Blocked64: {
+      unsigned blockBits = maskBits() - 9;
+      uint64_t x = (addr >> shift) * seed;
+      uint32_t block = blockBits ? (uint32_t)(x >> (64 - blockBits)) : 0;
+      uint32_t bit = (uint32_t)(x >> (64 - blockBits - 9 * (arg + 1))) & 511;
+      return block * 512 + bit;
+    }
+    }
+    return 0;
+  }
+
+  unsigned maskBits() const {
+    unsigned bits = 0;
+    while (mask >> bits)
+      ++bits;
+    return bits;
+  }
+
+  /// Rough number of IR operations the hash costs.
+  unsigned ops() const {
+    switch (kind) {
+    case ShiftMask:   return 2;
+    case Knuth:       return 3;
+    case Xor:         return 8;
+    case XorUDiv:     return 8 + 20;
+    case StructField: return 20 + (arg > 256 ? 1 : 0) + (arg > 1024 ? 4 : 0);
+    case MultiplyShift64: return 4;
+    case Tabulation64: return 1 + 5 * ((64 - shift + 7) / 8);
+    case Fold64:      return 6;
+    // The multiply is shared; each further bank adds h2 and masks.
+    case DoubleHash64: return arg == 0 ? 7 : 2;
+    // Block pointer once, then a splat/compare/select per bit.
+    case Blocked64:   return (arg == 0 ? 5 : 0) + 9;
+    }
+    return 0;
+  }
+
+  std::string getName() const {
+    switch (kind) {
+    case ShiftMask:   return "shiftmask";
+    case Knuth:       return "knuth";
+    case Xor:         return "xor";
+    case XorUDiv:     return "xor/" + std::to_string(arg);
+    case StructField: return "field%" + std::to_string(arg);
+    case MultiplyShift64: return "mulshift64";
+    case Tabulation64: return "tab64";
+    case Fold64:      return "fold64";
+    case DoubleHash64: return "doublehash64";
+    case Blocked64:   return "blocked64";
+    }
+    return "";
+  }
+};
+
+struct BankModel {
+  HashModel hash;
+  unsigned bits;
+
+  BankModel(const HashModel &h, unsigned b) : hash(h), bits(b) {}
+};
+
+/// SignatureModel - one signature configuration.
+struct SignatureModel {
+  std::string name;       // e.g. accurate_1024
+  std::string impl;       // name of the SImple it mirrors
+  std::string kind;       // fast, accurate, hybrid, dynstruct or banked
+  unsigned requestedBits; // -signsize that selects it (0 if not a preset)
+  std::vector<BankModel> banks;
+  bool range;             // RangeAndBankedSignature
+  bool shared;            // BlockedSignature: every bank is the same array
+  bool predicated;        // checks use select rather than branches
+
+  SignatureModel()
+      : requestedBits(0), range(false), shared(false), predicated(true) {}
+
+  unsigned totalBits() const {
+    if (shared)
+      return banks.empty() ? 0 : banks[0].bits;
+    unsigned b = 0;
+    for (size_t i = 0; i < banks.size(); i++)
+      b += banks[i].bits;
+    return b;
+  }
+
+  unsigned memoryBytes() const {
+    return totalBits() / 8 + (range ? 8 : 0);
+  }
+
+  /// Estimated cost, in IR operations, of one insert.
+  double insertCost() const {
+    double c = range ? 6 : 0;
+    for (size_t i = 0; i < banks.size(); i++)
+      c += banks[i].hash.ops() + wordOps(banks[i]) + 1;
+    return shared ? c - (banks.size() - 1) * 4 : c;
+  }
+
+  /// Estimated cost of one check that reaches the banks.
+  double checkCost() const {
+    double c = banks.size() - 1;
+    for (size_t i = 0; i < banks.size(); i++)
+      c += banks[i].hash.ops() + wordOps(banks[i]) + 1;
+    // A blocked check is one vector load, and, compare and reduce.
+    return shared ? c - (banks.size() - 1) * 5 + 2 : c;
+  }
+
+  /// Estimated cost of the range test that guards hybrid checks.
+  double rangeCost() const { return range ? 5 : 0; }
+
+  /// Estimated cost of (re)allocating the signature in a new region.
+  double allocCost() const {
+    return 2 + std::ceil(memoryBytes() / 32.0) + (range ? 2 : 0);
+  }
+
+ private:
+  // Load, modify and store one bank word. SimpleSignatures wider than 64
+  // bits are lowered to an array of i64 words, so they do the same.
+  double wordOps(const BankModel &) const {
+    return 3;
+  }
+};
+
+/// SignatureState - the contents of one live signature.
+class SignatureState {
+  const SignatureModel *M;
+  std::vector<uint32_t> words;
+  std::vector<unsigned> bankWord;  // first word of each bank
+  uint32_t minAddr, maxAddr;
+
+ public:
+  explicit SignatureState(const SignatureModel &aM) : M(&aM) {
+    unsigned w = 0;
+    for (size_t i = 0; i < M->banks.size(); i++) {
+      bankWord.push_back(M->shared ? 0 : w);
+      if (!M->shared || i == 0)
+        w += (M->banks[i].bits + 31) / 32;
+    }
+    words.resize(w);
+    clear();
+  }
+
+  void clear() {
+    if (!words.empty())
+      memset(&words[0], 0, words.size() * sizeof(uint32_t));
+    minAddr = 0xFFFFFFFFu;
+    maxAddr = 0;
+  }
+
+  void insert(uint64_t addr) {
+    uint32_t a = (uint32_t)addr;
+    if (M->range) {
+      if (a < minAddr)
+        minAddr = a;
+      if (a > maxAddr)
+        maxAddr = a;
+    }
+    for (size_t i = 0; i < M->banks.size(); i++) {
+      uint32_t bit = index(i, addr);
+      words[bankWord[i] + (bit >> 5)] |= 1u << (bit & 31);
+    }
+  }
+
+  bool inRange(uint64_t addr) const {
+    uint32_t a = (uint32_t)addr;
+    return !M->range || (a >= minAddr && a <= maxAddr);
+  }
+
+  bool check(uint64_t addr) const {
+    if (!inRange(addr))
+      return false;
+    for (size_t i = 0; i < M->banks.size(); i++) {
+      uint32_t bit = index(i, addr);
+      if (!(words[bankWord[i] + (bit >> 5)] & (1u << (bit & 31))))
+        return false;
+    }
+    return true;
+  }
+
+ private:
+  uint32_t index(size_t bank, uint64_t a) const {
+    return M->banks[bank].hash(a);
+  }
+};
+
+/// Builders mirroring the SImple constructors =================================
+
+inline unsigned log2Floor(unsigned v) {
+  unsigned l = 0;
+  while (v >>= 1)
+    ++l;
+  return l;
+}
+
+inline void addSimple(SignatureModel &S, unsigned numBits, const HashModel &h) {
+  S.impl = "SimpleSignature" + std::to_string(numBits);
+  S.banks.push_back(BankModel(h, numBits));
+}
+
+inline void addArray(SignatureModel &S, unsigned length, const HashModel &h) {
+  S.impl = "ArraySignature_32_" + std::to_string(length);
+  S.banks.push_back(BankModel(h, 32 * length));
+}
+
+// BankedSignature(nBanks, 32, length).
+inline void addBanked(SignatureModel &S, unsigned nBanks, unsigned length) {
+  unsigned targetlevel = log2Floor(32 * length);
+  unsigned offset = 2;
+  uint32_t mask = (1u << targetlevel) - 1;
+  for (unsigned i = 0; i < nBanks; i++) {
+    S.banks.push_back(BankModel(HashModel(HashModel::Xor, offset, mask),
+                                32 * length));
+    offset += targetlevel;
+  }
+  S.impl = "BankedSignature_" + std::to_string(nBanks) + "x" +
+           std::to_string(32 * length);
+}
+
+// The bank layout SImpleFactory uses above 512 bits.
+inline void bankLayout(unsigned bits, unsigned &nBanks, unsigned &length) {
+  if (bits <= 1024) {
+    nBanks = 2; length = 16;
+  } else if (bits <= 2048) {
+    nBanks = 2; length = 32;
+  } else if (bits <= 3072) {
+    nBanks = 3; length = 32;
+  } else if (bits <= 4096) {
+    nBanks = 2; length = 64;
+  } else {
+    nBanks = 2; length = 128;
+  }
+}
+
+// BankedSignature(32, lengths, hashes) as built by CreateFoldBanked and
+// CreateMultiplyShiftBanked in BuildSignature.cpp.
+inline void addBanked64(SignatureModel &S, HashModel::Kind hash,
+                        unsigned nBanks, unsigned length) {
+  unsigned targetlevel = log2Floor(32 * length);
+  uint32_t mask = (1u << targetlevel) - 1;
+  for (unsigned i = 0; i < nBanks; i++) {
+    if (hash == HashModel::Fold64)
+      S.banks.push_back(BankModel(HashModel(hash, 2 + i * targetlevel, mask),
+                                  32 * length));
+    else
+      S.banks.push_back(BankModel(HashModel(hash, 2, mask, 0,
+                                            ddphash::multiplyShiftSeed(i)),
+                                  32 * length));
+  }
+  S.impl = "BankedSignature_" + std::to_string(nBanks) + "x" +
+           std::to_string(32 * length);
+}
+
+// DoubleHashSignature(nBanks, 32, length)
+inline void addDoubleHash(SignatureModel &S, unsigned nBanks, unsigned length) {
+  uint32_t mask = (1u << log2Floor(32 * length)) - 1;
+  for (unsigned i = 0; i < nBanks; i++)
+    S.banks.push_back(BankModel(HashModel(HashModel::DoubleHash64, 2, mask, i,
+                                          ddphash::multiplyShiftSeed(0)),
+                                32 * length));
+  S.impl = "DoubleHashSignature_" + std::to_string(nBanks) + "x" +
+           std::to_string(32 * length);
+}
+
+/// SImpleFactory::CreateFastSignature(bits)
+inline SignatureModel createFast(unsigned bits) {
+  SignatureModel S;
+  S.name = "fast_" + std::to_string(bits);
+  S.kind = "fast";
+  S.requestedBits = bits;
+  if (bits <= 32)
+    addSimple(S, 32, HashModel(HashModel::Fold64, 2, 0x1F));
+  else if (bits <= 64)
+    addSimple(S, 64, HashModel(HashModel::Fold64, 2, 0x3F));
+  else if (bits <= 128)
+    addSimple(S, 128, HashModel(HashModel::Fold64, 2, 0x7F));
+  else if (bits <= 256)
+    addSimple(S, 256, HashModel(HashModel::Fold64, 2, 0xFF));
+  else if (bits <= 512)
+    addArray(S, 16, HashModel(HashModel::Fold64, 2, 0x1FF));
+  else if (bits <= 1024)
+    addBanked64(S, HashModel::Fold64, 2, 16);
+  else if (bits <= 2048)
+    addArray(S, 64, HashModel(HashModel::Fold64, 2, 0x7FF));
+  else
+    addArray(S, 128, HashModel(HashModel::Fold64, 2, 0xFFF));
+  return S;
+}
+
+/// SImpleFactory::CreateAccurateSignature(bits)
+inline SignatureModel createAccurate(unsigned bits) {
+  SignatureModel S;
+  S.name = "accurate_" + std::to_string(bits);
+  S.kind = "accurate";
+  S.requestedBits = bits;
+  const uint64_t seed = ddphash::multiplyShiftSeed(0);
+  if (bits <= 32)
+    addSimple(S, 32, HashModel(HashModel::MultiplyShift64, 2, 0x1F, 0, seed));
+  else if (bits <= 64)
+    addSimple(S, 64, HashModel(HashModel::MultiplyShift64, 2, 0x3F, 0, seed));
+  else if (bits <= 128)
+    addSimple(S, 128, HashModel(HashModel::MultiplyShift64, 2, 0x7F, 0, seed));
+  else if (bits <= 256)
+    addSimple(S, 256, HashModel(HashModel::MultiplyShift64, 2, 0xFF, 0, seed));
+  else if (bits <= 512)
+    addArray(S, 16, HashModel(HashModel::MultiplyShift64, 2, 0x1FF, 0, seed));
+  else {
+    unsigned nBanks, length;
+    bankLayout(bits, nBanks, length);
+    addBanked64(S, HashModel::MultiplyShift64, nBanks, length);
+  }
+  return S;
+}
+
+/// SImpleFactory::CreateDoubleHashSignature(bits)
+inline SignatureModel createDoubleHash(unsigned bits) {
+  if (bits <= 512) {
+    SignatureModel S = createAccurate(bits);
+    S.name = "doublehash_" + std::to_string(bits);
+    S.kind = "doublehash";
+    return S;
+  }
+  SignatureModel S;
+  S.name = "doublehash_" + std::to_string(bits);
+  S.kind = "doublehash";
+  S.requestedBits = bits;
+  unsigned nBanks, length;
+  bankLayout(bits, nBanks, length);
+  addDoubleHash(S, nBanks, length);
+  return S;
+}
+
+/// SImpleFactory::CreateBlockedSignature(bits)
+inline SignatureModel createBlocked(unsigned bits) {
+  SignatureModel S;
+  S.name = "blocked_" + std::to_string(bits);
+  S.kind = "blocked";
+  S.requestedBits = bits;
+  unsigned numBlocks = 1;
+  while (numBlocks * 512 < bits)
+    numBlocks <<= 1;
+  unsigned k = std::min(bits > 2048 ? 6u : 4u,
+                        (64 - log2Floor(numBlocks)) / 9);
+  uint32_t mask = numBlocks * 512 - 1;
+  for (unsigned j = 0; j < k; j++)
+    S.banks.push_back(BankModel(HashModel(HashModel::Blocked64, 2, mask, j,
+                                          ddphash::multiplyShiftSeed(0)),
+                                numBlocks * 512));
+  S.shared = true;
+  S.impl = "BlockedSignature_" + std::to_string(numBlocks) + "x512_k" +
+           std::to_string(k);
+  return S;
+}
+
+/// SImpleFactory::CreateHybridSignature(bits); bits must be over 512.
+inline SignatureModel createHybrid(unsigned bits) {
+  SignatureModel S;
+  S.name = "hybrid_" + std::to_string(bits);
+  S.kind = "hybrid";
+  S.requestedBits = bits;
+  unsigned nBanks, length;
+  bankLayout(bits, nBanks, length);
+  addBanked(S, nBanks, length);
+  S.impl = "RangeAnd" + S.impl;
+  S.range = true;
+  return S;
+}
+
+/// SImpleFactory::CreateDynStructSignature(bits, structSize); bits > 512.
+inline SignatureModel createDynStruct(unsigned bits, unsigned structSize) {
+  SignatureModel S;
+  S.name = "dynstruct" + std::to_string(structSize) + "_" +
+           std::to_string(bits);
+  S.kind = "dynstruct";
+  S.requestedBits = bits;
+  unsigned nBanks, length;
+  bankLayout(bits, nBanks, length);
+
+  unsigned targetlevel = log2Floor(32 * length);
+  unsigned offset = 0;
+  uint32_t mask = (1u << targetlevel) - 1;
+  for (unsigned i = 0; i < nBanks; i++) {
+    S.banks.push_back(BankModel(HashModel(HashModel::XorUDiv, offset, mask,
+                                          structSize), 32 * length));
+    offset += targetlevel;
+  }
+
+  unsigned extra = (unsigned)std::ceil(structSize / 32.0);
+  if (extra > 8)
+    extra = 8;
+  S.banks.push_back(BankModel(HashModel(HashModel::StructField, 0, 0,
+                                        structSize), 32 * extra));
+  S.impl = "BankedSignature_" + std::to_string(nBanks + 1) + "x" +
+           std::to_string(32 * length);
+  return S;
+}
+
+/// BankedSignature(32, lengths, hashes) with nBanks equal banks, each using
+/// the given hash kind at the shifts BankedSignature(n, 32, L) would use.
+/// Returns false if a bank would need a shift of 32 or more.
+/// The 64-bit multiply-shift and tabulation hashes use one seed per bank
+/// instead of a shift, and DoubleHash64 gives a DoubleHashSignature.
+inline bool createBanked(HashModel::Kind hash, unsigned nBanks,
+                         unsigned length, SignatureModel &S) {
+  if (hash == HashModel::DoubleHash64) {
+    S = SignatureModel();
+    addDoubleHash(S, nBanks, length);
+    S.kind = "banked";
+    S.name = "banked_doublehash64_" + std::to_string(nBanks) + "x" +
+             std::to_string(32 * length);
+    return true;
+  }
+  unsigned targetlevel = log2Floor(32 * length);
+  bool seeded = hash == HashModel::MultiplyShift64 ||
+                hash == HashModel::Tabulation64;
+  unsigned limit = hash == HashModel::Fold64 ? 64 : 32;
+  if (!seeded && 2 + (nBanks - 1) * targetlevel >= limit)
+    return false;
+  S = SignatureModel();
+  uint32_t mask = (1u << targetlevel) - 1;
+  for (unsigned i = 0; i < nBanks; i++) {
+    if (seeded)
+      S.banks.push_back(BankModel(HashModel(hash, 2, mask, 0,
+                                            ddphash::multiplyShiftSeed(i)),
+                                  32 * length));
+    else
+      S.banks.push_back(BankModel(HashModel(hash, 2 + i * targetlevel, mask),
+                                  32 * length));
+  }
+  S.kind = "banked";
+  S.name = "banked_" + S.banks[0].hash.getName() + "_" +
+           std::to_string(nBanks) + "x" + std::to_string(32 * length);
+  S.impl = "BankedSignature_" + std::to_string(nBanks) + "x" +
+           std::to_string(32 * length);
+  return true;
+}
+
+} // end namespace sigsim
+
+#endif // DDP_SIGNATURE_MODEL_H
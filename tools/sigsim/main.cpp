@@ -0,0 +1,539 @@
+//===- main.cpp - ddp-sigsim: replay address traces against signatures ----===//
+//
+// Replays an address trace recorded with -record-trace (see
+// lib/runtime/TraceSet.cpp) against a matrix of signature configurations and
+// reports, as JSON:
+//
+//   per configuration   - false positive rate, false negatives (must be 0),
+//                         memory and an estimated instrumentation cost
+//   per refid           - the recommended configuration: the cheapest one
+//                         whose false positive rate is within --max-fpr, or
+//                         the most accurate one if none is
+//
+// Each recorded set is replayed exactly as the instrumented program used it:
+// stores are inserts, loads are membership checks and a region record clears
+// the set, per thread. The signatures are C++ models that set the same bits
+// as the IR BuildSignature.cpp emits (SignatureModel.h), so no rebuild of the
+// program is needed to try a configuration.
+//
+// The configurations are split across worker threads; each worker decodes
+// the trace once for its share and keeps its own exact reference sets.
+//
+// The cost estimate counts IR operations per insert, check and allocation,
+// weighted by how often the trace performs each. It is only meant to rank
+// configurations; ddp-sigbench measures actual throughput.
+//
+//===----------------------------------------------------------------------===//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "TraceFormat.h"
+#include "SignatureModel.h"
+
+using namespace sigsim;
+
+namespace {
+
+struct Options {
+  std::string trace;
+  std::string output;
+  std::string filter;
+  std::vector<std::string> kinds;
+  std::vector<unsigned> sizes;
+  std::vector<unsigned> structSizes;
+  unsigned threads;
+  double maxFpr;
+  bool list;
+
+  Options() : threads(0), maxFpr(0.01), list(false) {
+    const char *k[] = { "fast", "accurate", "doublehash", "blocked", "hybrid",
+                        "dynstruct", "banked" };
+    kinds.assign(k, k + sizeof(k) / sizeof(k[0]));
+    unsigned s[] = { 32, 64, 128, 256, 512, 1024, 2048, 3072, 4096, 8192 };
+    sizes.assign(s, s + sizeof(s) / sizeof(s[0]));
+    structSizes.push_back(24);
+  }
+
+  bool wants(const std::string &kind) const {
+    return std::find(kinds.begin(), kinds.end(), kind) != kinds.end();
+  }
+};
+
+/// Configuration matrix =====================================================
+
+void buildMatrix(const Options &O, std::vector<SignatureModel> &configs) {
+  for (size_t i = 0; i < O.sizes.size(); i++) {
+    unsigned bits = O.sizes[i];
+    if (O.wants("fast"))
+      configs.push_back(createFast(bits));
+    if (O.wants("accurate"))
+      configs.push_back(createAccurate(bits));
+    if (O.wants("doublehash"))
+      configs.push_back(createDoubleHash(bits));
+    if (O.wants("blocked"))
+      configs.push_back(createBlocked(bits));
+    // Hybrid and struct signatures are only defined for banked sizes.
+    if (bits <= 512)
+      continue;
+    if (O.wants("hybrid"))
+      configs.push_back(createHybrid(bits));
+    if (O.wants("dynstruct"))
+      for (size_t s = 0; s < O.structSizes.size(); s++)
+        configs.push_back(createDynStruct(bits, O.structSizes[s]));
+  }
+
+  if (O.wants("banked")) {
+    const HashModel::Kind hashes[] = { HashModel::Xor, HashModel::Knuth,
+                                       HashModel::ShiftMask,
+                                       HashModel::MultiplyShift64,
+                                       HashModel::Tabulation64,
+                                       HashModel::Fold64,
+                                       HashModel::DoubleHash64 };
+    const unsigned numHashes = sizeof(hashes) / sizeof(hashes[0]);
+    const unsigned lengths[] = { 16, 32, 64, 128 };
+    for (unsigned h = 0; h < numHashes; h++)
+      for (unsigned nBanks = 1; nBanks <= 4; nBanks++)
+        for (unsigned l = 0; l < 4; l++) {
+          SignatureModel S;
+          if (createBanked(hashes[h], nBanks, lengths[l], S))
+            configs.push_back(S);
+        }
+  }
+
+  if (!O.filter.empty()) {
+    std::vector<SignatureModel> kept;
+    for (size_t i = 0; i < configs.size(); i++)
+      if (configs[i].name.find(O.filter) != std::string::npos)
+        kept.push_back(configs[i]);
+    configs.swap(kept);
+  }
+}
+
+// The ddp options that select a preset configuration.
+std::string flagsFor(const SignatureModel &S) {
+  std::string size = " -signsize=" + std::to_string(S.requestedBits);
+  if (S.kind == "fast")
+    return "-signinstr -fastsign" + size;
+  if (S.kind == "accurate")
+    return "-signinstr" + size;
+  if (S.kind == "doublehash")
+    return "-signinstr -double-hash-sign" + size;
+  if (S.kind == "blocked")
+    return "-signinstr -blocked-sign" + size;
+  if (S.kind == "hybrid")
+    return "-signinstr -hybrid" + size;
+  if (S.kind == "dynstruct")
+    return "-signinstr -struct-size-based-sign" + size;
+  return "";
+}
+
+/// Replay ===================================================================
+
+/// Counters for one refid, for the configurations of one worker.
+struct RefStats {
+  uint64_t inserts, checks, regions, negatives;
+  std::vector<uint64_t> falsePositives;
+  std::vector<uint64_t> falseNegatives;
+  std::vector<uint64_t> inRange;  // checks that passed the range test
+
+  RefStats() : inserts(0), checks(0), regions(0), negatives(0) {}
+
+  void resize(size_t n) {
+    falsePositives.resize(n);
+    falseNegatives.resize(n);
+    inRange.resize(n);
+  }
+};
+
+/// One live set: the exact reference and every modelled signature.
+struct LiveSet {
+  std::unordered_set<uint64_t> exact;
+  std::vector<SignatureState> sigs;
+};
+
+struct Worker {
+  std::vector<const SignatureModel*> configs;
+  std::vector<size_t> ids;               // index of each config in the matrix
+  std::map<int32_t, RefStats> refs;
+  uint64_t records;
+  bool ok;
+
+  Worker() : records(0), ok(true) {}
+
+  void run(const std::string &file) {
+    ddptrace::TraceReader R;
+    if (!R.open(file.c_str())) {
+      ok = false;
+      return;
+    }
+
+    std::unordered_map<uint64_t, LiveSet> live;
+    uint64_t lastKey = ~0ULL;
+    LiveSet *L = NULL;
+    int32_t lastRef = 0;
+    RefStats *RS = NULL;
+    const size_t n = configs.size();
+
+    ddptrace::Record rec;
+    while (R.next(rec)) {
+      records++;
+      uint64_t key = ((uint64_t)rec.thread << 32) | (uint32_t)rec.refid;
+      if (key != lastKey) {
+        std::unordered_map<uint64_t, LiveSet>::iterator it = live.find(key);
+        if (it == live.end()) {
+          it = live.insert(std::make_pair(key, LiveSet())).first;
+          for (size_t c = 0; c < n; c++)
+            it->second.sigs.push_back(SignatureState(*configs[c]));
+        }
+        L = &it->second;
+        lastKey = key;
+      }
+      if (!RS || rec.refid != lastRef) {
+        RS = &refs[rec.refid];
+        RS->resize(n);
+        lastRef = rec.refid;
+      }
+
+      switch (rec.kind) {
+      case ddptrace::TRACE_REGION:
+        RS->regions++;
+        L->exact.clear();
+        for (size_t c = 0; c < n; c++)
+          L->sigs[c].clear();
+        break;
+      case ddptrace::TRACE_STORE:
+        RS->inserts++;
+        L->exact.insert(rec.addr);
+        for (size_t c = 0; c < n; c++)
+          L->sigs[c].insert(rec.addr);
+        break;
+      case ddptrace::TRACE_LOAD: {
+        RS->checks++;
+        bool member = L->exact.count(rec.addr) != 0;
+        if (!member)
+          RS->negatives++;
+        for (size_t c = 0; c < n; c++) {
+          SignatureState &S = L->sigs[c];
+          if (!S.inRange(rec.addr))
+            continue;
+          RS->inRange[c]++;
+          bool hit = S.check(rec.addr);
+          if (hit && !member)
+            RS->falsePositives[c]++;
+          else if (!hit && member)
+            RS->falseNegatives[c]++;
+        }
+        break;
+      }
+      }
+    }
+    if (R.isCorrupt())
+      fprintf(stderr, "ddp-sigsim: warning: trace %s is truncated or "
+              "corrupt, results cover the first %llu records\n", file.c_str(),
+              (unsigned long long)records);
+    if (R.droppedEvents())
+      fprintf(stderr, "ddp-sigsim: warning: trace %s lost %u events at "
+              "exit\n", file.c_str(), R.droppedEvents());
+  }
+};
+
+/// Results ==================================================================
+
+struct Outcome {
+  uint64_t inserts, checks, regions, negatives;
+  uint64_t falsePositives, falseNegatives, inRange;
+
+  Outcome() : inserts(0), checks(0), regions(0), negatives(0),
+              falsePositives(0), falseNegatives(0), inRange(0) {}
+
+  double fpr() const {
+    return negatives ? (double)falsePositives / negatives : 0.0;
+  }
+
+  // Predicated (select based) checks evaluate the banks whatever the range
+  // test says; branching ones only for checks that pass it.
+  double cost(const SignatureModel &S) const {
+    return regions * S.allocCost() + inserts * S.insertCost() +
+           checks * S.rangeCost() +
+           (S.predicated ? checks : inRange) * S.checkCost();
+  }
+};
+
+// Index of the recommended configuration for the given outcomes.
+size_t recommend(const std::vector<SignatureModel> &configs,
+                 const std::vector<Outcome> &out, double maxFpr) {
+  size_t best = 0;
+  bool bestMeets = false;
+  for (size_t c = 0; c < configs.size(); c++) {
+    bool meets = out[c].falseNegatives == 0 && out[c].fpr() <= maxFpr;
+    double cost = out[c].cost(configs[c]);
+    double bestCost = out[best].cost(configs[best]);
+    bool better;
+    if (meets != bestMeets)
+      better = meets;
+    else if (meets)
+      better = cost < bestCost ||
+               (cost == bestCost &&
+                configs[c].memoryBytes() < configs[best].memoryBytes());
+    else
+      better = out[c].fpr() < out[best].fpr() ||
+               (out[c].fpr() == out[best].fpr() && cost < bestCost);
+    if (c == 0 || better) {
+      best = c;
+      bestMeets = meets;
+    }
+  }
+  return best;
+}
+
+std::string jsonString(const std::string &s) {
+  std::string r = "\"";
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '"' || s[i] == '\\')
+      r += '\\';
+    r += s[i];
+  }
+  return r + "\"";
+}
+
+void printChoice(FILE *out, const SignatureModel &S, const Outcome &O,
+                 double maxFpr) {
+  std::string flags = flagsFor(S);
+  fprintf(out, "{ \"config\": %s, \"false_positive_rate\": %.6f, "
+          "\"est_cost\": %.0f, \"meets_max_fpr\": %s, \"flags\": %s }",
+          jsonString(S.name).c_str(), O.fpr(), O.cost(S),
+          O.falseNegatives == 0 && O.fpr() <= maxFpr ? "true" : "false",
+          flags.empty() ? "null" : jsonString(flags).c_str());
+}
+
+/// Options ==================================================================
+
+template <typename T>
+std::vector<T> parseList(const std::string &l) {
+  std::vector<T> r;
+  size_t pos = 0;
+  while (pos < l.size()) {
+    size_t comma = l.find(',', pos);
+    if (comma == std::string::npos)
+      comma = l.size();
+    r.push_back((T)strtoul(l.substr(pos, comma - pos).c_str(), NULL, 10));
+    pos = comma + 1;
+  }
+  return r;
+}
+
+std::vector<std::string> parseNames(const std::string &l) {
+  std::vector<std::string> r;
+  size_t pos = 0;
+  while (pos < l.size()) {
+    size_t comma = l.find(',', pos);
+    if (comma == std::string::npos)
+      comma = l.size();
+    r.push_back(l.substr(pos, comma - pos));
+    pos = comma + 1;
+  }
+  return r;
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options] <trace>\n"
+          "  --kinds=a,b          signature kinds to try (default fast,accurate,\n"
+          "                       doublehash,blocked,hybrid,dynstruct,banked)\n"
+          "  --sizes=a,b          -signsize values for the factory kinds\n"
+          "  --struct-sizes=a,b   struct sizes for dynstruct (default 24)\n"
+          "  --filter=<substr>    only configurations whose name contains substr\n"
+          "  --max-fpr=<rate>     accuracy target for recommendations (0.01)\n"
+          "  --threads=<n>        worker threads (default: all cores)\n"
+          "  --list               list the configurations and exit\n"
+          "  -o <file>            write the JSON report to file (default stdout)\n",
+          argv0);
+}
+
+bool parseOptions(int argc, char **argv, Options &O) {
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a.compare(0, 8, "--kinds=") == 0)
+      O.kinds = parseNames(a.substr(8));
+    else if (a.compare(0, 8, "--sizes=") == 0)
+      O.sizes = parseList<unsigned>(a.substr(8));
+    else if (a.compare(0, 15, "--struct-sizes=") == 0)
+      O.structSizes = parseList<unsigned>(a.substr(15));
+    else if (a.compare(0, 9, "--filter=") == 0)
+      O.filter = a.substr(9);
+    else if (a.compare(0, 10, "--max-fpr=") == 0)
+      O.maxFpr = strtod(a.c_str() + 10, NULL);
+    else if (a.compare(0, 10, "--threads=") == 0)
+      O.threads = strtoul(a.c_str() + 10, NULL, 10);
+    else if (a == "--list")
+      O.list = true;
+    else if (a == "-o" && i + 1 < argc)
+      O.output = argv[++i];
+    else if (a[0] != '-' && O.trace.empty())
+      O.trace = a;
+    else {
+      usage(argv[0]);
+      return false;
+    }
+  }
+  for (size_t i = 0; i < O.structSizes.size(); i++)
+    if (!O.structSizes[i]) {
+      fprintf(stderr, "ddp-sigsim: struct sizes must be non-zero\n");
+      return false;
+    }
+  if (O.trace.empty() && !O.list) {
+    usage(argv[0]);
+    return false;
+  }
+  return true;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+  Options O;
+  if (!parseOptions(argc, argv, O))
+    return 1;
+
+  std::vector<SignatureModel> configs;
+  buildMatrix(O, configs);
+  if (configs.empty()) {
+    fprintf(stderr, "ddp-sigsim: no configurations selected\n");
+    return 1;
+  }
+
+  if (O.list) {
+    for (size_t i = 0; i < configs.size(); i++)
+      printf("%s\t%s\t%u bytes\n", configs[i].name.c_str(),
+             configs[i].impl.c_str(), configs[i].memoryBytes());
+    return 0;
+  }
+
+  unsigned threads = O.threads ? O.threads : std::thread::hardware_concurrency();
+  if (!threads)
+    threads = 1;
+  if (threads > configs.size())
+    threads = configs.size();
+
+  // Deal configurations out largest first, so each worker gets a similar
+  // amount of signature state to update.
+  std::vector<size_t> order(configs.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return configs[a].banks.size() > configs[b].banks.size();
+  });
+  std::vector<Worker> workers(threads);
+  for (size_t i = 0; i < order.size(); i++) {
+    Worker &W = workers[i % threads];
+    W.configs.push_back(&configs[order[i]]);
+    W.ids.push_back(order[i]);
+  }
+
+  std::vector<std::thread> pool;
+  for (unsigned t = 0; t < threads; t++)
+    pool.push_back(std::thread(&Worker::run, &workers[t], O.trace));
+  for (unsigned t = 0; t < threads; t++)
+    pool[t].join();
+
+  for (unsigned t = 0; t < threads; t++)
+    if (!workers[t].ok) {
+      fprintf(stderr, "ddp-sigsim: cannot read trace %s\n", O.trace.c_str());
+      return 1;
+    }
+
+  // Gather the per-refid outcome of every configuration. The event counts
+  // are the same in every worker.
+  std::map<int32_t, std::vector<Outcome> > byRef;
+  std::vector<Outcome> total(configs.size());
+  for (size_t w = 0; w < workers.size(); w++) {
+    Worker &W = workers[w];
+    std::map<int32_t, RefStats>::iterator i, e = W.refs.end();
+    for (i = W.refs.begin(); i != e; ++i) {
+      std::vector<Outcome> &out = byRef[i->first];
+      out.resize(configs.size());
+      for (size_t c = 0; c < W.configs.size(); c++) {
+        Outcome &Oc = out[W.ids[c]];
+        Oc.inserts = i->second.inserts;
+        Oc.checks = i->second.checks;
+        Oc.regions = i->second.regions;
+        Oc.negatives = i->second.negatives;
+        Oc.falsePositives = i->second.falsePositives[c];
+        Oc.falseNegatives = i->second.falseNegatives[c];
+        Oc.inRange = i->second.inRange[c];
+
+        Outcome &T = total[W.ids[c]];
+        T.inserts += Oc.inserts;
+        T.checks += Oc.checks;
+        T.regions += Oc.regions;
+        T.negatives += Oc.negatives;
+        T.falsePositives += Oc.falsePositives;
+        T.falseNegatives += Oc.falseNegatives;
+        T.inRange += Oc.inRange;
+      }
+    }
+  }
+
+  FILE *out = stdout;
+  if (!O.output.empty() && !(out = fopen(O.output.c_str(), "w"))) {
+    fprintf(stderr, "ddp-sigsim: cannot write %s\n", O.output.c_str());
+    return 1;
+  }
+
+  fprintf(out, "{\n  \"tool\": \"ddp-sigsim\",\n  \"trace\": %s,\n"
+          "  \"records\": %llu,\n  \"max_fpr\": %g,\n  \"configs\": [",
+          jsonString(O.trace).c_str(),
+          (unsigned long long)workers[0].records, O.maxFpr);
+  for (size_t c = 0; c < configs.size(); c++) {
+    const SignatureModel &S = configs[c];
+    const Outcome &T = total[c];
+    uint64_t events = T.inserts + T.checks + T.regions;
+    fprintf(out, "%s\n    { \"config\": %s, \"impl\": %s, \"kind\": %s, "
+            "\"memory_bytes\": %u, \"hashes\": [", c ? "," : "",
+            jsonString(S.name).c_str(), jsonString(S.impl).c_str(),
+            jsonString(S.kind).c_str(), S.memoryBytes());
+    for (size_t b = 0; b < S.banks.size(); b++)
+      fprintf(out, "%s%s", b ? ", " : "",
+              jsonString(S.banks[b].hash.getName()).c_str());
+    fprintf(out, "],\n      \"false_positive_rate\": %.6f, "
+            "\"false_negatives\": %llu, \"est_cost\": %.0f, "
+            "\"est_cost_per_event\": %.2f }",
+            T.fpr(), (unsigned long long)T.falseNegatives, T.cost(S),
+            events ? T.cost(S) / events : 0.0);
+  }
+
+  fprintf(out, "\n  ],\n  \"refids\": [");
+  bool first = true;
+  std::map<int32_t, std::vector<Outcome> >::iterator i, e = byRef.end();
+  for (i = byRef.begin(); i != e; ++i) {
+    const Outcome &any = i->second[0];
+    fprintf(out, "%s\n    { \"refid\": %d, \"inserts\": %llu, "
+            "\"checks\": %llu, \"regions\": %llu,\n      \"recommended\": ",
+            first ? "" : ",", i->first, (unsigned long long)any.inserts,
+            (unsigned long long)any.checks, (unsigned long long)any.regions);
+    size_t best = recommend(configs, i->second, O.maxFpr);
+    printChoice(out, configs[best], i->second[best], O.maxFpr);
+    fprintf(out, " }");
+    first = false;
+  }
+
+  size_t best = recommend(configs, total, O.maxFpr);
+  fprintf(out, "\n  ],\n  \"recommended\": ");
+  printChoice(out, configs[best], total[best], O.maxFpr);
+  fprintf(out, "\n}\n");
+
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}